@@ -5,29 +5,41 @@
 #include "api.h"
 
 void SpyL_initializeStandardLibrary(SpyState* S) {
-	Spy_pushC(S, "println", SpyL_println);
-	Spy_pushC(S, "print", SpyL_print);
-	Spy_pushC(S, "getline", SpyL_getline);
+	Spy_pushC(S, "println", SpyL_println, 0);
+	Spy_pushC(S, "print", SpyL_print, 0);
+	Spy_pushC(S, "getline", SpyL_getline, 1);
 
-	Spy_pushC(S, "fopen", SpyL_fopen);
-	Spy_pushC(S, "fclose", SpyL_fclose);
-	Spy_pushC(S, "fputc", SpyL_fputc);
-	Spy_pushC(S, "fputs", SpyL_fputs);
-	Spy_pushC(S, "fgetc", SpyL_fgetc);
-	Spy_pushC(S, "fread", SpyL_fread);
-	Spy_pushC(S, "ftell", SpyL_ftell);
-	Spy_pushC(S, "fseek", SpyL_fseek);
+	Spy_pushC(S, "fopen", SpyL_fopen, 1);
+	Spy_pushC(S, "fclose", SpyL_fclose, 0);
+	Spy_pushC(S, "fputc", SpyL_fputc, 0);
+	Spy_pushC(S, "fputs", SpyL_fputs, 0);
+	Spy_pushC(S, "fgetc", SpyL_fgetc, 1);
+	Spy_pushC(S, "fread", SpyL_fread, 0);
+	Spy_pushC(S, "ftell", SpyL_ftell, 1);
+	Spy_pushC(S, "fseek", SpyL_fseek, 0);
+	Spy_pushC(S, "fread_async", SpyL_freadAsync, 1);
+	Spy_pushC(S, "fwrite_async", SpyL_fwriteAsync, 1);
+	Spy_pushC(S, "io_done", SpyL_ioDone, 1);
+	Spy_pushC(S, "io_wait", SpyL_ioWait, 1);
 
-	Spy_pushC(S, "malloc", SpyL_malloc);
-	Spy_pushC(S, "free", SpyL_free);
-	Spy_pushC(S, "exit", SpyL_exit);
+	Spy_pushC(S, "malloc", SpyL_malloc, 1);
+	Spy_pushC(S, "free", SpyL_free, 0);
+	Spy_pushC(S, "arena_new", SpyL_arenaNew, 1);
+	Spy_pushC(S, "arena_alloc", SpyL_arenaAlloc, 1);
+	Spy_pushC(S, "arena_reset", SpyL_arenaReset, 0);
+	Spy_pushC(S, "arena_free", SpyL_arenaFree, 0);
+	Spy_pushC(S, "heap_report", SpyL_heapReport, 0);
+	Spy_pushC(S, "coroutine_done", SpyL_coroutineDone, 1);
+	Spy_pushC(S, "coroutine_free", SpyL_coroutineFree, 0);
+	Spy_pushC(S, "snapshot", SpyL_snapshot, 0);
+	Spy_pushC(S, "exit", SpyL_exit, 0);
 
-	Spy_pushC(S, "min", SpyL_min);
-	Spy_pushC(S, "max", SpyL_max);
-	Spy_pushC(S, "sqrt", SpyL_sqrt);
-	Spy_pushC(S, "sin", SpyL_sin);
-	Spy_pushC(S, "cos", SpyL_cos);
-	Spy_pushC(S, "tan", SpyL_tan);
+	Spy_pushC(S, "min", SpyL_min, 1);
+	Spy_pushC(S, "max", SpyL_max, 1);
+	Spy_pushC(S, "sqrt", SpyL_sqrt, 1);
+	Spy_pushC(S, "sin", SpyL_sin, 1);
+	Spy_pushC(S, "cos", SpyL_cos, 1);
+	Spy_pushC(S, "tan", SpyL_tan, 1);
 }
 
 static uint32_t
@@ -56,8 +68,10 @@ SpyL_tan(SpyState* S) {
 
 static uint32_t
 SpyL_println(SpyState* S) {
-	SpyL_print(S);
-	fputc('\n', stdout);
+	SpyL_format(S, Spy_popString(S));
+	*SpyL_room(S, 1) = '\n';
+	S->output_used++;
+	SpyL_flush(S);
 	return 0;
 }
 
@@ -66,6 +80,9 @@ SpyL_getline(SpyState* S) {
 	int64_t buf = Spy_popInt(S);
 	int64_t length = Spy_popInt(S);
 	int64_t slen;
+	if (S->output_flush == SPY_FLUSHLINES) {
+		Spy_flushOutput(S); /* a prompt without a newline */
+	}
 	fgets((char *)&S->memory[buf], length, stdin);
 	slen = strlen((char *)&S->memory[buf]);
 	S->memory[buf + slen - 1] = 0; /* remove newline */
@@ -73,45 +90,113 @@ SpyL_getline(SpyState* S) {
 	return 1;
 }
 
+/* note the format takes %s %d %x %p %f %c and the escapes \n \t \\ */
 static uint32_t
 SpyL_print(SpyState* S) {
-	const char* format = Spy_popString(S);
+	SpyL_format(S, Spy_popString(S));
+	SpyL_flush(S);
+	return 0;
+}
+
+/* formats straight into S's output buffer, see Spy_setOutput */
+static void
+SpyL_format(SpyState* S, const char* format) {
 	while (*format) {
-		switch (*format) {
-			case '%':
-				switch (*++format) {
-					case 's':
-						fputs(Spy_popString(S), stdout);
-						break;
-					case 'd':
-						printf("%lld", Spy_popInt(S));
-						break;
-					case 'x':
-						printf("%llX", Spy_popInt(S));
-						break;
-					case 'p':
-						printf("0x%lX", (uintptr_t)Spy_popPointer(S));
-						break;
-					case 'f':
-						printf("%f", Spy_popFloat(S));
-						break;
-					case 'c':
-						printf("%c", (char)Spy_popInt(S));
-						break;
+		size_t run = strcspn(format, "%\\");
+		if (run) {
+			Spy_write(S, format, run);
+			format += run;
+			continue;
+		}
+		char* to = SpyL_room(S, 32); /* any number but %f fits */
+		size_t length = 0;
+		if (*format++ == '%') {
+			switch (*format) {
+				case 's': {
+					const char* string = Spy_popString(S);
+					Spy_write(S, string, strlen(string));
+					break;
 				}
-				break;
-			case '\\':
-				switch (*++format) {
-					case 'n': fputc('\n', stdout); break;
-					case 't': fputc('\t', stdout); break;
-					case '\\': fputc('\\', stdout); break;
+				case 'd':
+					length = SpyL_decimal(to, Spy_popInt(S));
+					break;
+				case 'x':
+					length = SpyL_hex(to, Spy_popInt(S));
+					break;
+				case 'p':
+					to[0] = '0';
+					to[1] = 'x';
+					length = 2 + SpyL_hex(to + 2, (uintptr_t)Spy_popPointer(S));
+					break;
+				case 'f': {
+					double value = Spy_popFloat(S);
+					length = snprintf(to, 32, "%f", value);
+					if (length >= 32) {
+						to = SpyL_room(S, length + 1);
+						snprintf(to, length + 1, "%f", value);
+					}
+					break;
 				}
-			default:
-				fputc(*format, stdout);
+				case 'c':
+					to[length++] = (char)Spy_popInt(S);
+					break;
+			}
+		} else {
+			switch (*format) {
+				case 'n': to[length++] = '\n'; break;
+				case 't': to[length++] = '\t'; break;
+				case '\\': to[length++] = '\\'; break;
+				default: if (*format) to[length++] = *format;
+			}
 		}
-		format++;
+		S->output_used += length;
+		if (*format) format++;
 	}
-	return 0;
+}
+
+/* what print and println do after every call, see SPY_FLUSHFULL */
+static void
+SpyL_flush(SpyState* S) {
+	if (S->output_flush == SPY_FLUSHCALLS ||
+		(S->output_flush == SPY_FLUSHLINES && memchr(S->output_buffer, '\n', S->output_used))) {
+		Spy_flushOutput(S);
+	}
+}
+
+/* where 'bytes' more fit in S's output buffer, at most SIZE_MINOUTPUT */
+static char*
+SpyL_room(SpyState* S, size_t bytes) {
+	if (S->output_used + bytes > S->output_size) {
+		Spy_flushOutput(S);
+	}
+	return &S->output_buffer[S->output_used];
+}
+
+static size_t
+SpyL_decimal(char* to, int64_t value) {
+	char digits[20];
+	uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+	size_t n = 0, length = 0;
+	do {
+		digits[n++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude);
+	if (value < 0) to[length++] = '-';
+	while (n) to[length++] = digits[--n];
+	return length;
+}
+
+/* upper case, like %llX */
+static size_t
+SpyL_hex(char* to, uint64_t value) {
+	char digits[16];
+	size_t n = 0, length = 0;
+	do {
+		digits[n++] = "0123456789ABCDEF"[value & 15];
+		value >>= 4;
+	} while (value);
+	while (n) to[length++] = digits[--n];
+	return length;
 }
 
 static uint32_t
@@ -184,89 +269,113 @@ SpyL_fseek(SpyState* S) {
 	return 0;
 }
 
-uint32_t
+/* note called as fread_async(FILE*, void*, int bytes, int offset), returns
+ * a handle for io_done and io_wait, see io.c */
+static uint32_t
+SpyL_freadAsync(SpyState* S) {
+	FILE* f = (FILE *)Spy_popPointer(S);
+	uint64_t dest = Spy_popInt(S);
+	uint64_t bytes = Spy_popInt(S);
+	int64_t offset = Spy_popInt(S);
+	Spy_pushInt(S, Spy_ioSubmit(S, f, 0, dest, bytes, offset));
+	return 1;
+}
+
+/* note called as fwrite_async(FILE*, void*, int bytes, int offset) */
+static uint32_t
+SpyL_fwriteAsync(SpyState* S) {
+	FILE* f = (FILE *)Spy_popPointer(S);
+	uint64_t src = Spy_popInt(S);
+	uint64_t bytes = Spy_popInt(S);
+	int64_t offset = Spy_popInt(S);
+	Spy_pushInt(S, Spy_ioSubmit(S, f, 1, src, bytes, offset));
+	return 1;
+}
+
+/* note 1 once the transfer is done, io_wait still has to release it */
+static uint32_t
+SpyL_ioDone(SpyState* S) {
+	Spy_pushInt(S, Spy_ioDone(S, Spy_popInt(S)));
+	return 1;
+}
+
+/* note returns the bytes moved, -1 on error */
+static uint32_t
+SpyL_ioWait(SpyState* S) {
+	Spy_pushInt(S, Spy_ioWait(S, Spy_popInt(S)));
+	return 1;
+}
+
+static uint32_t
 SpyL_malloc(SpyState* S) {
-	SpyMemoryChunk* chunk = (SpyMemoryChunk *)malloc(sizeof(SpyMemoryChunk));
-	if (!chunk) Spy_crash(S, "Out of memory\n");
-	int64_t size = Spy_popInt(S);
-
-	/* round chunk->size up to nearest SIZE_PAGE multiple */
-	if (size == 0) chunk->pages = 1;
-	else if (size % SIZE_PAGE > 0) {
-		chunk->pages = (size + (SIZE_PAGE - (size % SIZE_PAGE))) / SIZE_PAGE;
-	} else {
-		chunk->pages = size / SIZE_PAGE;	
-	}
-	
-	/* find an open memory slot */
-	if (!S->memory_chunks) {
-		S->memory_chunks = chunk;
-		chunk->next = NULL;
-		chunk->prev = NULL;
-		chunk->absolute_address = &S->memory[START_HEAP];
-		chunk->vm_address = START_HEAP;
-	} else {
-		SpyMemoryChunk* at = S->memory_chunks;
-		uint8_t found_slot = 0;
-		while (at->next) {
-			uint64_t offset = at->pages * SIZE_PAGE;
-			uint8_t* abs_addr = at->absolute_address + offset;
-			uint64_t page_distance = (at->next->absolute_address - abs_addr) / SIZE_PAGE;
-			if (page_distance >= chunk->pages) {
-				chunk->absolute_address = abs_addr;
-				chunk->vm_address = at->vm_address + offset;
-				chunk->next = at->next;
-				chunk->prev = at;
-				at->next->prev = chunk;
-				at->next = chunk;
-				found_slot = 1;
-				break;
-			}
-			at = at->next;
-		}
-		if (!found_slot) {
-			chunk->absolute_address = at->absolute_address + at->pages * SIZE_PAGE;
-			chunk->vm_address = at->vm_address + at->pages * SIZE_PAGE;
-			chunk->next = NULL;
-			chunk->prev = at;
-			at->next = chunk;
-		}
-	}
+	Spy_pushInt(S, Spy_heapAlloc(S, Spy_popInt(S)));
+	return 1;
+}
+
+static uint32_t
+SpyL_free(SpyState* S) {
+	Spy_heapFree(S, Spy_popInt(S));
+	return 0;
+}
+
+/* note called as arena_new(int size), see Spy_arenaNew */
+static uint32_t
+SpyL_arenaNew(SpyState* S) {
+	Spy_pushInt(S, Spy_arenaNew(S, Spy_popInt(S)));
+	return 1;
+}
 
-	Spy_pushInt(S, chunk->vm_address <= (START_HEAP + SIZE_MEMORY) ? chunk->vm_address : 0);
+/* note called as arena_alloc(arena, int size) */
+static uint32_t
+SpyL_arenaAlloc(SpyState* S) {
+	uint64_t arena = Spy_popInt(S);
+	uint64_t size = Spy_popInt(S);
+	Spy_pushInt(S, Spy_arenaAlloc(S, arena, size));
+	return 1;
+}
 
+static uint32_t
+SpyL_arenaReset(SpyState* S) {
+	Spy_arenaReset(S, Spy_popInt(S));
 	return 0;
 }
 
 static uint32_t
-SpyL_free(SpyState* S) {
-	static const char* errmsg = "Attempt to free an invalid pointer (0x%x)";
-	uint8_t success = 0;
-	uint64_t vm_address = Spy_popInt(S);
-	SpyMemoryChunk* at = S->memory_chunks;
-	if (!at) Spy_crash(S, errmsg, vm_address);
-	while (at) {
-		if (at->vm_address == vm_address) {
-			if (at->next) {
-				at->prev->next = at->next;
-				at->next->prev = at->prev;
-			} else {
-				at->prev->next = NULL;
-			}
-			free(at);
-			success = 1;
-		}
-		at = at->next; 
-	}
-	if (!success) {
-		Spy_crash(S, errmsg, vm_address);
-	}
+SpyL_arenaFree(SpyState* S) {
+	Spy_arenaFree(S, Spy_popInt(S));
+	return 0;
+}
+
+/* note 1 once the coroutine's function returned, see coroutine.c */
+static uint32_t
+SpyL_coroutineDone(SpyState* S) {
+	Spy_pushInt(S, Spy_coroutine(S, Spy_popInt(S))->status == COROUTINE_DEAD);
+	return 1;
+}
+
+static uint32_t
+SpyL_coroutineFree(SpyState* S) {
+	Spy_freeCoroutine(S, Spy_popInt(S));
+	return 0;
+}
+
+/* note prints the same report as -m, see Spy_heapReport */
+static uint32_t
+SpyL_heapReport(SpyState* S) {
+	Spy_heapReport(S);
+	return 0;
+}
+
+/* note does nothing unless the program runs with SPY_SNAPSHOT, see snapshot.c */
+static uint32_t
+SpyL_snapshot(SpyState* S) {
+	Spy_saveSnapshot(S);
 	return 0;
 }
 
 static uint32_t
 SpyL_exit(SpyState* S) {
-	exit(0);
+	Spy_exit(S, 0);
 	return 0;
 }
 
@@ -2,6 +2,10 @@
 #define API_H
 
 #include "spyre.h"
+#include "heap.h"
+#include "snapshot.h"
+#include "coroutine.h"
+#include "io.h"
 
 void SpyL_initializeStandardLibrary(SpyState*);
 
@@ -9,6 +13,11 @@ void SpyL_initializeStandardLibrary(SpyState*);
 static uint32_t SpyL_println(SpyState*);
 static uint32_t SpyL_print(SpyState*);
 static uint32_t SpyL_getline(SpyState*);
+static void SpyL_format(SpyState*, const char*);
+static void SpyL_flush(SpyState*);
+static char* SpyL_room(SpyState*, size_t);
+static size_t SpyL_decimal(char*, int64_t);
+static size_t SpyL_hex(char*, uint64_t);
 
 /* file system */
 static uint32_t SpyL_fopen(SpyState*);
@@ -20,10 +29,22 @@ static uint32_t SpyL_fgetc(SpyState*);
 static uint32_t SpyL_fread(SpyState*);
 static uint32_t SpyL_ftell(SpyState*);
 static uint32_t SpyL_fseek(SpyState*);
+static uint32_t SpyL_freadAsync(SpyState*);
+static uint32_t SpyL_fwriteAsync(SpyState*);
+static uint32_t SpyL_ioDone(SpyState*);
+static uint32_t SpyL_ioWait(SpyState*);
 
 /* memory management */
-uint32_t		SpyL_malloc(SpyState*); /* expose to spyre.c */
+static uint32_t SpyL_malloc(SpyState*);
 static uint32_t SpyL_free(SpyState*);
+static uint32_t SpyL_arenaNew(SpyState*);
+static uint32_t SpyL_arenaAlloc(SpyState*);
+static uint32_t SpyL_arenaReset(SpyState*);
+static uint32_t SpyL_arenaFree(SpyState*);
+static uint32_t SpyL_heapReport(SpyState*);
+static uint32_t SpyL_coroutineDone(SpyState*);
+static uint32_t SpyL_coroutineFree(SpyState*);
+static uint32_t SpyL_snapshot(SpyState*);
 static uint32_t	SpyL_exit(SpyState*);
 
 /* math */
@@ -2,84 +2,117 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include "spyre.h"
 #include "assembler.h"
 
-const AssemblerInstruction instructions[0xFF] = {
-	{"NOOP",	0x00, {NO_OPERAND}},
-	{"IPUSH",	0x01, {_INT64}},
-	{"IADD",	0x02, {NO_OPERAND}},
-	{"ISUB",	0x03, {NO_OPERAND}},
-	{"IMUL",	0x04, {NO_OPERAND}},
-	{"IDIV",	0x05, {NO_OPERAND}},
-	{"MOD",		0x06, {NO_OPERAND}},
-	{"SHL",		0x07, {NO_OPERAND}},
-	{"SHR",		0x08, {NO_OPERAND}},
-	{"AND",		0x09, {NO_OPERAND}},
-	{"OR",		0x0A, {NO_OPERAND}},
-	{"XOR",		0x0B, {NO_OPERAND}},
-	{"NOT",		0x0C, {NO_OPERAND}},
-	{"NEG",		0x0D, {NO_OPERAND}},
-	{"IGT",		0x0E, {NO_OPERAND}},
-	{"IGE",		0x0F, {NO_OPERAND}},
-	{"ILT",		0x10, {NO_OPERAND}},
-	{"ILE",		0x11, {NO_OPERAND}},
-	{"ICMP",	0x12, {NO_OPERAND}},
-	{"JNZ",		0x13, {_INT32}},
-	{"JZ",		0x14, {_INT32}},
-	{"JMP",		0x15, {_INT32}},
-	{"CALL",	0x16, {_INT32, _INT32}},
-	{"IRET",	0x17, {NO_OPERAND}},
-	{"CCALL",	0x18, {_INT32, _INT32}},
-	{"FPUSH",	0x19, {_FLOAT64}},
-	{"FADD",	0x1A, {NO_OPERAND}},
-	{"FSUB",	0x1B, {NO_OPERAND}},
-	{"FMUL",	0x1C, {NO_OPERAND}},
-	{"FDIV",	0x1D, {NO_OPERAND}},
-	{"FGT",		0x1E, {NO_OPERAND}},
-	{"FGE",		0x1F, {NO_OPERAND}},
-	{"FLT",		0x20, {NO_OPERAND}},
-	{"FLE",		0x21, {NO_OPERAND}},
-	{"FCMP",	0x22, {NO_OPERAND}},
-	{"FRET",	0x23, {NO_OPERAND}},
-	{"ILLOAD",	0x24, {_INT32}},
-	{"ILSAVE",	0x25, {_INT32}},
-	{"IARG",	0x26, {_INT32}},
-	{"ILOAD",	0x27, {NO_OPERAND}},
-	{"ISAVE",	0x28, {NO_OPERAND}},
-	{"RES",		0x29, {_INT32}},
-	{"LEA",		0x2A, {_INT32}},
-	{"IDER",	0x2B, {NO_OPERAND}},
-	{"ICINC",	0x2C, {_INT64}},
-	{"CDER",	0x2D, {NO_OPERAND}},
-	{"LOR",		0x2E, {NO_OPERAND}},
-	{"LAND",	0x2F, {NO_OPERAND}},
-	{"PADD",	0x30, {NO_OPERAND}},
-	{"PSUB",	0x31, {NO_OPERAND}},
-	{"LOG",		0x32, {_INT32}},
-	{"VRET",	0x33, {NO_OPERAND}},
-	{"DBON",	0x34, {NO_OPERAND}},
-	{"DBOFF",	0x35, {NO_OPERAND}},
-	{"DBDS",	0x36, {NO_OPERAND}},
-	{"CJNZ",	0x37, {NO_OPERAND}},
-	{"CJZ",		0x38, {NO_OPERAND}},
-	{"CJMP",	0x39, {NO_OPERAND}},
-	{"ILNSAVE",	0x3A, {_INT32, _INT32}},
-	{"ILNLOAD",	0x3B, {_INT32, _INT32}},
-	{"FLLOAD",	0x3C, {_INT32}},
-	{"FLSAVE",	0x3D, {_INT32}},
-	{"FTOI",	0x3E, {_INT32}},
-	{"ITOF",	0x3F, {_INT32}},
-	{"FDER",	0x40, {NO_OPERAND}},
-	{"FSAVE",	0x41, {NO_OPERAND}},
-	{"LNOT",	0x42, {NO_OPERAND}}
+const AssemblerInstruction instructions[SPY_OPCODES] = {
+	{"NOOP",	0x00, {NO_OPERAND}, 0, 0},
+	{"IPUSH",	0x01, {_INT64}, 0, 1},
+	{"IADD",	0x02, {NO_OPERAND}, 2, 1},
+	{"ISUB",	0x03, {NO_OPERAND}, 2, 1},
+	{"IMUL",	0x04, {NO_OPERAND}, 2, 1},
+	{"IDIV",	0x05, {NO_OPERAND}, 2, 1},
+	{"MOD",		0x06, {NO_OPERAND}, 2, 1},
+	{"SHL",		0x07, {NO_OPERAND}, 2, 1},
+	{"SHR",		0x08, {NO_OPERAND}, 2, 1},
+	{"AND",		0x09, {NO_OPERAND}, 2, 1},
+	{"OR",		0x0A, {NO_OPERAND}, 2, 1},
+	{"XOR",		0x0B, {NO_OPERAND}, 2, 1},
+	{"NOT",		0x0C, {NO_OPERAND}, 1, 1},
+	{"NEG",		0x0D, {NO_OPERAND}, 1, 1},
+	{"IGT",		0x0E, {NO_OPERAND}, 2, 1},
+	{"IGE",		0x0F, {NO_OPERAND}, 2, 1},
+	{"ILT",		0x10, {NO_OPERAND}, 2, 1},
+	{"ILE",		0x11, {NO_OPERAND}, 2, 1},
+	{"ICMP",	0x12, {NO_OPERAND}, 2, 1},
+	{"JNZ",		0x13, {_ADDR32}, 1, 0},
+	{"JZ",		0x14, {_ADDR32}, 1, 0},
+	{"JMP",		0x15, {_ADDR32}, 0, 0},
+	{"CALL",	0x16, {_ADDR32, _INT32}, VARIES, VARIES},
+	{"IRET",	0x17, {NO_OPERAND}, 1, 0},
+	{"CCALL",	0x18, {_INT32, _INT32}, VARIES, VARIES},
+	{"FPUSH",	0x19, {_FLOAT64}, 0, 1},
+	{"FADD",	0x1A, {NO_OPERAND}, 2, 1},
+	{"FSUB",	0x1B, {NO_OPERAND}, 2, 1},
+	{"FMUL",	0x1C, {NO_OPERAND}, 2, 1},
+	{"FDIV",	0x1D, {NO_OPERAND}, 2, 1},
+	{"FGT",		0x1E, {NO_OPERAND}, 2, 1},
+	{"FGE",		0x1F, {NO_OPERAND}, 2, 1},
+	{"FLT",		0x20, {NO_OPERAND}, 2, 1},
+	{"FLE",		0x21, {NO_OPERAND}, 2, 1},
+	{"FCMP",	0x22, {NO_OPERAND}, 2, 1},
+	{"FRET",	0x23, {NO_OPERAND}, 1, 0},
+	{"ILLOAD",	0x24, {_INT32}, 0, 1},
+	{"ILSAVE",	0x25, {_INT32}, 1, 0},
+	{"IARG",	0x26, {_INT32}, 0, 1},
+	{"ILOAD",	0x27, {NO_OPERAND}, 1, 1},
+	{"ISAVE",	0x28, {NO_OPERAND}, 2, 0},
+	{"RES",		0x29, {_INT32}, VARIES, VARIES},
+	{"LEA",		0x2A, {_INT32}, 0, 1},
+	{"IDER",	0x2B, {NO_OPERAND}, 1, 1},
+	{"ICINC",	0x2C, {_INT64}, 1, 1},
+	{"CDER",	0x2D, {NO_OPERAND}, 1, 1},
+	{"LOR",		0x2E, {NO_OPERAND}, 2, 1},
+	{"LAND",	0x2F, {NO_OPERAND}, 2, 1},
+	{"PADD",	0x30, {NO_OPERAND}, 2, 1},
+	{"PSUB",	0x31, {NO_OPERAND}, 2, 1},
+	{"LOG",		0x32, {_INT32}, 0, 0},
+	{"VRET",	0x33, {NO_OPERAND}, 0, 0},
+	{"DBON",	0x34, {NO_OPERAND}, 0, 0},
+	{"DBOFF",	0x35, {NO_OPERAND}, 0, 0},
+	{"DBDS",	0x36, {NO_OPERAND}, 0, 0},
+	{"CJNZ",	0x37, {NO_OPERAND}, 2, 0},
+	{"CJZ",		0x38, {NO_OPERAND}, 2, 0},
+	{"CJMP",	0x39, {NO_OPERAND}, 1, 0},
+	{"ILNSAVE",	0x3A, {_INT32, _INT32}, VARIES, VARIES},
+	{"ILNLOAD",	0x3B, {_INT32, _INT32}, VARIES, VARIES},
+	{"FLLOAD",	0x3C, {_INT32}, 0, 1},
+	{"FLSAVE",	0x3D, {_INT32}, 1, 0},
+	{"FTOI",	0x3E, {_INT32}, 0, 0},
+	{"ITOF",	0x3F, {_INT32}, 0, 0},
+	{"FDER",	0x40, {NO_OPERAND}, 1, 1},
+	{"FSAVE",	0x41, {NO_OPERAND}, 2, 0},
+	{"LNOT",	0x42, {NO_OPERAND}, 1, 1},
+	{"NCALL",	0x43, {_INT32, _INT32}, VARIES, VARIES}, /* CCALL bound at load time, not emitted by the assembler */
+
+	/* superinstructions, see fusions[] */
+	{"ILINC",	0x44, {_INT32, _INT64}, 0, 0},
+	{"ILCINC",	0x45, {_INT32, _INT64}, 0, 1},
+	{"ILLTJZ",	0x46, {_INT32, _INT32, _ADDR32}, 0, 0},
+	{"ILCLTJZ",	0x47, {_INT32, _INT64, _ADDR32}, 0, 0},
+
+	/* coroutines, see coroutine.c */
+	{"CONEW",	0x48, {_ADDR32}, 1, 1},
+	{"RESUME",	0x49, {NO_OPERAND}, 2, 1},
+	{"YIELD",	0x4A, {NO_OPERAND}, 1, 1}
+};
+
+/* tried in order at every instruction, so longer patterns come first */
+static const AssemblerFusion fusions[] = {
+	{"ILINC",	{"LEA $0", "ILLOAD $0", "IPUSH $1", "IADD", "ISAVE"}},
+	{"ILINC",	{"ILLOAD $0", "IPUSH $1", "IADD", "ILSAVE $0"}},
+	{"ILLTJZ",	{"ILLOAD $0", "ILLOAD $1", "ILT", "JZ $2"}},
+	{"ILCLTJZ",	{"ILLOAD $0", "IPUSH $1", "ILT", "JZ $2"}},
+	{"ILCINC",	{"ILLOAD $0", "IPUSH $1", "IADD"}}
 };
 
+#define NUM_FUSIONS (sizeof(fusions) / sizeof(fusions[0]))
+
 void
 Assembler_generateBytecodeFile(const char* in_file_name) {
 	Assembler A;
 	A.labels = NULL;
 	A.tokens = NULL;
 	A.constants = NULL;
+	A.lines = NULL;
+	A.lines_size = 0;
+	A.lines_capacity = 0;
+	A.line_offset = 0;
+	A.line_number = 0;
+	A.line_file = UINT32_MAX;
+	A.files = NULL;
+	A.nfiles = 0;
+	A.fusion_hits = (unsigned int *)calloc(NUM_FUSIONS, sizeof(unsigned int));
 
 	AssemblerFile input;
 	input.handle = fopen(in_file_name, "rb");
@@ -109,6 +142,14 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 	output.length = 0;
 	output.contents = NULL;
 
+	/* line markers without a file name refer to the .spy the .spys was
+	 * compiled from */
+	char* source_name = (char *)malloc(name_len + 1);
+	strcpy(source_name, in_file_name);
+	if (name_len > 5 && !strcmp(&source_name[name_len - 5], ".spys")) {
+		source_name[name_len - 1] = 0;
+	}
+
 	AssemblerFile tmp_output;
 	if (!output.handle) {
 		Assembler_die(&A, "Couldn't open tmp file for writing");
@@ -124,6 +165,10 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 	
 	if (!(A.tokens = head = AsmLexer_convertToAssemblerTokens(input.contents))) goto done;
 
+	/* pass zero, replace common sequences with superinstructions */
+	Assembler_fuseInstructions(&A);
+	head = A.tokens;
+
 	/* pass one, find all labels */
 	while (A.tokens && A.tokens->next) {
 		if (A.tokens->type == IDENTIFIER) {
@@ -168,6 +213,7 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 					index += (
 						ins->operands[i] == _INT64 ? 8 :
 						ins->operands[i] == _INT32 ? 4 : 
+						ins->operands[i] == _ADDR32 ? 4 :
 						ins->operands[i] == _FLOAT64 ? 8 : 0
 					);
 				}
@@ -223,6 +269,13 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 				} else if (!(ins = Assembler_validateInstruction(&A, A.tokens->word))) {
 					Assembler_die(&A, "unknown instruction '%s'", A.tokens->word);
 				}
+				/* hand written assembly is its own source */
+				if (A.tokens->source_line) {
+					Assembler_addLine(&A, ftell(tmp_output.handle) - rom_size,
+						A.tokens->source_file ? A.tokens->source_file : source_name, A.tokens->source_line);
+				} else {
+					Assembler_addLine(&A, ftell(tmp_output.handle) - rom_size, in_file_name, A.tokens->line);
+				}
 				fputc(ins->opcode, tmp_output.handle);
 				/* go through the operands */
 				for (int i = 0; i < 4; i++) {
@@ -242,6 +295,7 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 							break;
 						}
 						case _INT32:
+						case _ADDR32:
 						{
 							uint64_t n = A.tokens->word[1] == 'x' ? strtoll(&A.tokens->word[2], NULL, 16) : strtol(A.tokens->word, NULL, 10);
 							fwrite(&n, 1, 4, tmp_output.handle);
@@ -272,13 +326,14 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 	/* close temporary write file and open for reading */
 	AssemblerFile tmp_input;	
 	fclose(tmp_output.handle);
+	tmp_output.handle = NULL;
 	tmp_input.handle = fopen(TMPFILE_NAME, "rb");
 	/* N/A */
 	tmp_input.length = 0;
 	tmp_input.contents = NULL;
 
 	/* write the headers for the output file */
-	const uint32_t magic = 0x5950535F;
+	const uint32_t magic = SPY_MAGIC;
 	const uint32_t rom = sizeof(uint32_t) * 2;
 	const uint32_t code = sizeof(uint32_t) * 3 + rom_size;
 	fwrite(&magic, sizeof(uint32_t), 1, output.handle);
@@ -286,10 +341,37 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 	fwrite(&code, sizeof(uint32_t), 1, output.handle);
 
 	/* copy temporary file into output file */
-	char c;
+	int c;
 	while ((c = fgetc(tmp_input.handle)) != EOF) {
 		fputc(c, output.handle);
 	}
+	fclose(tmp_input.handle);
+
+	/* function names for profiles and crash reports, see Spy_loadSections */
+	const uint32_t symbols = ftell(output.handle);
+	const uint32_t symbol_magic = SPY_SYMBOLMAGIC;
+	uint32_t symbol_count = 0;
+	for (const AssemblerLabel* i = A.labels; i; i = i->next) {
+		if (!strncmp(i->identifier, FUNCTION_PREFIX, strlen(FUNCTION_PREFIX))) {
+			const char* name = i->identifier + strlen(FUNCTION_PREFIX);
+			fwrite(&i->index, sizeof(uint32_t), 1, output.handle);
+			fwrite(name, 1, strlen(name) + 1, output.handle);
+			symbol_count++;
+		}
+	}
+	fwrite(&symbol_count, sizeof(uint32_t), 1, output.handle);
+	fwrite(&symbols, sizeof(uint32_t), 1, output.handle);
+	fwrite(&symbol_magic, sizeof(uint32_t), 1, output.handle);
+	Assembler_writeLines(&A, output.handle);
+
+	/* report how often each superinstruction was used */
+	for (int i = 0; i < NUM_FUSIONS; i++) {
+		printf("fused %6u %-8s <-", A.fusion_hits[i], fusions[i].name);
+		for (int j = 0; fusions[i].pattern[j]; j++) {
+			printf(" %s;", fusions[i].pattern[j]);
+		}
+		fputc('\n', stdout);
+	}
 
 	done:
 	if (tmp_output.handle) {
@@ -351,10 +433,184 @@ Assembler_appendConstant(Assembler* A, const char* identifier, uint32_t index) {
 	}
 }
 
+/* a token from the same place in the source as 'from' */
+static AssemblerToken*
+Assembler_newToken(const char* word, AssemblerTokenType type, const AssemblerToken* from) {
+	AssemblerToken* token = (AssemblerToken *)malloc(sizeof(AssemblerToken));
+	size_t length = strlen(word);
+	token->word = (char *)malloc(length + 1);
+	strcpy(token->word, word);
+	token->line = from->line;
+	token->source_file = from->source_file;
+	token->source_line = from->source_line;
+	token->type = type;
+	token->next = NULL;
+	token->prev = NULL;
+	return token;
+}
+
+/* the line table maps code offsets to source lines.  a row is added
+ * whenever the file or line changes, encoded relative to the row before
+ * it (which starts out as offset 0, line 0, file 0):
+ *
+ *	varint (offset delta << 1 | file changed)
+ *	varint file index, only if it changed
+ *	varint line delta, zigzag encoded
+ *
+ * varints are 7 bits per byte, least significant first, with the high
+ * bit set on every byte but the last.  the section written after the
+ * symbol table is
+ *
+ *	uint32 file count  {name NUL}*  rows  uint32 start  uint32 SPY_LINEMAGIC
+ *
+ * see Spy_loadSections and Spy_locate */
+static void
+Assembler_addLine(Assembler* A, uint32_t offset, const char* file, uint32_t line) {
+	uint32_t index;
+	for (index = 0; index < A->nfiles; index++) {
+		if (!strcmp(A->files[index], file)) break;
+	}
+	if (index == A->nfiles) {
+		A->files = (char **)realloc(A->files, (A->nfiles + 1) * sizeof(char *));
+		A->files[A->nfiles] = (char *)malloc(strlen(file) + 1);
+		strcpy(A->files[A->nfiles++], file);
+	}
+	if (index == A->line_file && line == A->line_number) return;
+	int32_t delta = (int32_t)(line - A->line_number);
+	Assembler_emitVarint(A, (offset - A->line_offset) << 1 | (index != A->line_file));
+	if (index != A->line_file) {
+		Assembler_emitVarint(A, index);
+	}
+	Assembler_emitVarint(A, (uint32_t)(delta << 1) ^ (uint32_t)(delta >> 31));
+	A->line_offset = offset;
+	A->line_number = line;
+	A->line_file = index;
+}
+
+static void
+Assembler_emitVarint(Assembler* A, uint32_t value) {
+	do {
+		if (A->lines_size == A->lines_capacity) {
+			A->lines_capacity = A->lines_capacity ? A->lines_capacity * 2 : 256;
+			A->lines = (uint8_t *)realloc(A->lines, A->lines_capacity);
+		}
+		A->lines[A->lines_size++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+		value >>= 7;
+	} while (value);
+}
+
+static void
+Assembler_writeLines(Assembler* A, FILE* handle) {
+	const uint32_t start = ftell(handle);
+	const uint32_t magic = SPY_LINEMAGIC;
+	fwrite(&A->nfiles, sizeof(uint32_t), 1, handle);
+	for (uint32_t i = 0; i < A->nfiles; i++) {
+		fwrite(A->files[i], 1, strlen(A->files[i]) + 1, handle);
+	}
+	fwrite(A->lines, 1, A->lines_size, handle);
+	fwrite(&start, sizeof(uint32_t), 1, handle);
+	fwrite(&magic, sizeof(uint32_t), 1, handle);
+}
+
+/* tries to match the fusion's pattern starting at 'at'.  on success
+ * returns 1, stores the token after the sequence in 'after' and the
+ * operand tokens of the superinstruction in 'operands' */
+static int
+Assembler_matchFusion(Assembler* A, const AssemblerFusion* fusion, AssemblerToken* at, AssemblerToken** operands, AssemblerToken** after) {
+	for (int i = 0; i < 4; i++) {
+		operands[i] = NULL;
+	}
+	for (int i = 0; fusion->pattern[i]; i++) {
+		char mnemonic[16];
+		const char* binding;
+		const AssemblerInstruction* ins;
+		size_t len;
+		if (!at || at->type != IDENTIFIER) return 0;
+		binding = strchr(fusion->pattern[i], '$');
+		len = binding ? (size_t)(binding - fusion->pattern[i] - 1) : strlen(fusion->pattern[i]);
+		memcpy(mnemonic, fusion->pattern[i], len);
+		mnemonic[len] = 0;
+		if (strcmp_lower(mnemonic, at->word)) return 0;
+		ins = Assembler_validateInstruction(A, at->word);
+		at = at->next;
+		/* every pattern instruction has at most one operand */
+		if (ins->operands[0] != NO_OPERAND) {
+			if (!at || ins->operands[1] != NO_OPERAND) return 0;
+			if (binding) {
+				AssemblerToken** bound = &operands[binding[1] - '0'];
+				if (*bound && strcmp((*bound)->word, at->word)) return 0;
+				*bound = at;
+			}
+			at = at->next;
+		}
+	}
+	*after = at;
+	return 1;
+}
+
+/* rewrites matching instruction sequences into superinstructions, see
+ * fusions[].  labels break sequences, so jumps into them stay valid */
+static void
+Assembler_fuseInstructions(Assembler* A) {
+	AssemblerToken* head = A->tokens;
+	AssemblerToken* at = head;
+	while (at) {
+		AssemblerToken* operands[4];
+		AssemblerToken* after = NULL;
+		int matched;
+		for (matched = 0; matched < NUM_FUSIONS; matched++) {
+			if (Assembler_matchFusion(A, &fusions[matched], at, operands, &after)) break;
+		}
+		if (matched == NUM_FUSIONS) {
+			/* skip over let constant literals, they are never instructions */
+			if (at->type == IDENTIFIER && !strcmp_lower(at->word, "let") && at->next) {
+				at = at->next;
+			}
+			at = at->next;
+			continue;
+		}
+		A->fusion_hits[matched]++;
+
+		/* build the superinstruction */
+		AssemblerToken* fused = Assembler_newToken(fusions[matched].name, IDENTIFIER, at);
+		AssemblerToken* tail = fused;
+		for (int i = 0; i < 4 && operands[i]; i++) {
+			if (i > 0) {
+				tail->next = Assembler_newToken(",", PUNCT, at);
+				tail->next->prev = tail;
+				tail = tail->next;
+			}
+			tail->next = Assembler_newToken(operands[i]->word, operands[i]->type, at);
+			tail->next->prev = tail;
+			tail = tail->next;
+		}
+
+		/* splice it in place of the sequence */
+		fused->prev = at->prev;
+		if (at->prev) {
+			at->prev->next = fused;
+		} else {
+			head = fused;
+		}
+		tail->next = after;
+		if (after) {
+			after->prev = tail;
+		}
+		while (at != after) {
+			AssemblerToken* next = at->next;
+			free(at->word);
+			free(at);
+			at = next;
+		}
+		at = after;
+	}
+	A->tokens = head;
+}
+
 /* 0 = not valid, 1 = valid */
 static const AssemblerInstruction*
 Assembler_validateInstruction(Assembler* A, const char* instruction) {
-	for (int i = 0; i <= 0x42; i++) {
+	for (int i = 0; instructions[i].name; i++) {
 		if (!strcmp_lower(instructions[i].name, instruction)) {
 			return &instructions[i];	
 		};
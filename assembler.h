@@ -3,28 +3,41 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include "spyre.h"
 #include "assembler_lex.h"
 
 #define TMPFILE_NAME ".SPYRE_TEMP_FILE"
+#define FUNCTION_PREFIX "__FUNC__" /* labels that name a function, see generate.c */
 
 typedef struct Assembler Assembler;
 typedef struct AssemblerFile AssemblerFile;
 typedef struct AssemblerLabel AssemblerLabel;
 typedef struct AssemblerConstant AssemblerConstant;
 typedef struct AssemblerInstruction AssemblerInstruction;
+typedef struct AssemblerFusion AssemblerFusion;
 typedef enum AssemblerOperand AssemblerOperand;
 
 enum AssemblerOperand {
 	NO_OPERAND = 0,
 	_INT64,
 	_INT32,
-	_FLOAT64
+	_FLOAT64,
+	_ADDR32 /* code address, same encoding as _INT32 */
 };
 
 struct Assembler {
 	AssemblerToken*		tokens;
 	AssemblerLabel*		labels;
 	AssemblerConstant*	constants;
+	unsigned int*		fusion_hits; /* one counter per entry in fusions[] */
+	uint8_t*			lines; /* line table rows, see Assembler_addLine */
+	size_t				lines_size;
+	size_t				lines_capacity;
+	uint32_t			line_offset; /* the last row */
+	uint32_t			line_number;
+	uint32_t			line_file;
+	char**				files; /* source file names the rows refer to */
+	uint32_t			nfiles;
 };
 
 struct AssemblerFile {
@@ -45,19 +58,39 @@ struct AssemblerConstant {
 	AssemblerConstant*	next;
 };
 
+/* stack effect of an instruction whose pops or pushes depend on its
+ * operands or on the function it calls, see Spy_verify */
+#define VARIES -1
+
 struct AssemblerInstruction {
 	char*				name;
 	uint8_t				opcode;
 	AssemblerOperand	operands[4];
+	int8_t				pops; /* stack slots consumed */
+	int8_t				pushes; /* stack slots produced */
+};
+
+/* a sequence of instructions that the assembler replaces with a single
+ * superinstruction.  pattern operands are written as $n, the n-th operand
+ * of the superinstruction.  a $n that appears twice must match twice */
+struct AssemblerFusion {
+	const char*			name;
+	const char*			pattern[8];
 };
 
-extern const AssemblerInstruction instructions[0xFF];
+extern const AssemblerInstruction instructions[SPY_OPCODES]; /* unused opcodes have no name */
 
 void Assembler_generateBytecodeFile(const char*);
 static void	Assembler_die(Assembler*, const char*, ...);
 static void Assembler_appendLabel(Assembler*, const char*, uint32_t);
 static void Assembler_appendConstant(Assembler*, const char*, uint32_t);
 static const AssemblerInstruction* Assembler_validateInstruction(Assembler*, const char*);
+static void Assembler_fuseInstructions(Assembler*);
+static int Assembler_matchFusion(Assembler*, const AssemblerFusion*, AssemblerToken*, AssemblerToken**, AssemblerToken**);
+static AssemblerToken* Assembler_newToken(const char*, AssemblerTokenType, const AssemblerToken*);
+static void Assembler_addLine(Assembler*, uint32_t, const char*, uint32_t);
+static void Assembler_emitVarint(Assembler*, uint32_t);
+static void Assembler_writeLines(Assembler*, FILE*);
 static int strcmp_lower(const char*, const char*);
 
 #endif
@@ -9,6 +9,8 @@ AsmLexer_convertToAssemblerTokens(const char* source) {
 	AsmLexer L;
 	L.tokens = NULL;
 	L.line = 1;
+	L.source_file = NULL;
+	L.source_line = 0;
 
 	char c;
 	while ((c = *source++)) {
@@ -17,6 +19,7 @@ AsmLexer_convertToAssemblerTokens(const char* source) {
 		} else if (c == ' ' || c == '\t') {
 			continue;
 		} else if (c == ';') {
+			source = AsmLexer_readMarker(&L, source);
 			while (*source && *source != '\n') source++;
 		/*
 		} else if (c == '\'') {
@@ -119,6 +122,8 @@ AsmLexer_appendAssemblerToken(AsmLexer* L, const char* word, AssemblerTokenType
 	token->next = NULL;
 	token->prev = NULL;
 	token->line = L->line;
+	token->source_file = L->source_file;
+	token->source_line = L->source_line;
 	token->type = type;
 	size_t length = strlen(word);
 	token->word = (char *)malloc(length + 1);
@@ -134,6 +139,34 @@ AsmLexer_appendAssemblerToken(AsmLexer* L, const char* word, AssemblerTokenType
 	}
 }
 
+/* the compiler marks where the code that follows came from with comments,
+ * ';  file name.spy' and ';  line'.  reads one if 'source' (just past the
+ * ';') starts one and returns where it stopped, other comments are left
+ * alone */
+static const char*
+AsmLexer_readMarker(AsmLexer* L, const char* source) {
+	const char* at = source;
+	while (*at == ' ' || *at == '\t') at++;
+	if (!strncmp(at, "file ", 5)) {
+		const char* name = at + 5;
+		size_t len = strcspn(name, "\r\n");
+		char* file = (char *)malloc(len + 1);
+		memcpy(file, name, len);
+		file[len] = 0;
+		L->source_file = file;
+		return name + len;
+	}
+	if (isdigit(*at)) {
+		unsigned int line = strtoul(at, (char **)&at, 10);
+		while (*at == ' ' || *at == '\t' || *at == '\r') at++;
+		if (!*at || *at == '\n') {
+			L->source_line = line;
+			return at;
+		}
+	}
+	return source;
+}
+
 static void
 AsmLexer_printAssemblerTokens(AsmLexer* L) {
 	AssemblerToken* at = L->tokens;
@@ -12,6 +12,8 @@ enum AssemblerTokenType {
 struct AssemblerToken {
 	char*					word;
 	unsigned int			line;
+	const char*				source_file; /* from the last '; file' marker, NULL if none */
+	unsigned int			source_line; /* from the last line marker, 0 if none */
 	AssemblerTokenType		type;
 	AssemblerToken*			next;
 	AssemblerToken*			prev;
@@ -20,10 +22,13 @@ struct AssemblerToken {
 struct AsmLexer {
 	AssemblerToken*	tokens;	
 	unsigned int	line;
+	const char*		source_file;
+	unsigned int	source_line;
 };
 
 AssemblerToken*		AsmLexer_convertToAssemblerTokens(const char*);
 static void			AsmLexer_appendAssemblerToken(AsmLexer*, const char*, AssemblerTokenType);
+static const char*	AsmLexer_readMarker(AsmLexer*, const char*);
 static void			AsmLexer_printAssemblerTokens(AsmLexer*);
 
 #endif
@@ -0,0 +1,204 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "batch.h"
+
+/* spy batch: many programs in one process.  the manifest has a job per
+ * line, a .spyb and the arguments its entry point gets, separated by
+ * blanks; empty lines and lines starting with '#' are skipped.
+ *
+ * every file is loaded once, up front, and its jobs share it.  every job
+ * is a task in its own state, run by a scheduler on a fixed pool of
+ * threads in time slices of 'quantum' microseconds and/or 'budget'
+ * instructions, so a job that loops forever only slows the others down.
+ * exit() and runtime errors end the job and not the process, see
+ * sched.c.  jobs aren't isolated from each other's memory bugs though:
+ * an address past the end of a state's memory is a plain SIGSEGV and
+ * ends every job.  a job's output is collected and written to stdout in one
+ * piece when it ends, jobs never interleave.  the wall time of every job
+ * and the totals go to stderr at the end */
+
+/* returns 0 if every job ended with status 0 */
+int
+Spy_batch(const char* manifest, uint32_t option_flags, uint32_t jit_threshold, size_t stack_limit,
+		size_t heap_limit, size_t output_size, uint32_t threads, uint32_t quantum, int64_t budget) {
+	Batch batch;
+	Batch* B = &batch;
+	SpyScheduler* Z;
+	uint64_t start, elapsed, busy = 0, slices = 0, steals = 0;
+	size_t failed = 0;
+
+	memset(B, 0, sizeof(Batch));
+	B->option_flags = option_flags;
+	B->jit_threshold = jit_threshold;
+	B->stack_limit = stack_limit;
+	B->heap_limit = heap_limit;
+	B->output_size = output_size;
+	Batch_read(B, manifest);
+	if (!threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > B->count) threads = B->count ? B->count : 1;
+
+	Z = Spy_newScheduler(threads, quantum, budget);
+	for (size_t i = 0; i < B->count; i++) {
+		BatchJob* J = &B->jobs[i];
+		if (!J->program) continue;
+		J->task.start = Batch_start;
+		J->task.done = Batch_done;
+		J->task.data = J;
+		Spy_schedule(Z, &J->task);
+	}
+	start = Batch_now();
+	Spy_runScheduler(Z);
+	elapsed = Batch_now() - start;
+	for (uint32_t i = 0; i < threads; i++) {
+		steals += Z->workers[i].steals;
+	}
+	Spy_freeScheduler(Z);
+	fflush(stdout); /* keep the jobs' output before the report */
+
+	/* 'ms' is the job's own wall time, 'done' when it ended after the batch started */
+	fprintf(stderr, "\n%6s %6s %12s %12s %8s  %s\n", "job", "status", "ms", "done", "slices", "program");
+	for (size_t i = 0; i < B->count; i++) {
+		BatchJob* J = &B->jobs[i];
+		fprintf(stderr, "%6zu %6d %12.3f %12.3f %8llu  %s\n", i + 1, J->status, J->ns / 1e6,
+			J->end > start ? (J->end - start) / 1e6 : 0.0, (unsigned long long)J->task.slices, J->line);
+		busy += J->ns;
+		slices += J->task.slices;
+		if (J->status) failed++;
+	}
+	fprintf(stderr, "%zu jobs (%zu failed) on %u threads in %.3f s, %.1f jobs/s, %.3f s of job time\n",
+		B->count, failed, threads, elapsed / 1e9, elapsed ? B->count / (elapsed / 1e9) : 0.0, busy / 1e9);
+	fprintf(stderr, "%llu slices, %llu tasks stolen\n", (unsigned long long)slices, (unsigned long long)steals);
+
+	for (size_t i = 0; i < B->count; i++) {
+		free(B->jobs[i].line);
+		if (B->jobs[i].argc) free(B->jobs[i].argv[0]);
+		free(B->jobs[i].argv);
+	}
+	for (size_t i = 0; i < B->program_count; i++) {
+		if (B->programs[i]) Spy_freeProgram(B->programs[i]);
+	}
+	free(B->programs);
+	free(B->jobs);
+	return failed != 0;
+}
+
+/* reads the manifest and loads the programs it names */
+static void
+Batch_read(Batch* B, const char* manifest) {
+	FILE* f = fopen(manifest, "r");
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t length;
+	if (!f) Spy_crash(NULL, "Couldn't open manifest '%s'", manifest);
+	while ((length = getline(&line, &size, f)) >= 0) {
+		BatchJob* J;
+		char* copy;
+		char* at;
+		char* word;
+		size_t words = 0;
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			line[--length] = 0;
+		}
+		at = line + strspn(line, " \t");
+		if (!*at || *at == '#') continue;
+
+		if (B->count == B->capacity) {
+			B->capacity = B->capacity ? B->capacity * 2 : 64;
+			B->jobs = (BatchJob *)realloc(B->jobs, B->capacity * sizeof(BatchJob));
+			if (!B->jobs) Spy_crash(NULL, "Out of memory\n");
+		}
+		J = &B->jobs[B->count++];
+		memset(J, 0, sizeof(BatchJob));
+		J->batch = B;
+		J->line = strdup(at);
+		copy = strdup(at);
+		J->argv = (char **)malloc((strlen(at) / 2 + 2) * sizeof(char *));
+		if (!J->line || !copy || !J->argv) Spy_crash(NULL, "Out of memory\n");
+		for (word = strtok(copy, " \t"); word; word = strtok(NULL, " \t")) {
+			J->argv[words++] = word;
+		}
+		J->argv[words] = NULL;
+		J->argc = words;
+		J->program = Batch_program(B, J->argv[0]);
+		if (!J->program) J->status = 1;
+	}
+	free(line);
+	fclose(f);
+}
+
+/* the program loaded from 'filename', loading it the first time.  NULL
+ * if it can't be, the reason has been printed */
+static SpyProgram*
+Batch_program(Batch* B, const char* filename) {
+	BatchLoad load;
+	for (size_t i = 0; i < B->program_count; i++) {
+		if (!strcmp(B->programs[i]->filename, filename)) return B->programs[i];
+	}
+	memset(&load, 0, sizeof(BatchLoad));
+	load.filename = filename;
+	if (Spy_protect(Batch_load, &load)) return NULL;
+	if (B->program_count == B->program_capacity) {
+		B->program_capacity = B->program_capacity ? B->program_capacity * 2 : 16;
+		B->programs = (SpyProgram **)realloc(B->programs, B->program_capacity * sizeof(SpyProgram *));
+		if (!B->programs) Spy_crash(NULL, "Out of memory\n");
+	}
+	B->programs[B->program_count++] = load.program;
+	return load.program;
+}
+
+static void
+Batch_load(void* arg) {
+	BatchLoad* load = (BatchLoad *)arg;
+	load->program = Spy_load(load->filename);
+}
+
+/* a job's first turn, protected: its state, ready to run */
+static void
+Batch_start(SpyTask* T) {
+	BatchJob* J = (BatchJob *)T->data;
+	Batch* B = J->batch;
+	SpyState* S;
+	J->start = Batch_now();
+	J->output = open_memstream(&J->buffer, &J->buffer_size);
+	if (!J->output) Spy_crash(NULL, "Out of memory\n");
+	S = Spy_newState(J->program, B->option_flags);
+	T->state = S;
+	if (B->stack_limit || B->heap_limit) {
+		Spy_setLimits(S, B->stack_limit ? B->stack_limit : SIZE_STACK - SIZE_GUARD,
+			B->heap_limit ? B->heap_limit : SIZE_HEAP);
+	}
+	S->jit_threshold = B->jit_threshold;
+	Spy_setOutput(S, J->output, B->output_size);
+	Spy_startProgram(S, J->argc, J->argv);
+}
+
+/* the job ended, however it did.  frees its state and writes its output */
+static void
+Batch_done(SpyTask* T) {
+	BatchJob* J = (BatchJob *)T->data;
+	if (T->state) Spy_freeState(T->state);
+	T->state = NULL;
+	J->status = T->status;
+	J->end = Batch_now();
+	J->ns = J->end - J->start;
+	if (!J->output) return;
+	fclose(J->output);
+	flockfile(stdout);
+	fwrite(J->buffer, 1, J->buffer_size, stdout);
+	funlockfile(stdout);
+	free(J->buffer);
+	J->output = NULL;
+}
+
+static uint64_t
+Batch_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
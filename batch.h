@@ -0,0 +1,57 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "spyre.h"
+#include "sched.h"
+
+typedef struct Batch Batch;
+typedef struct BatchJob BatchJob;
+typedef struct BatchLoad BatchLoad;
+
+/* one line of the manifest */
+struct BatchJob {
+	Batch*			batch;
+	SpyProgram*		program; /* NULL if it couldn't be loaded */
+	char*			line; /* the line as written, for the report */
+	char**			argv; /* the program's file name first, pointing into a copy of the line */
+	int				argc;
+	int				status;
+	SpyTask			task;
+	FILE*			output; /* collects what the job prints */
+	char*			buffer; /* what 'output' collected */
+	size_t			buffer_size;
+	uint64_t		start; /* when its first slice started */
+	uint64_t		end;
+	uint64_t		ns; /* wall time from the job's first slice to its end */
+};
+
+struct Batch {
+	BatchJob*		jobs;
+	size_t			count;
+	size_t			capacity;
+	SpyProgram**	programs; /* every file the manifest names, loaded once */
+	size_t			program_count;
+	size_t			program_capacity;
+	uint32_t		option_flags;
+	uint32_t		jit_threshold;
+	size_t			stack_limit;
+	size_t			heap_limit;
+	size_t			output_size; /* every job's output buffer, see Spy_setOutput */
+};
+
+/* what loading a file under Spy_protect needs, see Batch_program */
+struct BatchLoad {
+	const char*		filename;
+	SpyProgram*		program;
+};
+
+int				Spy_batch(const char*, uint32_t, uint32_t, size_t, size_t, size_t, uint32_t, uint32_t, int64_t);
+
+static void		Batch_read(Batch*, const char*);
+static SpyProgram*	Batch_program(Batch*, const char*);
+static void		Batch_load(void*);
+static void		Batch_start(SpyTask*);
+static void		Batch_done(SpyTask*);
+static uint64_t	Batch_now(void);
+
+#endif
@@ -0,0 +1,153 @@
+#!/usr/bin/env bash
+# compares reading a file with fread against reading it with fread_async
+# into two buffers, where the next chunk is read while the program sums
+# the bytes of the last one.  the file is SIZE megabytes of random bytes,
+# read CHUNK bytes at a time.  a cold run starts right after the file is
+# dropped from the page cache, a warm run reports the best of several
+# runs with the file cached.  both programs print the same sum.
+#
+#   bench/aio.sh
+#
+# set SPY to the binary, SIZE, CHUNK and RUNS to change the setup.
+
+cd "$(dirname "$0")"
+SPY=${SPY:-spy}
+SIZE=${SIZE:-64}
+CHUNK=${CHUNK:-65536}
+RUNS=${RUNS:-3}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+head -c $((SIZE * 1048576)) /dev/urandom > "$TMP/data"
+
+# $1 gets chunk 'i' (local 4) into buffer a (local 1), $2 comes before
+# the loop and $3 after it
+program() {
+	cat <<SPYS
+; sums the bytes of the file, $CHUNK bytes at a time
+let fopen "fopen"
+let fseek "fseek"
+let ftell "ftell"
+let fread "fread"
+let fread_async "fread_async"
+let io_wait "io_wait"
+let malloc "malloc"
+let print "print"
+let path "$TMP/data"
+let mode "rb"
+let fmt "%d\n"
+; 0 file, 1 buffer a, 2 buffer b, 3 handle, 4 i, 6 sum, 7 byte, 8 chunks
+res 9
+ipush mode
+ipush path
+ccall fopen, 2
+ilsave 0
+ipush $CHUNK
+ccall malloc, 1
+ilsave 1
+ipush $CHUNK
+ccall malloc, 1
+ilsave 2
+ipush 0
+ipush 2
+ilload 0
+ccall fseek, 3
+ilload 0
+ccall ftell, 1
+ipush $CHUNK
+idiv
+ilsave 8
+ipush 0
+ipush 1
+ilload 0
+ccall fseek, 3
+ipush 0
+ilsave 6
+ipush 0
+ilsave 4
+$2
+__CHUNK:
+ilload 4
+ilload 8
+ilt
+jz __DONE
+$1
+ipush 0
+ilsave 7
+__SUM:
+ilload 7
+ipush $CHUNK
+ilt
+jz __NEXT
+ilload 1
+ilload 7
+iadd
+cder
+ilload 6
+iadd
+ilsave 6
+ilinc 7, 1
+jmp __SUM
+__NEXT:
+ilload 1
+ilload 2
+ilsave 1
+ilsave 2
+ilinc 4, 1
+jmp __CHUNK
+__DONE:
+$3
+ilload 6
+ipush fmt
+ccall print, 2
+noop
+SPYS
+}
+
+program "ipush $CHUNK
+ilload 1
+ilload 0
+ccall fread, 3" > "$TMP/fread.spys"
+
+# waits for chunk i in buffer a and starts reading chunk i + 1 into b
+program "ilload 3
+ccall io_wait, 1
+ilload 4
+ipush 1
+iadd
+ipush $CHUNK
+imul
+ipush $CHUNK
+ilload 2
+ilload 0
+ccall fread_async, 4
+ilsave 3" "ipush 0
+ipush $CHUNK
+ilload 1
+ilload 0
+ccall fread_async, 4
+ilsave 3" "ilload 3
+ccall io_wait, 1" > "$TMP/fread_async.spys"
+
+(cd "$TMP" && "$SPY" a fread.spys > /dev/null && "$SPY" a fread_async.spys > /dev/null) || exit 1
+
+printf "%-16s %12s %12s\n" "program" "cold" "warm"
+for name in fread fread_async; do
+	printf "%-16s" "$name"
+	for start in cold warm; do
+		best=
+		for ((run = 0; run < RUNS; run++)); do
+			if [ $start = cold ]; then
+				dd if="$TMP/data" iflag=nocache count=0 2> /dev/null
+			fi
+			begin=$(date +%s%N)
+			"$SPY" r "$TMP/$name.spyb" > /dev/null
+			t=$((($(date +%s%N) - begin) / 1000000))
+			if [ -z "$best" ] || [ $t -lt $best ]; then
+				best=$t
+			fi
+		done
+		printf "%10sms" "$best"
+	done
+	printf "\n"
+done
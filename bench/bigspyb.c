@@ -0,0 +1,52 @@
+/* writes a .spyb of about the given number of megabytes for
+ * bench/startup.sh, straight into the bytecode format since assembling
+ * that much source takes far longer than loading it.  the program adds 1
+ * to a local once per ILINC and prints the count
+ *
+ *	bigspyb out.spyb megabytes */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+static void
+put32(FILE* f, uint32_t v) {
+	fwrite(&v, 4, 1, f);
+}
+
+static void
+put64(FILE* f, uint64_t v) {
+	fwrite(&v, 8, 1, f);
+}
+
+int
+main(int argc, char** argv) {
+	static const char rom[] = "print\0%d\n"; /* print at 0, format at 6 */
+	FILE* f;
+	uint64_t count;
+	if (argc != 3 || !(f = fopen(argv[1], "wb"))) {
+		fprintf(stderr, "usage: %s out.spyb megabytes\n", argv[0]);
+		return 1;
+	}
+	count = strtoull(argv[2], NULL, 10) * 1024 * 1024 / 13;
+	put32(f, 0x5950535F);
+	put32(f, 8);
+	put32(f, 12 + sizeof(rom));
+	fwrite(rom, sizeof(rom), 1, f);
+	fputc(0x29, f); /* RES 1 */
+	put32(f, 1);
+	for (uint64_t i = 0; i < count; i++) {
+		fputc(0x44, f); /* ILINC 0, 1 */
+		put32(f, 0);
+		put64(f, 1);
+	}
+	fputc(0x24, f); /* ILLOAD 0 */
+	put32(f, 0);
+	fputc(0x01, f); /* IPUSH format */
+	put64(f, 6);
+	fputc(0x18, f); /* CCALL print, 2 */
+	put32(f, 0);
+	put32(f, 2);
+	fputc(0x00, f); /* NOOP */
+	return fclose(f) != 0;
+}
@@ -0,0 +1,53 @@
+/* a host for bench/callback.sh.  registers 'cb', a C function that calls
+ * back into the state it was called from, and runs the program's
+ * functions:
+ *
+ *	outer(n)	calls cb, then recurses n deep, returns 7 + n
+ *	calls(n)	calls cb n times, returns 7 * n
+ *
+ * cb calls inner(), which returns 7.  the recursion after the callback
+ * grows the stack past what was committed, which only works if the run
+ * cb was called from kept its fault handling.  prints the result of
+ * outer(DEPTH) and the cost of one callback in nanoseconds */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "spyre.h"
+
+static uint32_t
+host_cb(SpyState* S) {
+	return Spy_callFunction(S, "inner", "");
+}
+
+int
+main(int argc, char** argv) {
+	struct timespec start, end;
+	int64_t depth, calls, result;
+	if (argc < 4) {
+		fprintf(stderr, "usage: callback file.spyb depth calls\n");
+		return 1;
+	}
+	depth = strtoll(argv[2], NULL, 10);
+	calls = strtoll(argv[3], NULL, 10);
+	SpyProgram* P = Spy_load(argv[1]);
+	SpyState* S = Spy_newState(P, SPY_NOFLAG);
+	Spy_pushC(S, "cb", host_cb, 1);
+
+	Spy_callFunction(S, "outer", "i", depth);
+	printf("outer(%lld) = %lld\n", (long long)depth, (long long)Spy_popInt(S));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	Spy_callFunction(S, "calls", "i", calls);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	result = Spy_popInt(S);
+	if (result != 7 * calls) {
+		printf("calls(%lld) = %lld\n", (long long)calls, (long long)result);
+		return 1;
+	}
+	printf("%.0fns per callback\n",
+		((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / (calls ? calls : 1));
+	Spy_freeState(S);
+	Spy_freeProgram(P);
+	return 0;
+}
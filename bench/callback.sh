@@ -0,0 +1,75 @@
+#!/usr/bin/env bash
+# builds bench/callback.c against the objects in build/ (run make first)
+# and runs it: a C function called by the program calls back into the
+# same state, then the program recurses DEPTH deep, and CALLS callbacks
+# are timed.  fails unless outer(DEPTH) returns 7 + DEPTH.
+#
+#   bench/callback.sh
+#
+# set DEPTH and CALLS to change the run.
+
+cd "$(dirname "$0")"
+DEPTH=${DEPTH:-20000}
+CALLS=${CALLS:-1000000}
+SPY=${SPY:-spy}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+objects=$(ls ../build/*.o | grep -v '/main\.o$') || exit 1
+cc -O2 -pthread -iquote .. -o "$TMP/callback" callback.c $objects -lm || exit 1
+
+cat > "$TMP/callback.spys" <<SPYS
+let cb "cb"
+noop
+__FUNC__inner:
+ipush 7
+iret
+__FUNC__outer:
+ccall cb, 0
+iarg 0
+call __FUNC__deep, 1
+iadd
+iret
+__FUNC__deep:
+iarg 0
+jz __BOTTOM
+iarg 0
+ipush 1
+isub
+call __FUNC__deep, 1
+ipush 1
+iadd
+iret
+__BOTTOM:
+ipush 0
+iret
+__FUNC__calls:
+res 2
+ipush 0
+ilsave 0
+ipush 0
+ilsave 1
+__LOOP:
+ilload 0
+iarg 0
+ilt
+jz __DONE
+ccall cb, 0
+ilload 1
+iadd
+ilsave 1
+ilinc 0, 1
+jmp __LOOP
+__DONE:
+ilload 1
+iret
+SPYS
+(cd "$TMP" && "$SPY" a callback.spys > /dev/null) || exit 1
+
+"$TMP/callback" "$TMP/callback.spyb" "$DEPTH" "$CALLS" > "$TMP/out.txt"
+status=$?
+cat "$TMP/out.txt"
+if [ $status -ne 0 ] || ! grep -q "^outer($DEPTH) = $((DEPTH + 7))\$" "$TMP/out.txt"; then
+	echo "a callback broke the run it was called from (status $status)"
+	exit 1
+fi
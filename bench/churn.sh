@@ -0,0 +1,181 @@
+#!/usr/bin/env bash
+# measures malloc/free churn with each spy binary given on the command line
+# (default: spy).  the program allocates LIVE blocks, then OPS times frees
+# a random one and allocates a block of a random size (8 to 263 bytes) in
+# its place.  the time of a run with OPS = 0 is taken off, what's printed
+# is the cost of one free plus one malloc in nanoseconds.  an allocator
+# that doesn't depend on how many blocks are live prints the same number
+# in every row.  binary options work like bench/run.sh.  every binary
+# first has to catch a block freed twice after it merged with the free
+# block below it.
+#
+#   bench/churn.sh [spy binary ...]
+#
+# set LIVES to a list of live block counts (default: 100 1000 10000
+# 100000), OPS to the number of free/malloc pairs and RUNS to change the
+# number of runs per measurement.
+
+cd "$(dirname "$0")"
+RUNS=${RUNS:-3}
+OPS=${OPS:-200000}
+LIVES=${LIVES:-100 1000 10000 100000}
+BINARIES=("$@")
+[ ${#BINARIES[@]} -eq 0 ] && BINARIES=(spy)
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# churn LIVE OPS > file.spys
+churn() {
+	cat <<SPYS
+let malloc "malloc"
+let free "free"
+let print "print"
+let fmt "%d\n"
+res 5
+ipush $(($1 * 8))
+ccall malloc, 1
+ilsave 0
+ipush 0
+ilsave 1
+__FILL:
+ilload 1
+ipush $1
+ilt
+jz __FILLED
+ilload 0
+ilload 1
+ipush 8
+imul
+iadd
+ipush 24
+ccall malloc, 1
+isave
+ilinc 1, 1
+jmp __FILL
+__FILLED:
+ipush 12345
+ilsave 2
+ipush 0
+ilsave 1
+__LOOP:
+ilload 1
+ipush $2
+ilt
+jz __DONE
+ilload 2
+ipush 6364136223846793005
+imul
+ipush 1442695040888963407
+iadd
+ilsave 2
+ilload 0
+ilload 2
+ipush 33
+shr
+ipush 2147483647
+and
+ipush $1
+mod
+ipush 8
+imul
+iadd
+ilsave 3
+ilload 3
+iload
+ccall free, 1
+ilload 3
+ilload 2
+ipush 40
+shr
+ipush 255
+and
+ipush 8
+iadd
+ccall malloc, 1
+isave
+ilinc 1, 1
+jmp __LOOP
+__DONE:
+ilload 1
+ipush fmt
+ccall print, 2
+noop
+SPYS
+}
+
+# allocates five blocks, frees the second, fourth and third, which merges
+# into the second, and the third again
+double_free() {
+	cat <<SPYS
+let malloc "malloc"
+let free "free"
+res 5
+ipush 64
+ccall malloc, 1
+ilsave 0
+ipush 64
+ccall malloc, 1
+ilsave 1
+ipush 64
+ccall malloc, 1
+ilsave 2
+ipush 64
+ccall malloc, 1
+ilsave 3
+ipush 64
+ccall malloc, 1
+ilsave 4
+ilload 1
+ccall free, 1
+ilload 3
+ccall free, 1
+ilload 2
+ccall free, 1
+ilload 2
+ccall free, 1
+noop
+SPYS
+}
+
+# best LIVE OPS binary-index, prints the best time of RUNS runs
+best() {
+	local name=churn.$1.$2.$3 best= t
+	read -r -a cmd <<< "${BINARIES[$3]}"
+	churn "$1" "$2" > "$TMP/$name.spys"
+	(cd "$TMP" && "${cmd[0]}" a "$name.spys" > /dev/null)
+	for ((run = 0; run < RUNS; run++)); do
+		t=$( { time "${cmd[0]}" r "${cmd[@]:1}" "$TMP/$name.spyb" > /dev/null; } 2>&1 )
+		if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+			best=$t
+		fi
+	done
+	echo "$best"
+}
+
+double_free > "$TMP/double.spys"
+for bin in "${BINARIES[@]}"; do
+	read -r -a cmd <<< "$bin"
+	(cd "$TMP" && "${cmd[0]}" a double.spys > /dev/null)
+	if ! "${cmd[0]}" r "${cmd[@]:1}" "$TMP/double.spyb" 2>&1 | grep -q "free an invalid pointer"; then
+		echo "$bin: a double free after a merge wasn't caught"
+		exit 1
+	fi
+done
+
+printf "%-16s" "live blocks"
+for bin in "${BINARIES[@]}"; do
+	printf "%16s" "$(basename "$bin")"
+done
+printf "\n"
+
+TIMEFORMAT=%R
+for live in $LIVES; do
+	printf "%-16s" "$live"
+	for i in "${!BINARIES[@]}"; do
+		base=$(best "$live" 0 "$i")
+		full=$(best "$live" "$OPS" "$i")
+		awk "BEGIN { t = ($full - $base) * 1e9 / $OPS; printf \"%14.0fns\", t < 0 ? 0 : t }"
+	done
+	printf "\n"
+done
@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+# measures how long short batch jobs wait behind CPU bound ones.  the
+# manifest starts with HOGS runs of loop.spys and goes on with SHORT runs
+# of a program that sums a few thousand integers, all of them on THREADS
+# threads.  each argument is a set of batch options to compare, quoted as
+# one argument (default: -Q0, which runs every job to its end, against the
+# default time slices).  prints the wall time of the batch and the mean
+# and worst time from the start of the batch to the end of a short job.
+#
+#   bench/fair.sh ["batch options" ...]
+#   bench/fair.sh -Q0 -Q1000 -B100000
+#
+# set SPY to the binary, HOGS, SHORT and THREADS to change the mix.
+
+cd "$(dirname "$0")"
+SPY=${SPY:-spy}
+HOGS=${HOGS:-2}
+SHORT=${SHORT:-50}
+THREADS=${THREADS:-1}
+OPTIONS=("$@")
+[ ${#OPTIONS[@]} -eq 0 ] && OPTIONS=(-Q0 "")
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cp loop.spys "$TMP/hog.spys"
+cat > "$TMP/short.spys" <<SPYS
+let print "print"
+let fmt "%d\n"
+res 2
+ipush 0
+ilsave 0
+ipush 0
+ilsave 1
+__LOOP:
+ilload 0
+ipush 5000
+ilt
+jz __DONE
+ilload 1
+ilload 0
+iadd
+ilsave 1
+ilinc 0, 1
+jmp __LOOP
+__DONE:
+ilload 1
+ipush fmt
+ccall print, 2
+noop
+SPYS
+(cd "$TMP" && "$SPY" a hog.spys > /dev/null && "$SPY" a short.spys > /dev/null)
+for ((i = 0; i < HOGS; i++)); do
+	echo "$TMP/hog.spyb"
+done > "$TMP/jobs.txt"
+for ((i = 0; i < SHORT; i++)); do
+	echo "$TMP/short.spyb"
+done >> "$TMP/jobs.txt"
+
+printf "%-16s %10s %14s %14s\n" "options" "batch s" "short mean ms" "short last ms"
+for options in "${OPTIONS[@]}"; do
+	read -r -a opts <<< "$options"
+	"$SPY" batch -T"$THREADS" "${opts[@]}" "$TMP/jobs.txt" > /dev/null 2> "$TMP/report.txt"
+	awk -v name="${options:-default}" '
+		/short\.spyb$/ { n++; sum += $4; if ($4 > max) max = $4 }
+		/ jobs \(/ { for (i = 1; i < NF; i++) if ($i == "in") batch = $(i + 1) }
+		END { printf "%-16s %10s %14.3f %14.3f\n", name, batch, n ? sum / n : 0, max }
+	' "$TMP/report.txt"
+done
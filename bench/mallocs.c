@@ -0,0 +1,34 @@
+/* counts host allocations, preloaded by bench/mallocs.sh.  prints the
+ * number of malloc, calloc and realloc calls to stderr on exit */
+
+#include <stdio.h>
+#include <stddef.h>
+
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+
+static unsigned long allocations = 0;
+
+void*
+malloc(size_t size) {
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void*
+calloc(size_t count, size_t size) {
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+void*
+realloc(void* p, size_t size) {
+	allocations++;
+	return __libc_realloc(p, size);
+}
+
+__attribute__((destructor)) static void
+report(void) {
+	fprintf(stderr, "mallocs %lu\n", allocations);
+}
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# counts the host allocations (malloc, calloc, realloc) made while running
+# each benchmark program with each spy binary given on the command line
+# (default: spy).  options work like bench/run.sh.  the count includes
+# loading and startup, so a program that allocates nothing per call
+# reports the same small number however many calls it makes.
+#
+#   bench/mallocs.sh [spy binary ...]
+#
+# set PROGRAMS to a list of .spys files, it defaults to fib.spys.
+
+cd "$(dirname "$0")"
+PROGRAMS=${PROGRAMS:-fib.spys}
+BINARIES=("$@")
+[ ${#BINARIES[@]} -eq 0 ] && BINARIES=(spy)
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+cc -shared -fPIC -O2 -o "$TMP/mallocs.so" mallocs.c || exit 1
+
+printf "%-16s" "program"
+for bin in "${BINARIES[@]}"; do
+	printf "%16s" "$(basename "$bin")"
+done
+printf "\n"
+
+for src in $PROGRAMS; do
+	name=$(basename "$src" .spys)
+	printf "%-16s" "$name"
+	for i in "${!BINARIES[@]}"; do
+		read -r -a cmd <<< "${BINARIES[$i]}"
+		cp "$src" "$TMP/$name.$i.spys"
+		(cd "$TMP" && "${cmd[0]}" a "$name.$i.spys" > /dev/null)
+		count=$(LD_PRELOAD="$TMP/mallocs.so" "${cmd[0]}" r "${cmd[@]:1}" "$TMP/$name.$i.spyb" 2>&1 > /dev/null | awk '/^mallocs/ { print $2 }')
+		printf "%16s" "$count"
+	done
+	printf "\n"
+done
@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+# runs every benchmark program with each spy binary given on the command
+# line (default: spy) and prints the best wall time of several runs.  a
+# binary may be followed by run options, quoted as one argument.
+#
+#   bench/run.sh [spy binary ...]
+#   bench/run.sh "spy -n" spy
+#
+# set RUNS to change the number of runs per program, and PROGRAMS to a
+# list of .spys files to only run some of the benchmarks.
+
+cd "$(dirname "$0")"
+RUNS=${RUNS:-5}
+PROGRAMS=${PROGRAMS:-*.spys}
+BINARIES=("$@")
+[ ${#BINARIES[@]} -eq 0 ] && BINARIES=(spy)
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# a 0xFF byte where an opcode goes must be rejected, not read past the
+# instruction table.  the IADD after the two pushes is overwritten
+printf "ipush 1\nipush 2\niadd\nnoop\n" > "$TMP/opcode.spys"
+for bin in "${BINARIES[@]}"; do
+	read -r -a cmd <<< "$bin"
+	(cd "$TMP" && "${cmd[0]}" a opcode.spys > /dev/null)
+	code=$(od -An -tu4 -j8 -N4 "$TMP/opcode.spyb")
+	printf '\377' | dd of="$TMP/opcode.spyb" bs=1 seek=$((code + 18)) conv=notrunc 2> /dev/null
+	if ! "${cmd[0]}" r "${cmd[@]:1}" "$TMP/opcode.spyb" 2>&1 | grep -q "invalid opcode 0xFF"; then
+		echo "$bin: an invalid opcode wasn't rejected"
+		exit 1
+	fi
+done
+
+printf "%-16s" "program"
+for bin in "${BINARIES[@]}"; do
+	printf "%16s" "$(basename "$bin")"
+done
+printf "\n"
+
+TIMEFORMAT=%R
+for src in $PROGRAMS; do
+	name=$(basename "$src" .spys)
+	printf "%-16s" "$name"
+	for i in "${!BINARIES[@]}"; do
+		read -r -a cmd <<< "${BINARIES[$i]}"
+		# assemble with the binary being measured, the format may differ
+		cp "$src" "$TMP/$name.$i.spys"
+		(cd "$TMP" && "${cmd[0]}" a "$name.$i.spys" > /dev/null)
+		best=
+		for ((run = 0; run < RUNS; run++)); do
+			t=$( { time "${cmd[0]}" r "${cmd[@]:1}" "$TMP/$name.$i.spyb" > /dev/null; } 2>&1 )
+			if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+				best=$t
+			fi
+		done
+		printf "%15ss" "$best"
+	done
+	printf "\n"
+done
@@ -0,0 +1,53 @@
+#!/usr/bin/env bash
+# times loading and running large generated bytecode files with each spy
+# binary given on the command line (default: spy).  a cold start runs
+# right after the file is dropped from the page cache, a warm start
+# reports the best of several runs with the file cached.  the programs
+# do little more than count, so the times are mostly startup.  binary
+# options work like bench/run.sh.
+#
+#   bench/startup.sh [spy binary ...]
+#
+# set SIZES to a list of file sizes in megabytes (default: 1 50) and RUNS
+# to change the number of runs per start.  dropping a file from the cache
+# only works while no other process has it mapped.
+
+cd "$(dirname "$0")"
+RUNS=${RUNS:-5}
+SIZES=${SIZES:-1 50}
+BINARIES=("$@")
+[ ${#BINARIES[@]} -eq 0 ] && BINARIES=(spy)
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+cc -O2 -o "$TMP/bigspyb" bigspyb.c || exit 1
+
+printf "%-16s" "start"
+for bin in "${BINARIES[@]}"; do
+	printf "%16s" "$(basename "$bin")"
+done
+printf "\n"
+
+TIMEFORMAT=%R
+for size in $SIZES; do
+	file="$TMP/$size.spyb"
+	"$TMP/bigspyb" "$file" "$size" || exit 1
+	for start in cold warm; do
+		printf "%-16s" "${size}MB $start"
+		for i in "${!BINARIES[@]}"; do
+			read -r -a cmd <<< "${BINARIES[$i]}"
+			best=
+			for ((run = 0; run < RUNS; run++)); do
+				if [ $start = cold ]; then
+					dd if="$file" iflag=nocache count=0 2> /dev/null
+				fi
+				t=$( { time "${cmd[0]}" r "${cmd[@]:1}" "$file" > /dev/null; } 2>&1 )
+				if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+					best=$t
+				fi
+			done
+			printf "%15ss" "$best"
+		done
+		printf "\n"
+	done
+done
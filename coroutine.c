@@ -0,0 +1,133 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "coroutine.h"
+#include "heap.h"
+
+/* coroutines: functions that run on a stack of their own and can stop
+ * in the middle (YIELD) to go on later where they stopped (RESUME).
+ * CONEW makes one from a heap block: the block's first page boundary
+ * holds the SpyCoroutine, the stack follows it and SIZE_GUARD bytes at
+ * the top are made inaccessible, so an overflow faults just like on the
+ * main stack.  the bottom of the stack holds the frame of a CALL with
+ * one argument returning to the NOOP past the end of the code; the first
+ * RESUME stores the argument and returning from the frame ends the
+ * coroutine.
+ *
+ * the interpreter switches between coroutines by saving ip, sp and bp to
+ * the SpyCoroutine it leaves and loading them from the one it enters,
+ * see TRANSFER in execute.h.  these functions check that the switch is
+ * allowed and keep the statuses */
+
+#define WORD(a)		(*(uint64_t *)&S->memory[a])
+
+/* a coroutine running the function at 'entry' (a cell) on a stack of
+ * 'size' bytes, rounded up to whole pages.  returns it, 0 if the heap is
+ * out of room */
+uint64_t
+Spy_newCoroutine(SpyState* S, uint32_t entry, uint64_t size) {
+	const uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t block, co, base;
+	SpyCoroutine* C;
+	if (size > S->heap_size) return 0;
+	size = (size + page - 1) & ~(page - 1);
+	if (size < page) size = page;
+	if (!(block = Spy_heapAlloc(S, size + SIZE_GUARD + page))) return 0;
+	co = (block + page - 1) & ~(page - 1);
+	if (mprotect(&S->memory[co + size], SIZE_GUARD, PROT_NONE)) {
+		Spy_heapFree(S, block);
+		return 0;
+	}
+	C = (SpyCoroutine *)&S->memory[co];
+	C->magic = COROUTINE_MAGIC;
+	C->block = block;
+	C->end = co + size;
+	C->caller = 0;
+	C->status = COROUTINE_FRESH;
+
+	/* what a VRET leaves on top, the argument, nargs, the caller's bp
+	 * and the return cell, like CALL pushes them */
+	base = co + sizeof(SpyCoroutine);
+	WORD(base) = 0;
+	WORD(base + 8) = 0;
+	WORD(base + 16) = 1;
+	*(uint8_t **)&S->memory[base + 24] = &S->memory[base];
+	WORD(base + 32) = S->program->code_size - 1;
+	C->ip = entry;
+	C->sp = base + 32;
+	C->bp = base + 32;
+	S->coroutines++;
+	return co;
+}
+
+void
+Spy_freeCoroutine(SpyState* S, uint64_t co) {
+	SpyCoroutine* C = Spy_coroutine(S, co);
+	if (C->status == COROUTINE_RUNNING || C->status == COROUTINE_NORMAL) {
+		Spy_crash(S, "freed a running coroutine (0x%llx)", (unsigned long long)co);
+	}
+	if (mprotect(&S->memory[C->end], SIZE_GUARD, PROT_READ | PROT_WRITE)) {
+		Spy_crash(S, "couldn't free the coroutine (0x%llx)", (unsigned long long)co);
+	}
+	C->magic = 0;
+	S->coroutines--;
+	Spy_heapFree(S, C->block);
+}
+
+/* coroutine co's control block, crashes unless co is a coroutine.  the
+ * block is in VM memory, so everything a switch loads from it is checked */
+SpyCoroutine*
+Spy_coroutine(SpyState* S, uint64_t co) {
+	SpyCoroutine* C = (SpyCoroutine *)&S->memory[co];
+	const uint64_t top = S->heap_start + S->heap_committed;
+	if (co < S->heap_start || co + sizeof(SpyCoroutine) > top || (co & 7) || C->magic != COROUTINE_MAGIC ||
+		C->end <= co || C->end + SIZE_GUARD > top || C->ip >= S->program->code_size ||
+		C->sp < co || C->sp >= C->end || C->bp < co || C->bp >= C->end) {
+		Spy_crash(S, "invalid coroutine (0x%llx)", (unsigned long long)co);
+	}
+	return C;
+}
+
+/* the running coroutine resumes co.  returns 1 if co never ran, 'value'
+ * is its argument then, else RESUME pushes it on co's stack */
+int
+Spy_resumeCoroutine(SpyState* S, uint64_t co, int64_t value) {
+	SpyCoroutine* C = Spy_coroutine(S, co);
+	if (C->status == COROUTINE_DEAD) {
+		Spy_crash(S, "resumed a coroutine that returned (0x%llx)", (unsigned long long)co);
+	}
+	if (C->status != COROUTINE_FRESH && C->status != COROUTINE_SUSPENDED) {
+		Spy_crash(S, "resumed a running coroutine (0x%llx)", (unsigned long long)co);
+	}
+	Spy_context(S, S->coroutine)->status = COROUTINE_NORMAL;
+	C->caller = S->coroutine;
+	if (C->status == COROUTINE_FRESH) {
+		C->status = COROUTINE_RUNNING;
+		WORD(C->bp - 24) = value;
+		return 1;
+	}
+	C->status = COROUTINE_RUNNING;
+	return 0;
+}
+
+/* the running coroutine yields (COROUTINE_SUSPENDED) or returns
+ * (COROUTINE_DEAD).  returns the coroutine that resumed it, which runs
+ * next */
+uint64_t
+Spy_leaveCoroutine(SpyState* S, uint64_t status) {
+	SpyCoroutine* C;
+	if (!S->coroutine) {
+		Spy_crash(S, "yield outside of a coroutine");
+	}
+	if (S->coroutine == S->coroutine_floor) {
+		Spy_crash(S, "yield from a function called by C");
+	}
+	C = Spy_coroutine(S, S->coroutine);
+	if (C->caller && Spy_coroutine(S, C->caller)->status != COROUTINE_NORMAL) {
+		Spy_crash(S, "the coroutine that resumed this one is gone (0x%llx)", (unsigned long long)C->caller);
+	}
+	Spy_context(S, C->caller)->status = COROUTINE_RUNNING;
+	C->status = status;
+	return C->caller;
+}
@@ -0,0 +1,27 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include "spyre.h"
+
+#define COROUTINE_MAGIC		0x4F524F43595053 /* "SPYCORO", first word of every coroutine */
+
+/* SpyCoroutine.status */
+#define COROUTINE_FRESH		0 /* never resumed */
+#define COROUTINE_SUSPENDED	1 /* yielded */
+#define COROUTINE_RUNNING	2
+#define COROUTINE_NORMAL	3 /* resumed another coroutine and waits for it */
+#define COROUTINE_DEAD		4 /* its function returned */
+
+uint64_t		Spy_newCoroutine(SpyState*, uint32_t, uint64_t);
+void			Spy_freeCoroutine(SpyState*, uint64_t);
+SpyCoroutine*	Spy_coroutine(SpyState*, uint64_t);
+int				Spy_resumeCoroutine(SpyState*, uint64_t, int64_t);
+uint64_t		Spy_leaveCoroutine(SpyState*, uint64_t);
+
+/* the saved registers of coroutine 'co', 0 for the main stack */
+static inline SpyCoroutine*
+Spy_context(SpyState* S, uint64_t co) {
+	return co ? (SpyCoroutine *)&S->memory[co] : &S->main;
+}
+
+#endif
@@ -0,0 +1,857 @@
+/* body of the interpreter loop.  spyre.c includes this file once per
+ * interpreter variant, after defining:
+ *
+ *	SPY_VARIANT		name of the function to generate
+ *	SPY_VARIANT_ID	index of the variant's cells in S->program->codes
+ *	SPY_TOS			1 to keep the top of the stack in a register
+ *	SPY_DEBUGLOOP	1 to count, check and step through every instruction
+ *	SPY_CHECKED		0 to leave out run time checks, only for code that
+ *					passed Spy_verify
+ *	SPY_PROFILELOOP	1 to count and time every instruction, see profile.c
+ *	SPY_CALLGRAPHLOOP	1 to time every call, see profile.c
+ *	SPY_SAMPLELOOP	1 to keep S->ip and S->bp current for the sampling
+ *					profiler, see profile.c
+ *
+ * every loop except the debug and profiling loops counts CALLs and
+ * backward jumps for the JIT and runs native code where there is some,
+ * see jit.c.
+ * the generated function runs S from S->ip until the program halts
+ * (SPY_HALT), debugging is switched on or off and the program should
+ * continue in another variant (SPY_SWITCH) or the run's budget is spent
+ * (SPY_YIELD).  calls and backward jumps are the only safe points where
+ * a run yields, see Spy_resume.  release loops do nothing between
+ * instructions, stack overflows are caught by the guard below the heap,
+ * see Spy_allocateMemory, or the one above a coroutine's stack.
+ * CONEW, RESUME and YIELD move between the main stack and coroutines,
+ * see coroutine.c.
+ * ip, sp and bp live in locals while running and are written back to S
+ * before anything outside of the loop (C functions, crashes) can look
+ * at them.
+ *
+ * with SPY_TOS, the value on top of the stack is kept in 'tos' instead
+ * of at S->memory[sp], every slot below it is always up to date in
+ * memory.  floats are cached as their bit pattern.  the cache is spilled
+ * before C functions, calls and instructions that address memory, and
+ * reloaded after anything that may have written to the top slot.  no
+ * include guard, this file is meant to be included more than once */
+
+#if SPY_TOS
+#define TOS_LOAD()		(tos = *(int64_t *)sp)
+#define TOS_STORE()		(*(int64_t *)sp = tos)
+#define TOPI			tos
+#define PUSHI(v)		do { TOS_STORE(); sp += 8; tos = (v); } while (0)
+#define DROP()			do { sp -= 8; TOS_LOAD(); } while (0)
+/* locals may live in the top slot right after RES */
+#define LOADLOCAL(p)	((p) == sp ? tos : *(int64_t *)(p))
+#define SAVELOCAL(p, v)	do { if ((p) == sp) tos = (v); else *(int64_t *)(p) = (v); } while (0)
+#else
+#define TOS_LOAD()
+#define TOS_STORE()
+#define TOPI			(*(int64_t *)sp)
+#define PUSHI(v)		do { int64_t v_ = (v); sp += 8; *(int64_t *)sp = v_; } while (0)
+#define DROP()			(sp -= 8)
+#define LOADLOCAL(p)	(*(int64_t *)(p))
+#define SAVELOCAL(p, v)	(*(int64_t *)(p) = (v))
+#endif
+
+#define POPI(x)			do { (x) = TOPI; DROP(); } while (0)
+#define TOPF			Spy_bitsToFloat(TOPI)
+#define SETTOPF(v)		(TOPI = Spy_floatToBits(v))
+#define PUSHF(v)		PUSHI(Spy_floatToBits(v))
+#define POPF(x)			do { (x) = TOPF; DROP(); } while (0)
+#define LOCAL(n)		(bp + (n)*8 + 8)
+#define READINT()		((ip++)->i)
+#define READFLOAT()		((ip++)->f)
+
+/* hand the registers to the rest of the VM and take them back */
+#define SYNC()			do { TOS_STORE(); S->ip = ip; S->sp = sp; S->bp = bp; } while (0)
+#define UNSYNC()		do { ip = S->ip; sp = S->sp; bp = S->bp; TOS_LOAD(); } while (0)
+
+#if SPY_CHECKED
+/* a frame larger than the guard could skip over it.  sp may be past the
+ * stack, so the top of the stack isn't stored */
+#define CHECKSTACK() \
+	if (sp >= stack_end) { \
+		S->ip = ip; S->sp = sp; S->bp = bp; \
+		Spy_crash(S, "stack overflow"); \
+	}
+#define CHECKTARGET(a) \
+	if ((uint64_t)(a) > S->program->bytecode_size || S->program->code_map[a] == UINT32_MAX) { \
+		SYNC(); \
+		Spy_crash(S, "invalid jump target %lld", (long long)(a)); \
+	}
+#else
+#define CHECKSTACK()
+#define CHECKTARGET(a)
+#endif
+
+/* the hardware traps on a zero divisor, and on INT64_MIN / -1 which
+ * wraps here like every other overflow.  no verifier can rule these out,
+ * so every variant checks */
+#define CHECKDIVISOR(a) \
+	if ((a) == 0) { \
+		SYNC(); \
+		Spy_crash(S, "division by zero"); \
+	}
+
+#if SPY_PROFILELOOP
+/* charge the time since the last instruction started to it */
+#define PROFILE_STOP()	(profile->ticks[op] += PROFILE_CLOCK() - then)
+#else
+#define PROFILE_STOP()
+#endif
+
+#if SPY_CALLGRAPHLOOP
+#define CALLGRAPH_ENTER()	Spy_callGraphEnter(S, ip - code, bp)
+#define CALLGRAPH_LEAVE()	Spy_callGraphLeave(S, bp)
+#else
+#define CALLGRAPH_ENTER()
+#define CALLGRAPH_LEAVE()
+#endif
+
+#if SPY_SAMPLELOOP
+/* bp only changes on calls and returns, ip is stored before every
+ * instruction, see Profile_signal */
+#define SAMPLE_FRAME()	(*(uint8_t* volatile *)&S->bp = bp)
+#else
+#define SAMPLE_FRAME()
+#endif
+
+/* ip was just called or jumped back to, charge the 'n' instructions
+ * since the last safe point and stop there if the budget is spent */
+#define SAFEPOINT(n) \
+	if (Spy_charge(S, (n)) < 0) { \
+		PROFILE_STOP(); \
+		SYNC(); \
+		return SPY_YIELD; \
+	}
+
+/* leaves the running coroutine, or the main stack, for coroutine 'to' (0
+ * for the main stack).  the statuses are already set, switching is a
+ * swap of ip, sp and bp */
+#define TRANSFER(to) do { \
+	uint64_t to_ = (to); \
+	SpyCoroutine* from_ = Spy_context(S, S->coroutine); \
+	SpyCoroutine* into_ = Spy_context(S, to_); \
+	TOS_STORE(); \
+	from_->ip = ip - code; \
+	from_->sp = sp - memory; \
+	from_->bp = bp - memory; \
+	ip = &code[into_->ip]; \
+	sp = &memory[into_->sp]; \
+	bp = &memory[into_->bp]; \
+	S->coroutine = to_; \
+	S->stack_end = stack_end = &memory[into_->end]; \
+	SAMPLE_FRAME(); \
+	TOS_LOAD(); \
+} while (0)
+
+#if !SPY_DEBUGLOOP && !SPY_PROFILELOOP && !SPY_CALLGRAPHLOOP && !SPY_SAMPLELOOP
+/* ip was just called or jumped back to, run it natively if it's compiled
+ * or just got hot.  native code charges its own safe points and leaves
+ * early once the budget is spent */
+#define JIT() \
+	if (jit) { \
+		size_t cell_ = ip - code; \
+		if (S->jit_entry[cell_] || (++S->jit_counts[cell_] == jit && Spy_jitCompile(S, cell_))) { \
+			SYNC(); \
+			cell_ = Spy_jitRun(S, S->jit_entry[cell_]); \
+			UNSYNC(); \
+			ip = &code[cell_]; \
+			SAFEPOINT(0); \
+		} \
+	}
+#else
+#define JIT()
+#endif
+
+static int
+SPY_VARIANT(SpyState* S) {
+
+	/* pointers to labels, (direct threading, significantly faster than switch/case) */
+	static const void* const opcodes[] = {
+		&&noop, &&ipush, &&iadd, &&isub,
+		&&imul, &&idiv, &&mod, &&shl,
+		&&shr, &&and, &&or, &&xor, &&not,
+		&&neg, &&igt, &&ige, &&ilt,
+		&&ile, &&icmp, &&jnz, &&jz,
+		&&jmp, &&call, &&iret, &&ccall,
+		&&fpush, &&fadd, &&fsub, &&fmul,
+		&&fdiv, &&fgt, &&fge, &&flt,
+		&&fle, &&fcmp, &&fret, &&ilload,
+		&&ilsave, &&iarg, &&iload, &&isave,
+		&&res, &&lea, &&ider, &&icinc, &&cder,
+		&&lor, &&land, &&padd, &&psub, &&log,
+		&&vret, &&dbon, &&dboff, &&dbds, &&cjnz,
+		&&cjz, &&cjmp, &&ilnsave, &&ilnload,
+		&&flload, &&flsave, &&ftoi, &&itof,
+		&&fder, &&fsave, &&lnot, &&ncall,
+		&&ilinc, &&ilcinc, &&illtjz, &&ilcltjz,
+		&&conew, &&resume, &&yield
+	};
+
+	/* pre-decode the code, the interpreter never sees raw bytes */
+	SpyCode* const cells = Spy_translate(S->program, SPY_VARIANT_ID, opcodes);
+	/* cells line up between variants, carry on where the last one stopped */
+	if (!S->ip) {
+		S->ip = &cells[S->start];
+	} else if (S->code != cells) {
+		S->ip = &cells[S->ip - S->code];
+	}
+	S->code = cells;
+#if SPY_PROFILELOOP
+	SpyProfile* const profile = S->profile;
+	Spy_profileInit(S);
+	const uint8_t* const ops = profile->ops;
+	uint32_t op = PROFILE_NONE;
+	uint32_t next;
+	uint64_t then = PROFILE_CLOCK();
+	uint64_t now;
+#elif SPY_CALLGRAPHLOOP
+	Spy_callGraphInit(S);
+#elif SPY_SAMPLELOOP
+	Spy_samplerInit(S);
+#elif !SPY_DEBUGLOOP
+	const uint32_t jit = S->jit_threshold;
+	if (jit) {
+		Spy_jitInit(S);
+	}
+#endif
+
+	/* registers */
+	const SpyCode* ip;
+	uint8_t* sp;
+	uint8_t* bp;
+	uint8_t* const memory = S->memory;
+	uint8_t* stack_end = &memory[Spy_context(S, S->coroutine)->end]; /* changes with the coroutine */
+	SpyCode* const code = S->code;
+#if SPY_TOS
+	int64_t tos;
+#endif
+
+	/* general purpose vars for interpretation */
+	int64_t a, c;
+	double b;
+	uint8_t* p;
+
+#if SPY_DEBUGLOOP
+	/* handler saver (for step debugging) */
+	const void* hsave = NULL;
+
+	int total = 0;
+#endif
+
+	S->stack_end = stack_end;
+	UNSYNC();
+
+	/* main interpreter loop */
+#if SPY_DEBUGLOOP
+	dispatch:
+	total++;
+	if (sp >= stack_end) {
+		SYNC();
+		Spy_crash(S, "stack overflow");
+	}
+	if (S->option_flags & SPY_STEP) {
+		SYNC();
+		for (int i = 0; i < 100; i++) {
+			fputc('\n', stdout);
+		}
+		Spy_dumpStack(S);
+		for (int i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++) {
+			if (opcodes[i] == hsave) {
+				printf("\nexecuted %s\n", instructions[i].name);
+				break;
+			}
+		}
+		getchar();
+	}
+	hsave = ip->handler;
+	goto *(ip++)->handler;
+#elif SPY_PROFILELOOP
+	dispatch:
+	now = PROFILE_CLOCK();
+	profile->ticks[op] += now - then;
+	then = now;
+	next = ops[ip - code];
+	profile->counts[next]++;
+	profile->pairs[op][next]++;
+	op = next;
+	goto *(ip++)->handler;
+#elif SPY_SAMPLELOOP
+	dispatch:
+	/* where the SIGPROF handler looks, one store keeps the dispatch small
+	 * enough for the compiler to copy into every instruction */
+	*(const SpyCode* volatile *)&S->ip = ip;
+	goto *(ip++)->handler;
+#else
+	dispatch:
+	goto *(ip++)->handler;
+#endif
+
+	noop:
+	if (S->coroutine && ip == &code[S->program->code_size] && bp == &memory[S->coroutine + sizeof(SpyCoroutine)]) {
+		/* a coroutine's function returned, its value goes to the resumer.
+		 * it keeps the NOOP as its ip, never the cell past the end */
+		a = TOPI;
+		ip--;
+		SYNC();
+		c = Spy_leaveCoroutine(S, COROUTINE_DEAD);
+		TRANSFER(c);
+		PUSHI(a);
+		goto dispatch;
+	}
+	goto done;
+
+	ipush:
+	a = READINT();
+	PUSHI(a);
+	goto dispatch;
+
+	iadd:
+	POPI(a);
+	TOPI += a;
+	goto dispatch;
+
+	isub:
+	POPI(a);
+	TOPI -= a;
+	goto dispatch;
+
+	imul:
+	POPI(a);
+	TOPI *= a;
+	goto dispatch;
+
+	idiv:
+	POPI(a);
+	CHECKDIVISOR(a);
+	TOPI = a == -1 ? (int64_t)(0 - (uint64_t)TOPI) : TOPI / a;
+	goto dispatch;
+
+	mod:
+	POPI(a);
+	CHECKDIVISOR(a);
+	TOPI = a == -1 ? 0 : TOPI % a;
+	goto dispatch;
+
+	shl:
+	POPI(a);
+	TOPI <<= a;
+	goto dispatch;
+
+	shr:
+	POPI(a);
+	TOPI >>= a;
+	goto dispatch;
+
+	and:
+	POPI(a);
+	TOPI &= a;
+	goto dispatch;
+
+	or:
+	POPI(a);
+	TOPI |= a;
+	goto dispatch;
+
+	xor:
+	POPI(a);
+	TOPI ^= a;
+	goto dispatch;
+
+	not:
+	TOPI = ~TOPI;
+	goto dispatch;
+
+	neg:
+	TOPI = -TOPI;
+	goto dispatch;
+
+	igt:
+	POPI(a);
+	TOPI = TOPI > a;
+	goto dispatch;
+
+	ige:
+	POPI(a);
+	TOPI = TOPI >= a;
+	goto dispatch;
+
+	ilt:
+	POPI(a);
+	TOPI = TOPI < a;
+	goto dispatch;
+
+	ile:
+	POPI(a);
+	TOPI = TOPI <= a;
+	goto dispatch;
+
+	icmp:
+	POPI(a);
+	TOPI = TOPI == a;
+	goto dispatch;
+
+	jnz:
+	POPI(a);
+	if (a) {
+		if (ip->target < ip) {
+			a = ip - ip->target;
+			ip = ip->target;
+			SAFEPOINT(a);
+			JIT();
+		} else {
+			ip = ip->target;
+		}
+	} else {
+		ip++;
+	}
+	goto dispatch;
+
+	jz:
+	POPI(a);
+	if (!a) {
+		if (ip->target < ip) {
+			a = ip - ip->target;
+			ip = ip->target;
+			SAFEPOINT(a);
+			JIT();
+		} else {
+			ip = ip->target;
+		}
+	} else {
+		ip++;
+	}
+	goto dispatch;
+
+	jmp:
+	if (ip->target < ip) {
+		a = ip - ip->target;
+		ip = ip->target;
+		SAFEPOINT(a);
+		JIT();
+	} else {
+		ip = ip->target;
+	}
+	goto dispatch;
+
+	call:
+	{
+		const SpyCode* target = (ip++)->target;
+		uint32_t num_args = READINT();
+		TOS_STORE();
+		/* the arguments are already in callee order, first one on top */
+		*(int64_t *)(sp += 8) = num_args; /* push number of arguments */
+		*(uint8_t **)(sp += 8) = bp; /* push base pointer */
+		*(int64_t *)(sp += 8) = ip - code; /* push return address (cell index) */
+		TOS_LOAD();
+		bp = sp;
+		SAMPLE_FRAME();
+		ip = target;
+		CALLGRAPH_ENTER();
+		SAFEPOINT(1);
+		JIT();
+	}
+	goto dispatch;
+
+	iret:
+	fret:
+	CALLGRAPH_LEAVE();
+	a = TOPI; /* return value */
+	ip = &code[*(int64_t *)bp];
+	sp = bp - 16 - *(int64_t *)(bp - 16) * 8;
+	bp = *(uint8_t **)(bp - 8);
+	SAMPLE_FRAME();
+	TOPI = a;
+	goto dispatch;
+
+	vret:
+	CALLGRAPH_LEAVE();
+	ip = &code[*(int64_t *)bp];
+	sp = bp - 24 - *(int64_t *)(bp - 16) * 8;
+	bp = *(uint8_t **)(bp - 8);
+	SAMPLE_FRAME();
+	TOS_LOAD();
+	goto dispatch;
+
+	ccall:
+	{
+		uint32_t name_index = READINT();
+		SpyCFunction* cf;
+		ip++; /* number of arguments, they're already in order */
+		SYNC();
+		cf = Spy_findC(S, (const char *)&memory[name_index]);
+		if (!cf) {
+			Spy_crash(S, "Attempt to call undefined C function '%s'\n", &memory[name_index]);
+		}
+		cf->function(S);
+		UNSYNC();
+	}
+	goto dispatch;
+
+	ncall:
+	{
+		uint32_t bound_index = READINT();
+		ip++; /* number of arguments, they're already in order */
+		SYNC();
+		S->c_bound[bound_index](S);
+		UNSYNC();
+	}
+	goto dispatch;
+
+	fpush:
+	b = READFLOAT();
+	PUSHF(b);
+	goto dispatch;
+
+	fadd:
+	POPF(b);
+	SETTOPF(TOPF + b);
+	goto dispatch;
+
+	fsub:
+	POPF(b);
+	SETTOPF(TOPF - b);
+	goto dispatch;
+
+	fmul:
+	POPF(b);
+	SETTOPF(TOPF * b);
+	goto dispatch;
+
+	fdiv:
+	POPF(b);
+	SETTOPF(TOPF / b);
+	goto dispatch;
+
+	fgt:
+	POPF(b);
+	SETTOPF(TOPF > b);
+	goto dispatch;
+
+	fge:
+	POPF(b);
+	SETTOPF(TOPF >= b);
+	goto dispatch;
+
+	flt:
+	POPF(b);
+	SETTOPF(TOPF < b);
+	goto dispatch;
+
+	fle:
+	POPF(b);
+	SETTOPF(TOPF <= b);
+	goto dispatch;
+
+	fcmp:
+	POPF(b);
+	TOPI = TOPF == b;
+	goto dispatch;
+
+	ilload:
+	p = LOCAL(READINT());
+	PUSHI(*(int64_t *)p);
+	goto dispatch;
+
+	ilsave:
+	p = LOCAL(READINT());
+	POPI(a);
+	SAVELOCAL(p, a);
+	goto dispatch;
+
+	iarg:
+	p = bp - 3*8 - READINT()*8;
+	PUSHI(*(int64_t *)p);
+	goto dispatch;
+
+	iload:
+	ider:
+	TOS_STORE();
+	TOPI = *(int64_t *)&memory[TOPI];
+	goto dispatch;
+
+	isave:
+	POPI(a); /* pop value */
+	POPI(c); /* pop address */
+	*(int64_t *)&memory[c] = a;
+	TOS_LOAD();
+	goto dispatch;
+
+	res:
+	TOS_STORE();
+	sp += READINT() * 8;
+	CHECKSTACK();
+	TOS_LOAD();
+	goto dispatch;
+
+	lea:
+	a = LOCAL(READINT()) - memory;
+	PUSHI(a);
+	goto dispatch;
+
+	icinc:
+	TOPI += READINT();
+	goto dispatch;
+
+	cder:
+	TOS_STORE();
+	TOPI = *(uint8_t *)&memory[TOPI];
+	goto dispatch;
+
+	lor:
+	POPI(a);
+	TOPI = TOPI || a;
+	goto dispatch;
+
+	land:
+	POPI(a);
+	TOPI = TOPI && a;
+	goto dispatch;
+
+	padd:
+	POPI(a);
+	TOPI += a * 8;
+	goto dispatch;
+
+	psub:
+	POPI(a);
+	TOPI -= a * 8;
+	goto dispatch;
+
+	log:
+	Spy_flushOutput(S); /* print's output comes first */
+	printf("%lld\n", (long long)READINT());
+	goto dispatch;
+
+	dbon:
+	S->option_flags |= (SPY_DEBUG | SPY_STEP);
+#if !SPY_DEBUGLOOP
+	PROFILE_STOP();
+	SYNC();
+	return SPY_SWITCH;
+#endif
+	goto dispatch;
+
+	dboff:
+	S->option_flags &= ~SPY_DEBUG;
+	S->option_flags &= ~SPY_STEP;
+#if SPY_DEBUGLOOP
+	SYNC();
+	return SPY_SWITCH;
+#endif
+	goto dispatch;
+
+	dbds:
+	SYNC();
+	Spy_dumpStack(S);
+	goto dispatch;
+
+	cjnz:
+	POPI(a); /* location */
+	POPI(c); /* condition */
+	if (c) {
+		CHECKTARGET(a);
+		ip = &code[S->program->code_map[a]];
+		SAFEPOINT(1);
+	}
+	goto dispatch;
+
+	cjz:
+	POPI(a); /* location */
+	POPI(c); /* condition */
+	if (!c) {
+		CHECKTARGET(a);
+		ip = &code[S->program->code_map[a]];
+		SAFEPOINT(1);
+	}
+	goto dispatch;
+
+	cjmp:
+	POPI(a);
+	CHECKTARGET(a);
+	ip = &code[S->program->code_map[a]];
+	SAFEPOINT(1);
+	goto dispatch;
+
+	ilnsave:
+	{
+		uint32_t addr = READINT();
+		uint32_t numsave = READINT();
+		TOS_STORE();
+		/* the deepest value goes to the first local */
+		sp -= numsave * 8;
+		memmove(LOCAL(addr), sp + 8, numsave * 8);
+		TOS_LOAD();
+	}
+	goto dispatch;
+
+	ilnload:
+	{
+		uint32_t addr = READINT();
+		uint32_t numload = READINT();
+		TOS_STORE();
+		for (int i = 0; i < numload; i++) {
+			sp += 8;
+			*(int64_t *)sp = *(int64_t *)LOCAL(addr + i);
+		}
+		TOS_LOAD();
+	}
+	goto dispatch;
+
+	flload:
+	p = LOCAL(READINT());
+	PUSHI(*(int64_t *)p);
+	goto dispatch;
+
+	flsave:
+	p = LOCAL(READINT());
+	POPI(a);
+	SAVELOCAL(p, a);
+	goto dispatch;
+
+	/* ***NOTE*** THIS ADDRESSES OFF THE TOP OF THE STACK */
+	ftoi:
+	p = sp - READINT()*8;
+	TOS_STORE();
+	*(int64_t *)p = (int64_t)*(double *)p;
+	TOS_LOAD();
+	goto dispatch;
+
+	/* ***NOTE*** THIS ADDRESSES OFF THE TOP OF THE STACK */
+	itof:
+	p = sp - READINT()*8;
+	TOS_STORE();
+	*(double *)p = (double)*(int64_t *)p;
+	TOS_LOAD();
+	goto dispatch;
+
+	fder:
+	TOS_STORE();
+	TOPI = *(int64_t *)&memory[TOPI];
+	goto dispatch;
+
+	fsave:
+	POPI(a); /* pop value (as bits) */
+	POPI(c); /* pop address */
+	*(int64_t *)&memory[c] = a;
+	TOS_LOAD();
+	goto dispatch;
+
+	lnot:
+	TOPI = !TOPI;
+	goto dispatch;
+
+	/* superinstructions */
+	ilinc:
+	p = LOCAL(READINT());
+	a = READINT();
+	SAVELOCAL(p, LOADLOCAL(p) + a);
+	goto dispatch;
+
+	ilcinc:
+	p = LOCAL(READINT());
+	a = READINT();
+	PUSHI(*(int64_t *)p + a);
+	goto dispatch;
+
+	illtjz:
+	p = LOCAL(READINT());
+	a = LOADLOCAL(p);
+	p = LOCAL(READINT());
+	if (a < LOADLOCAL(p)) {
+		ip++;
+	} else if (ip->target < ip) {
+		a = ip - ip->target;
+		ip = ip->target;
+		SAFEPOINT(a);
+	} else {
+		ip = ip->target;
+	}
+	goto dispatch;
+
+	ilcltjz:
+	p = LOCAL(READINT());
+	a = READINT();
+	if (LOADLOCAL(p) < a) {
+		ip++;
+	} else if (ip->target < ip) {
+		a = ip - ip->target;
+		ip = ip->target;
+		SAFEPOINT(a);
+	} else {
+		ip = ip->target;
+	}
+	goto dispatch;
+
+	/* coroutines */
+	conew:
+	{
+		const SpyCode* entry = (ip++)->target;
+		POPI(a); /* stack size */
+		SYNC();
+		a = Spy_newCoroutine(S, entry - code, a);
+		PUSHI(a);
+	}
+	goto dispatch;
+
+	resume:
+	POPI(a); /* coroutine */
+	POPI(c); /* value passed in */
+	SYNC();
+	if (Spy_resumeCoroutine(S, a, c)) {
+		TRANSFER(a); /* c is its argument */
+	} else {
+		TRANSFER(a);
+		PUSHI(c);
+	}
+	goto dispatch;
+
+	yield:
+	POPI(a);
+	SYNC();
+	c = Spy_leaveCoroutine(S, COROUTINE_SUSPENDED);
+	TRANSFER(c);
+	PUSHI(a);
+	goto dispatch;
+
+	done:
+	PROFILE_STOP();
+	SYNC();
+#if SPY_DEBUGLOOP
+	printf("\nSpyre process terminated\n");
+	printf("%d instructions were executed\n", total);
+#endif
+
+	return SPY_HALT;
+
+}
+
+#undef TOS_LOAD
+#undef TOS_STORE
+#undef TOPI
+#undef PUSHI
+#undef DROP
+#undef LOADLOCAL
+#undef SAVELOCAL
+#undef POPI
+#undef TOPF
+#undef SETTOPF
+#undef PUSHF
+#undef POPF
+#undef LOCAL
+#undef READINT
+#undef READFLOAT
+#undef SYNC
+#undef UNSYNC
+#undef CHECKSTACK
+#undef CHECKTARGET
+#undef CHECKDIVISOR
+#undef SAFEPOINT
+#undef TRANSFER
+#undef JIT
+#undef PROFILE_STOP
+#undef CALLGRAPH_ENTER
+#undef CALLGRAPH_LEAVE
+#undef SAMPLE_FRAME
@@ -5,11 +5,13 @@
 #include "generate.h"
 
 #define FORMAT_FUNCTION "__FUNC__%s"
+#define FORMAT_CFUNCTION "__CFUNC__%s" /* the constant holding a cfunc's name */
 #define FORMAT_LABEL "__LABEL__%04d"
 #define FORMAT_JMP "jmp " FORMAT_LABEL "\n"
 #define FORMAT_JZ "jz " FORMAT_LABEL "\n"
 #define FORMAT_JNZ "jnz " FORMAT_LABEL "\n"
 #define FORMAT_COMMENT_NUM ";  %d\n"
+#define FORMAT_COMMENT_FILE ";  file %s\n" /* the assembler keeps both in its line table */
 
 #define FORMAT_FUNCTION_HEAD FORMAT_FUNCTION ":\n"
 #define FORMAT_LABEL_HEAD FORMAT_LABEL ":\n"
@@ -39,6 +41,8 @@ static void generate_function(CompileState*);
 static void generate_expression(CompileState*, ExpNode*);
 static void generate_while(CompileState*);
 static void generate_for(CompileState*);
+static void generate_return(CompileState*);
+static void generate_arguments(CompileState*, ExpNode*);
 
 /* misc function */
 static int advance(CompileState*);
@@ -184,11 +188,37 @@ advance(CompileState* C) {
 static void
 generate_function(CompileState* C) {
 	TreeFunction* func = C->at->funcval;
+	/* a declaration has no code, a C function only needs its name in
+	 * the ROM for CCALL */
+	if (!func->implemented) {
+		if (func->modifiers & MOD_CFUNC) {
+			outb(C, "let " FORMAT_CFUNCTION " \"%s\"\n", func->identifier, func->identifier);
+		}
+		return;
+	}
 	C->return_label = C->label_count++;
 	outb(C, FORMAT_FUNCTION_HEAD, func->identifier); /* write function label */
 	outb(C, "res %d\n",	func->stack_space); /* reserve bytes for local vars */
+	/* parameters live in the first locals, copy them out of the arguments */
+	int arg = 0;
+	for (TreeVariableList* i = func->params; i; i = i->next) {
+		outb(C, "iarg %d\n", arg++);
+		outb(C, "ilsave %d\n", i->variable->offset/8);
+	}
 	pushb(C, FORMAT_LABEL_HEAD, C->return_label);
-	pushb(C, "iret\n"); /* return instruction */
+	if (strcmp(func->return_type->type_name, "void")) {
+		pushb(C, "iret\n"); /* return instruction */
+	} else {
+		pushb(C, "vret\n"); /* nothing to return */
+	}
+}
+
+static void
+generate_return(CompileState* C) {
+	if (C->at->stateval) {
+		generate_expression(C, C->at->stateval);
+	}
+	outb(C, FORMAT_JMP, C->return_label);
 }
 
 static void
@@ -380,11 +410,36 @@ generate_expression(CompileState* C, ExpNode* expression) {
 		case EXP_FLOAT:
 			C->write(C, "fpush %f\n", expression->fval);
 			break;
+		case EXP_FUNC_CALL: {
+			FuncCall* call = expression->fcval;
+			if (call->argument) {
+				generate_arguments(C, call->argument);
+			}
+			if (call->func->modifiers & MOD_CFUNC) {
+				C->write(C, "ccall " FORMAT_CFUNCTION ", %d\n", call->func->identifier, call->func->nparams);
+			} else {
+				C->write(C, "call " FORMAT_FUNCTION ", %d\n", call->func->identifier, call->func->nparams);
+			}
+			break;
+		}
+	}
+}
+
+/* arguments are pushed last to first, so that the first one ends up on
+ * top of the stack where the callee (and the VM) expects it.  the whole
+ * list is one left associative comma expression, ((a, b), c) */
+static void
+generate_arguments(CompileState* C, ExpNode* argument) {
+	if (argument->type == EXP_BINOP && argument->bval->type == TOK_COMMA) {
+		generate_arguments(C, argument->bval->right);
+		generate_arguments(C, argument->bval->left);
+	} else {
+		generate_expression(C, argument);
 	}
 }
 
 void
-generate_bytecode(TreeNode* root, const char* outfile) {
+generate_bytecode(TreeNode* root, const char* source, const char* outfile) {
 	CompileState* C = malloc(sizeof(CompileState));
 	C->root_node = root;
 	C->at = root;
@@ -397,6 +452,7 @@ generate_bytecode(TreeNode* root, const char* outfile) {
 		printf("couldn't open file '%s' for writing", outfile);
 	}
 
+	outb(C, FORMAT_COMMENT_FILE, source);
 	outb(C, "jmp __LABEL__ENTRY\n");
 
 	do {
@@ -417,8 +473,10 @@ generate_bytecode(TreeNode* root, const char* outfile) {
 			case NODE_FOR:
 				generate_for(C);
 				break;
-			case NODE_BLOCK:
 			case NODE_RETURN:
+				generate_return(C);
+				break;
+			case NODE_BLOCK:
 			case NODE_BREAK:
 			case NODE_CONTINUE:
 				break;
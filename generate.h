@@ -25,6 +25,6 @@ struct CompileState {
 	
 };
 
-void generate_bytecode(TreeNode*, const char*);
+void generate_bytecode(TreeNode*, const char*, const char*);
 
 #endif
@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap.h"
+
+/* the VM heap: a segregated fit allocator whose every byte of metadata
+ * lives in VM memory.  free blocks are kept on a list per size class,
+ * exact classes up to HEAP_SMALL and power of two classes above it, with
+ * a bit per class telling which lists have blocks.  boundary tags let a
+ * freed block merge with free neighbours in constant time, so neither
+ * malloc nor free depends on how many blocks are live.  memory past
+ * SpyHeap.top was never handed out, the heap grows into it and shrinks
+ * back when the block below it is freed */
+
+#define WORD(a)		(*(uint64_t *)&S->memory[a])
+#define SIZE(a)		(WORD(a) & HEAP_SIZEMASK)
+
+/* returns a block's payload, 0 if the heap is out of room */
+uint64_t
+Spy_heapAlloc(SpyState* S, uint64_t size) {
+	SpyHeap* H = Heap_get(S);
+	uint64_t need;
+	uint64_t b = 0;
+	uint32_t c;
+	if (!H || size > S->heap_size) return 0;
+	need = (size + 8 + HEAP_ALIGN - 1) & ~(uint64_t)(HEAP_ALIGN - 1);
+	if (need < HEAP_MINBLOCK) need = HEAP_MINBLOCK;
+
+	/* every block of a small class fits, in a large class only the
+	 * first one is looked at, any block of a larger class fits */
+	c = Heap_class(need);
+	if (H->free[c] && SIZE(H->free[c]) >= need) {
+		b = H->free[c];
+	} else if (c + 1 < HEAP_CLASSES && (H->nonempty >> (c + 1))) {
+		b = H->free[c + 1 + __builtin_ctzll(H->nonempty >> (c + 1))];
+	}
+	if (b) {
+		uint64_t bsize = SIZE(b);
+		Heap_unlink(S, b, bsize);
+		Heap_split(S, b, bsize, need);
+	} else {
+		b = H->top;
+		if (!Spy_commitHeap(S, b + need)) return 0;
+		WORD(b) = need | HEAP_USED | HEAP_PREVUSED;
+		H->top = b + need;
+	}
+
+	H->allocations[c]++;
+	H->live += SIZE(b);
+	if (H->live > H->peak) H->peak = H->live;
+	if (S->alloc_sites) {
+		uint32_t site = Heap_site(S);
+		HeapSite* at = &S->alloc_sites->sites[site];
+		WORD(b) |= (uint64_t)site << HEAP_SIZEBITS;
+		at->allocations++;
+		at->bytes += SIZE(b);
+		at->live++;
+		at->live_bytes += SIZE(b);
+	}
+	return b + 8;
+}
+
+void
+Spy_heapFree(SpyState* S, uint64_t address) {
+	static const char* errmsg = "Attempt to free an invalid pointer (0x%llx)";
+	SpyHeap* H = S->heap_committed ? Heap_get(S) : NULL;
+	uint64_t b = address - 8;
+	uint64_t size, next;
+	if (!H || address < Heap_first(S) + 8 || address >= H->top ||
+		(b & (HEAP_ALIGN - 1)) != (Heap_first(S) & (HEAP_ALIGN - 1)) || !(WORD(b) & HEAP_USED)) {
+		Spy_crash(S, errmsg, (unsigned long long)address);
+	}
+	size = SIZE(b);
+	H->live -= size;
+	H->frees++;
+	if (S->alloc_sites) {
+		uint64_t site = WORD(b) >> HEAP_SIZEBITS;
+		HeapSite* at = &S->alloc_sites->sites[site < S->alloc_sites->count ? site : 0];
+		at->live--;
+		at->live_bytes -= size;
+	}
+
+	/* free blocks are never next to each other, the merged block has a
+	 * block in use (or nothing) below it.  the header left inside it must
+	 * not look used, or freeing the address again would pass the checks */
+	if (!(WORD(b) & HEAP_PREVUSED)) {
+		uint64_t psize = WORD(b - 8);
+		WORD(b) = 0;
+		b -= psize;
+		Heap_unlink(S, b, psize);
+		size += psize;
+	}
+	next = b + size;
+	if (next == H->top) {
+		H->top = b;
+		return;
+	}
+	if (!(WORD(next) & HEAP_USED)) {
+		uint64_t nsize = SIZE(next);
+		Heap_unlink(S, next, nsize);
+		size += nsize;
+	} else {
+		WORD(next) &= ~(uint64_t)HEAP_PREVUSED;
+	}
+	WORD(b) = size | HEAP_PREVUSED;
+	WORD(b + size - 8) = size;
+	Heap_link(S, b, size);
+}
+
+/* arenas hand out memory by bumping a cursor through a heap block and
+ * give all of it back at once.  an arena is a heap block starting with
+ * ARENA_HEADER bytes:
+ *
+ *	magic  cursor  end  chunks  size
+ *
+ * followed by 'size' bytes.  when they run out another chunk of at least
+ * 'size' bytes is allocated from the heap, chunks start with the address
+ * of the previous one and ARENA_ALIGN bytes of padding.  returns the
+ * arena, 0 if the heap is out of room */
+uint64_t
+Spy_arenaNew(SpyState* S, uint64_t size) {
+	uint64_t a;
+	if (size > S->heap_size) return 0; /* before rounding, a negative size would wrap */
+	size = (size + ARENA_ALIGN - 1) & ~(uint64_t)(ARENA_ALIGN - 1);
+	if (!(a = Spy_heapAlloc(S, ARENA_HEADER + size))) return 0;
+	WORD(a) = ARENA_MAGIC;
+	WORD(a + 8) = a + ARENA_HEADER;
+	WORD(a + 16) = a + ARENA_HEADER + size;
+	WORD(a + 24) = 0;
+	WORD(a + 32) = size;
+	return a;
+}
+
+/* 'n' bytes from arena a, 0 if the heap is out of room */
+uint64_t
+Spy_arenaAlloc(SpyState* S, uint64_t a, uint64_t n) {
+	uint64_t at;
+	Arena_check(S, a);
+	if (n > S->heap_size) return 0;
+	n = (n + ARENA_ALIGN - 1) & ~(uint64_t)(ARENA_ALIGN - 1);
+	if (n > WORD(a + 16) - WORD(a + 8)) {
+		uint64_t size = n > WORD(a + 32) ? n : WORD(a + 32);
+		uint64_t chunk;
+		if (size > S->heap_size || !(chunk = Spy_heapAlloc(S, 2 * ARENA_ALIGN + size))) return 0;
+		WORD(chunk) = WORD(a + 24);
+		WORD(a + 24) = chunk;
+		WORD(a + 8) = chunk + 2 * ARENA_ALIGN;
+		WORD(a + 16) = chunk + 2 * ARENA_ALIGN + size;
+	}
+	at = WORD(a + 8);
+	WORD(a + 8) = at + n;
+	return at;
+}
+
+/* frees everything allocated from arena a, the first 'size' bytes are
+ * kept for reuse */
+void
+Spy_arenaReset(SpyState* S, uint64_t a) {
+	Arena_check(S, a);
+	while (WORD(a + 24)) {
+		uint64_t chunk = WORD(a + 24);
+		WORD(a + 24) = WORD(chunk);
+		Spy_heapFree(S, chunk);
+	}
+	WORD(a + 8) = a + ARENA_HEADER;
+	WORD(a + 16) = a + ARENA_HEADER + WORD(a + 32);
+}
+
+void
+Spy_arenaFree(SpyState* S, uint64_t a) {
+	Spy_arenaReset(S, a);
+	WORD(a) = 0;
+	Spy_heapFree(S, a);
+}
+
+SpyAllocSites*
+Spy_newAllocSites(SpyState* S) {
+	SpyAllocSites* A = (SpyAllocSites *)calloc(1, sizeof(SpyAllocSites));
+	if (!A) Spy_crash(S, "Out of memory\n");
+	A->capacity = 64;
+	A->count = 1;
+	A->sites = (HeapSite *)calloc(A->capacity, sizeof(HeapSite));
+	A->by_cell = (uint32_t *)calloc(S->program->code_size, sizeof(uint32_t));
+	if (!A->sites || !A->by_cell) Spy_crash(S, "Out of memory\n");
+	A->sites[0].offset = UINT32_MAX;
+	return A;
+}
+
+void
+Spy_freeAllocSites(SpyState* S) {
+	if (!S->alloc_sites) return;
+	free(S->alloc_sites->sites);
+	free(S->alloc_sites->by_cell);
+	free(S->alloc_sites);
+	S->alloc_sites = NULL;
+}
+
+/* prints the heap's statistics to stderr, and the sites holding the most
+ * memory and the sites that allocated the most if they're recorded */
+void
+Spy_heapReport(SpyState* S) {
+	SpyHeap* H = S->heap_committed ? Heap_get(S) : NULL;
+	uint64_t allocations = 0;
+	uint64_t span;
+	Spy_flushOutput(S); /* keep the program's output before the report */
+	if (!H) {
+		fprintf(stderr, "\nheap, nothing allocated\n");
+		return;
+	}
+	for (int c = 0; c < HEAP_CLASSES; c++) {
+		allocations += H->allocations[c];
+	}
+	span = H->top - Heap_first(S);
+	fprintf(stderr, "\nheap, %llu allocations, %llu frees, %llu bytes live, %llu bytes at the peak\n",
+		(unsigned long long)allocations, (unsigned long long)H->frees,
+		(unsigned long long)H->live, (unsigned long long)H->peak);
+	fprintf(stderr, "%llu bytes in use, %llu of them free in %llu blocks, %.2f%% fragmentation\n",
+		(unsigned long long)span, (unsigned long long)H->free_bytes, (unsigned long long)H->free_blocks,
+		100.0 * H->free_bytes / (span ? span : 1));
+	fprintf(stderr, "%-20s %14s %7s\n", "block size", "allocations", "%");
+	for (uint32_t c = 0; c < HEAP_CLASSES; c++) {
+		char size[32];
+		if (!H->allocations[c]) continue;
+		if (c <= Heap_class(HEAP_SMALL)) {
+			snprintf(size, sizeof(size), "%u", (c + HEAP_MINBLOCK / HEAP_ALIGN) * HEAP_ALIGN);
+		} else {
+			unsigned shift = c - Heap_class(HEAP_SMALL) - 1 + __builtin_ctzll(HEAP_SMALL);
+			snprintf(size, sizeof(size), "%llu-%llu", c == Heap_class(HEAP_SMALL) + 1 ? HEAP_SMALL + 1ULL : 1ULL << shift,
+				(2ULL << shift) - 1);
+		}
+		fprintf(stderr, "%-20s %14llu %6.2f%%\n", size, (unsigned long long)H->allocations[c],
+			100.0 * H->allocations[c] / allocations);
+	}
+	if (S->alloc_sites) {
+		SpyAllocSites* A = S->alloc_sites;
+		HeapSite* sites = (HeapSite *)malloc(A->count * sizeof(HeapSite));
+		if (!sites) Spy_crash(S, "Out of memory\n");
+		memcpy(sites, A->sites, A->count * sizeof(HeapSite));
+		fprintf(stderr, "\nallocation sites, by bytes live\n");
+		Heap_printSites(S, sites, A->count, Heap_compareLive);
+		fprintf(stderr, "\nallocation sites, by bytes allocated\n");
+		Heap_printSites(S, sites, A->count, Heap_compareBytes);
+		free(sites);
+	}
+}
+
+/* prints every block from the bottom of the heap up */
+void
+Spy_dumpHeap(SpyState* S) {
+	SpyHeap* H = S->heap_committed ? Heap_get(S) : NULL;
+	int index = 0;
+	if (!H) return;
+	for (uint64_t b = Heap_first(S); b < H->top; b += SIZE(b)) {
+		printf("block %d:\n\t%llu bytes %s\n\tvm address: 0x%llX\n", index++, (unsigned long long)SIZE(b) - 8,
+			(WORD(b) & HEAP_USED) ? "in use" : "free", (unsigned long long)b + 8);
+	}
+	printf("top: 0x%llX\n", (unsigned long long)H->top);
+}
+
+/* the allocator's state, set up the first time S allocates */
+static SpyHeap*
+Heap_get(SpyState* S) {
+	SpyHeap* H = (SpyHeap *)&S->memory[S->heap_start];
+	if (S->heap_committed) return H;
+	if (!Spy_commitHeap(S, Heap_first(S))) return NULL;
+	memset(H, 0, sizeof(SpyHeap));
+	H->top = Heap_first(S);
+	return H;
+}
+
+/* where the first block's header goes, its payload is aligned */
+static uint64_t
+Heap_first(SpyState* S) {
+	return ((S->heap_start + sizeof(SpyHeap) + 8 + HEAP_ALIGN - 1) & ~(uint64_t)(HEAP_ALIGN - 1)) - 8;
+}
+
+static uint32_t
+Heap_class(uint64_t size) {
+	uint32_t c;
+	if (size <= HEAP_SMALL) {
+		return size / HEAP_ALIGN - HEAP_MINBLOCK / HEAP_ALIGN;
+	}
+	/* HEAP_SMALL + 1 up to the next power of two is the first large class */
+	c = HEAP_SMALL / HEAP_ALIGN - HEAP_MINBLOCK / HEAP_ALIGN + 1 + (63 - __builtin_clzll(size)) - __builtin_ctzll(HEAP_SMALL);
+	return c < HEAP_CLASSES ? c : HEAP_CLASSES - 1;
+}
+
+static void
+Heap_link(SpyState* S, uint64_t b, uint64_t size) {
+	SpyHeap* H = (SpyHeap *)&S->memory[S->heap_start];
+	const uint32_t c = Heap_class(size);
+	WORD(b + 8) = H->free[c];
+	WORD(b + 16) = 0;
+	if (H->free[c]) WORD(H->free[c] + 16) = b;
+	H->free[c] = b;
+	H->nonempty |= (uint64_t)1 << c;
+	H->free_bytes += size;
+	H->free_blocks++;
+}
+
+static void
+Heap_unlink(SpyState* S, uint64_t b, uint64_t size) {
+	SpyHeap* H = (SpyHeap *)&S->memory[S->heap_start];
+	const uint32_t c = Heap_class(size);
+	const uint64_t next = WORD(b + 8);
+	const uint64_t prev = WORD(b + 16);
+	if (prev) {
+		WORD(prev + 8) = next;
+	} else {
+		H->free[c] = next;
+		if (!next) H->nonempty &= ~((uint64_t)1 << c);
+	}
+	if (next) WORD(next + 16) = prev;
+	H->free_bytes -= size;
+	H->free_blocks--;
+}
+
+/* hands out the first 'need' bytes of free block b, what's left over
+ * becomes a free block if it's large enough */
+static void
+Heap_split(SpyState* S, uint64_t b, uint64_t bsize, uint64_t need) {
+	SpyHeap* H = (SpyHeap *)&S->memory[S->heap_start];
+	const uint64_t prev = WORD(b) & HEAP_PREVUSED;
+	if (bsize - need >= HEAP_MINBLOCK) {
+		const uint64_t rest = b + need;
+		WORD(b) = need | HEAP_USED | prev;
+		WORD(rest) = (bsize - need) | HEAP_PREVUSED;
+		WORD(rest + bsize - need - 8) = bsize - need;
+		Heap_link(S, rest, bsize - need);
+		return;
+	}
+	WORD(b) = bsize | HEAP_USED | prev;
+	if (b + bsize != H->top) WORD(b + bsize) |= HEAP_PREVUSED;
+}
+
+static void
+Arena_check(SpyState* S, uint64_t a) {
+	SpyHeap* H = S->heap_committed ? Heap_get(S) : NULL;
+	if (!H || a < Heap_first(S) + 8 || a >= H->top || (a & (ARENA_ALIGN - 1)) ||
+		!(WORD(a - 8) & HEAP_USED) || WORD(a) != ARENA_MAGIC) {
+		Spy_crash(S, "invalid arena (0x%llx)", (unsigned long long)a);
+	}
+}
+
+/* the site of the C function call S is in, a new one the first time it
+ * allocates */
+static uint32_t
+Heap_site(SpyState* S) {
+	SpyAllocSites* A = S->alloc_sites;
+	size_t cell;
+	uint32_t offset;
+	if (!S->code || !S->ip || S->ip <= S->code) return 0;
+	cell = S->ip - 1 - S->code;
+	if (cell >= S->program->code_size) return 0;
+	if (A->by_cell[cell]) return A->by_cell[cell];
+
+	/* the JIT leaves ip at a different cell of the same CALL */
+	offset = S->program->cell_offsets[cell];
+	for (size_t i = 1; i < A->count; i++) {
+		if (A->sites[i].offset == offset) return A->by_cell[cell] = i;
+	}
+	if (A->count == HEAP_MAXSITES) return 0;
+	if (A->count == A->capacity) {
+		A->capacity *= 2;
+		A->sites = (HeapSite *)realloc(A->sites, A->capacity * sizeof(HeapSite));
+		if (!A->sites) Spy_crash(S, "Out of memory\n");
+	}
+	memset(&A->sites[A->count], 0, sizeof(HeapSite));
+	A->sites[A->count].offset = offset;
+	A->by_cell[cell] = A->count;
+	return A->count++;
+}
+
+static int
+Heap_compareLive(const void* a, const void* b) {
+	const HeapSite* x = (const HeapSite *)a;
+	const HeapSite* y = (const HeapSite *)b;
+	if (x->live_bytes != y->live_bytes) return x->live_bytes < y->live_bytes ? 1 : -1;
+	if (x->bytes != y->bytes) return x->bytes < y->bytes ? 1 : -1;
+	return 0;
+}
+
+static int
+Heap_compareBytes(const void* a, const void* b) {
+	const HeapSite* x = (const HeapSite *)a;
+	const HeapSite* y = (const HeapSite *)b;
+	if (x->bytes != y->bytes) return x->bytes < y->bytes ? 1 : -1;
+	if (x->allocations != y->allocations) return x->allocations < y->allocations ? 1 : -1;
+	return 0;
+}
+
+static void
+Heap_printSites(SpyState* S, HeapSite* sites, size_t count, int (*compare)(const void*, const void*)) {
+	qsort(sites, count, sizeof(HeapSite), compare);
+	fprintf(stderr, "%8s %12s %14s %10s %14s  %s\n", "offset", "allocations", "bytes", "live", "live bytes", "source");
+	for (size_t i = 0; i < count && i < HEAP_SITES; i++) {
+		const HeapSite* at = &sites[i];
+		SpyLocation location;
+		if (!at->allocations || (compare == Heap_compareLive && !at->live_bytes)) break;
+		if (at->offset == UINT32_MAX) {
+			fprintf(stderr, "%8s ", "-");
+		} else {
+			fprintf(stderr, "%8u ", at->offset);
+		}
+		fprintf(stderr, "%12llu %14llu %10llu %14llu  ", (unsigned long long)at->allocations,
+			(unsigned long long)at->bytes, (unsigned long long)at->live, (unsigned long long)at->live_bytes);
+		if (at->offset == UINT32_MAX) {
+			fprintf(stderr, "(outside of a run)");
+		} else {
+			Spy_locateOffset(S, at->offset, &location);
+			if (location.file) {
+				fprintf(stderr, "%s:%u", location.file, location.line);
+			}
+			if (location.function) {
+				fprintf(stderr, " in %s", location.function);
+			}
+		}
+		fputc('\n', stderr);
+	}
+}
@@ -0,0 +1,85 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include "spyre.h"
+
+#define HEAP_ALIGN		16 /* block sizes are multiples of this, payloads are aligned to it */
+#define HEAP_MINBLOCK	32 /* header, two free list links and the footer */
+#define HEAP_SMALL		512 /* blocks up to this size have a free list per HEAP_ALIGN bytes */
+#define HEAP_CLASSES	64
+
+/* block header flags, the rest of the header is the block size */
+#define HEAP_USED		0x1
+#define HEAP_PREVUSED	0x2 /* the block right below is in use, else its footer holds its size */
+#define HEAP_FLAGS		0xF
+#define HEAP_SIZEBITS	40 /* a block in use keeps its allocation site above its size */
+#define HEAP_SIZEMASK	((((uint64_t)1 << HEAP_SIZEBITS) - 1) & ~(uint64_t)HEAP_FLAGS)
+#define HEAP_MAXSITES	(((uint64_t)1 << (64 - HEAP_SIZEBITS)) - 1)
+#define HEAP_SITES		20 /* sites listed in the report */
+
+#define ARENA_MAGIC		0x414E455241595053 /* "SPYARENA", first word of every arena */
+#define ARENA_HEADER	40 /* magic, cursor, end, extra chunks, chunk size */
+#define ARENA_ALIGN		8
+
+typedef struct SpyHeap SpyHeap;
+typedef struct HeapSite HeapSite;
+
+/* the allocator's state, kept in VM memory at the start of the heap.
+ * every block starts with a header word, the payload follows it.  a
+ * free block holds the VM addresses of the next and previous free block
+ * of its class after the header and repeats its size in its last word */
+struct SpyHeap {
+	uint64_t		free[HEAP_CLASSES]; /* first free block of each class, 0 if none */
+	uint64_t		nonempty; /* bit per class with a free block */
+	uint64_t		top; /* first byte never handed out, the block below it is in use */
+
+	/* statistics, block sizes include their header */
+	uint64_t		live; /* bytes in blocks in use */
+	uint64_t		peak;
+	uint64_t		free_bytes; /* bytes in blocks on the free lists */
+	uint64_t		free_blocks;
+	uint64_t		frees;
+	uint64_t		allocations[HEAP_CLASSES]; /* by the class of the block asked for */
+};
+
+/* a CALL of a C function that allocated, see SPY_ALLOCSITES */
+struct HeapSite {
+	uint32_t		offset; /* code offset of the call */
+	uint64_t		allocations;
+	uint64_t		bytes;
+	uint64_t		live; /* blocks not freed yet */
+	uint64_t		live_bytes;
+};
+
+/* the allocation sites, kept by the host.  site 0 stands for blocks
+ * allocated outside of a run or when the table is full */
+struct SpyAllocSites {
+	HeapSite*		sites;
+	size_t			count;
+	size_t			capacity;
+	uint32_t*		by_cell; /* site of the call at each cell, 0 if none yet */
+};
+
+uint64_t	Spy_heapAlloc(SpyState*, uint64_t);
+void		Spy_heapFree(SpyState*, uint64_t);
+uint64_t	Spy_arenaNew(SpyState*, uint64_t);
+uint64_t	Spy_arenaAlloc(SpyState*, uint64_t, uint64_t);
+void		Spy_arenaReset(SpyState*, uint64_t);
+void		Spy_arenaFree(SpyState*, uint64_t);
+SpyAllocSites*	Spy_newAllocSites(SpyState*);
+void		Spy_freeAllocSites(SpyState*);
+void		Spy_heapReport(SpyState*);
+
+static SpyHeap*	Heap_get(SpyState*);
+static uint64_t	Heap_first(SpyState*);
+static uint32_t	Heap_class(uint64_t);
+static void		Heap_link(SpyState*, uint64_t, uint64_t);
+static void		Heap_unlink(SpyState*, uint64_t, uint64_t);
+static void		Heap_split(SpyState*, uint64_t, uint64_t, uint64_t);
+static void		Arena_check(SpyState*, uint64_t);
+static uint32_t	Heap_site(SpyState*);
+static int		Heap_compareLive(const void*, const void*);
+static int		Heap_compareBytes(const void*, const void*);
+static void		Heap_printSites(SpyState*, HeapSite*, size_t, int (*)(const void*, const void*));
+
+#endif
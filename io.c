@@ -0,0 +1,180 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include "io.h"
+
+/* asynchronous file I/O.  fread_async and fwrite_async queue a transfer
+ * between a file and a range of VM memory and return a handle right
+ * away, IO_THREADS threads shared by every state move the bytes with
+ * pread and pwrite.  io_done polls a handle, io_wait blocks until its
+ * transfer is done and releases it, so a program can work on one buffer
+ * while the next one is read.
+ *
+ * transfers use explicit file offsets, they never move the stream's
+ * position or go through its buffer.  the kernel checks the VM range, a
+ * transfer touching memory that isn't accessible fails with -1 instead
+ * of faulting.  a state waits for its transfers before it's freed, a
+ * program must not close a file or free a buffer that one is using */
+
+static pthread_once_t io_started = PTHREAD_ONCE_INIT;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER; /* the queue and every request's 'done' */
+static pthread_cond_t io_work = PTHREAD_COND_INITIALIZER; /* a request was queued */
+static pthread_cond_t io_finished = PTHREAD_COND_INITIALIZER; /* a request is done */
+static IORequest* io_head = NULL;
+static IORequest* io_tail = NULL;
+
+/* queues a transfer of 'bytes' between VM address 'address' and file f
+ * at 'offset', into the file if 'write'.  returns its handle */
+int64_t
+Spy_ioSubmit(SpyState* S, FILE* f, int write, uint64_t address, uint64_t bytes, int64_t offset) {
+	const uint64_t top = S->heap_start + S->heap_size;
+	SpyIO* io = S->io;
+	IORequest* R;
+	size_t handle;
+	if (!f || address > top || bytes > top - address || offset < 0) {
+		Spy_crash(S, "invalid asynchronous %s of %llu bytes at 0x%llx", write ? "write" : "read",
+			(unsigned long long)bytes, (unsigned long long)address);
+	}
+	if (!io) {
+		io = S->io = (SpyIO *)calloc(1, sizeof(SpyIO));
+		if (!io) Spy_crash(S, "Out of memory\n");
+	}
+	if (io->pending == io->capacity) {
+		size_t capacity = io->capacity ? io->capacity * 2 : 16;
+		io->requests = (IORequest **)realloc(io->requests, capacity * sizeof(IORequest *));
+		if (!io->requests) Spy_crash(S, "Out of memory\n");
+		memset(&io->requests[io->capacity], 0, (capacity - io->capacity) * sizeof(IORequest *));
+		io->capacity = capacity;
+	}
+	for (handle = 0; io->requests[handle]; handle++) {
+		/* there's a free one, pending < capacity */
+	}
+	if (write) {
+		fflush(f); /* what the program wrote through the stream goes first */
+	}
+	R = (IORequest *)malloc(sizeof(IORequest));
+	if (!R) Spy_crash(S, "Out of memory\n");
+	R->fd = fileno(f);
+	R->write = write != 0;
+	R->memory = &S->memory[address];
+	R->bytes = bytes;
+	R->offset = offset;
+	R->result = -1;
+	R->done = 0;
+	R->next = NULL;
+	io->requests[handle] = R;
+	io->pending++;
+
+	pthread_once(&io_started, IO_start);
+	pthread_mutex_lock(&io_lock);
+	if (io_tail) io_tail->next = R;
+	else io_head = R;
+	io_tail = R;
+	pthread_cond_signal(&io_work);
+	pthread_mutex_unlock(&io_lock);
+	return handle + 1;
+}
+
+/* whether the transfer behind 'handle' is done, without waiting */
+int
+Spy_ioDone(SpyState* S, int64_t handle) {
+	return __atomic_load_n(&IO_request(S, handle)->done, __ATOMIC_ACQUIRE);
+}
+
+/* waits for the transfer behind 'handle' and releases the handle.
+ * returns the bytes moved, fewer at the end of the file, -1 if nothing
+ * could be */
+int64_t
+Spy_ioWait(SpyState* S, int64_t handle) {
+	IORequest* R = IO_request(S, handle);
+	int64_t result;
+	pthread_mutex_lock(&io_lock);
+	while (!R->done) {
+		pthread_cond_wait(&io_finished, &io_lock);
+	}
+	pthread_mutex_unlock(&io_lock);
+	result = R->result;
+	free(R);
+	S->io->requests[handle - 1] = NULL;
+	S->io->pending--;
+	return result;
+}
+
+/* waits for every transfer S still has going, the pool may be writing
+ * to its memory */
+void
+Spy_ioFree(SpyState* S) {
+	SpyIO* io = S->io;
+	if (!io) return;
+	for (size_t i = 0; i < io->capacity; i++) {
+		if (io->requests[i]) Spy_ioWait(S, i + 1);
+	}
+	free(io->requests);
+	free(io);
+	S->io = NULL;
+}
+
+/* the pool, started by the first request.  its threads block every
+ * signal, SIGPROF and the fault handler are for interpreting threads */
+static void
+IO_start(void) {
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < IO_THREADS; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, IO_worker, NULL)) {
+			Spy_crash(NULL, "couldn't start a thread\n");
+		}
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void*
+IO_worker(void* arg) {
+	(void)arg;
+	for (;;) {
+		IORequest* R;
+		uint64_t moved = 0;
+		ssize_t n = 0;
+		pthread_mutex_lock(&io_lock);
+		while (!io_head) {
+			pthread_cond_wait(&io_work, &io_lock);
+		}
+		R = io_head;
+		io_head = R->next;
+		if (!io_head) io_tail = NULL;
+		pthread_mutex_unlock(&io_lock);
+
+		while (moved < R->bytes) {
+			if (R->write) {
+				n = pwrite(R->fd, R->memory + moved, R->bytes - moved, R->offset + moved);
+			} else {
+				n = pread(R->fd, R->memory + moved, R->bytes - moved, R->offset + moved);
+			}
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) break;
+			moved += n;
+		}
+
+		pthread_mutex_lock(&io_lock);
+		R->result = n < 0 && !moved ? -1 : (int64_t)moved;
+		__atomic_store_n(&R->done, 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&io_finished);
+		pthread_mutex_unlock(&io_lock);
+	}
+	return NULL;
+}
+
+/* the request behind 'handle', crashes if there's none */
+static IORequest*
+IO_request(SpyState* S, int64_t handle) {
+	if (!S->io || handle < 1 || (uint64_t)handle > S->io->capacity || !S->io->requests[handle - 1]) {
+		Spy_crash(S, "invalid I/O handle %lld", (long long)handle);
+	}
+	return S->io->requests[handle - 1];
+}
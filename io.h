@@ -0,0 +1,39 @@
+#ifndef IO_H
+#define IO_H
+
+#include "spyre.h"
+
+#define IO_THREADS		4 /* threads serving every state's requests */
+
+typedef struct IORequest IORequest;
+
+/* a read or write of a range of VM memory, queued for the pool.  'done'
+ * and 'result' are the pool's until 'done' is set */
+struct IORequest {
+	int				fd;
+	uint8_t			write;
+	uint8_t*		memory; /* host address of the range */
+	uint64_t		bytes;
+	int64_t			offset; /* file offset */
+	int64_t			result; /* bytes moved, -1 on error */
+	uint8_t			done;
+	IORequest*		next; /* in the pool's queue */
+};
+
+/* a state's requests, a handle is an index into 'requests' plus one */
+struct SpyIO {
+	IORequest**		requests; /* NULL for free handles */
+	size_t			capacity;
+	size_t			pending; /* handles in use */
+};
+
+int64_t			Spy_ioSubmit(SpyState*, FILE*, int, uint64_t, uint64_t, int64_t);
+int				Spy_ioDone(SpyState*, int64_t);
+int64_t			Spy_ioWait(SpyState*, int64_t);
+void			Spy_ioFree(SpyState*);
+
+static void		IO_start(void);
+static void*	IO_worker(void*);
+static IORequest*	IO_request(SpyState*, int64_t);
+
+#endif
@@ -0,0 +1,732 @@
+#define _DEFAULT_SOURCE /* mmap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "jit.h"
+#include "assembler.h"
+
+/* baseline template JIT for x86-64.  code that gets hot (a CALL target or
+ * the target of a backward jump reached S->jit_threshold times) is
+ * compiled together with everything reachable from it inside the same
+ * function.  every instruction becomes a fixed sequence of machine code
+ * working directly on VM memory, so the stack and frames look exactly
+ * like they do in the interpreter:
+ *
+ *	rbx		sp
+ *	r12		bp
+ *	r13		S->memory
+ *	r14		S
+ *
+ * native code is entered through a trampoline, Spy_jitRun(S, entry), which
+ * loads those registers from S and returns the index of the cell where the
+ * interpreter carries on.  that's the return address after IRET/FRET/VRET,
+ * and the instruction itself for anything the JIT can't compile (it's
+ * left to the interpreter).  CALLs go through Spy_jitCall which enters
+ * the callee's native code if there is any, so interpreted and compiled
+ * frames can call each other freely.  S->jit_entry maps cells to native
+ * code, the translated code itself is never patched.
+ *
+ * backward jumps and calls charge S->budget like the interpreter's safe
+ * points do and leave native code at their target once it's spent, the
+ * interpreter yields there, see Spy_resume */
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#define EMIT(...)	Jit_emit(J, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+/* patch kinds */
+#define PATCH_LABEL		0 /* to the code at offset 'target' */
+#define PATCH_EXIT		1 /* to a stub leaving with cell 'target' */
+#define PATCH_EPILOGUE	2 /* straight to the epilogue, rax holds the cell */
+
+#define JIT_MAXDEPTH	4096 /* native calls nested on the C stack */
+
+/* pieces of code shared by every template */
+#define POPRAX()	EMIT(0x48, 0x8B, 0x03, 0x48, 0x83, 0xEB, 0x08) /* mov rax, [rbx]; sub rbx, 8 */
+#define POPRCX()	EMIT(0x48, 0x8B, 0x0B, 0x48, 0x83, 0xEB, 0x08) /* mov rcx, [rbx]; sub rbx, 8 */
+#define PUSHRAX()	EMIT(0x48, 0x83, 0xC3, 0x08, 0x48, 0x89, 0x03) /* add rbx, 8; mov [rbx], rax */
+#define SETTOP()	EMIT(0x48, 0x89, 0x03) /* mov [rbx], rax */
+#define POPXMM()	EMIT(0xF2, 0x0F, 0x10, 0x0B, 0x48, 0x83, 0xEB, 0x08, 0xF2, 0x0F, 0x10, 0x03) /* movsd xmm1, [rbx]; sub rbx, 8; movsd xmm0, [rbx] */
+
+/* [r12 + disp32], the local or argument slot at 'disp' from bp */
+#define LOCALDISP(n)	((uint32_t)((n) * 8 + 8))
+
+void
+Spy_jitInit(SpyState* S) {
+	Jit jit;
+	Jit* J = &jit;
+	if (S->jit_entry) return;
+	S->jit_entry = (const void **)calloc(S->program->code_size, sizeof(void *));
+	S->jit_counts = (uint32_t *)calloc(S->program->code_size, sizeof(uint32_t));
+	if (!S->jit_entry || !S->jit_counts) Spy_crash(S, "Out of memory\n");
+
+	/* the trampoline, saves the registers the templates use and jumps to
+	 * the entry point in rsi.  the matching epilogue is part of every
+	 * region */
+	memset(J, 0, sizeof(jit));
+	J->S = S;
+	EMIT(0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); /* push rbx, r12, r13, r14, r15 */
+	EMIT(0x49, 0x89, 0xFE); /* mov r14, rdi */
+	Jit_unsync(J);
+	EMIT(0xFF, 0xE6); /* jmp rsi */
+	S->jit_trampoline = Jit_install(S, J->bytes, J->size);
+	free(J->bytes);
+}
+
+int64_t
+Spy_jitRun(SpyState* S, const void* entry) {
+	int64_t cell;
+	S->jit_depth++;
+	cell = ((int64_t (*)(SpyState*, const void*))S->jit_trampoline)(S, entry);
+	S->jit_depth--;
+	return cell;
+}
+
+/* compiles the code reachable from 'cell' without following calls.
+ * returns 0 if nothing there can be compiled */
+int
+Spy_jitCompile(SpyState* S, size_t cell) {
+	const uint8_t* code = S->program->bytecode;
+	const size_t size = S->program->bytecode_size;
+	uint32_t entry = S->program->cell_offsets[cell];
+	uint32_t* work;
+	size_t nwork = 0;
+	uint8_t* base;
+	Jit jit;
+	Jit* J = &jit;
+
+	if (entry >= size || !Jit_supported(code[entry])) {
+		return 0;
+	}
+
+	memset(J, 0, sizeof(jit));
+	J->S = S;
+	J->region = (uint8_t *)calloc(size + 1, 1);
+	J->labels = (uint32_t *)malloc((size + 1) * sizeof(uint32_t));
+	work = (uint32_t *)malloc((size + 1) * sizeof(uint32_t));
+	if (!J->region || !J->labels || !work) Spy_crash(S, "Out of memory\n");
+
+	/* find the region, unsupported instructions end a path */
+	J->region[entry] = 1;
+	work[nwork++] = entry;
+	while (nwork > 0) {
+		uint32_t at = work[--nwork];
+		uint32_t next[2];
+		int n = 0;
+		if (!Jit_supported(code[at])) continue;
+		switch (code[at]) {
+			case 0x00: /* NOOP */
+			case 0x17: /* IRET */
+			case 0x23: /* FRET */
+			case 0x33: /* VRET */
+				break;
+			case 0x15: /* JMP */
+				next[n++] = *(uint32_t *)&code[at + 1];
+				break;
+			case 0x13: /* JNZ */
+			case 0x14: /* JZ */
+				next[n++] = *(uint32_t *)&code[at + 1];
+				next[n++] = at + Spy_instructionSize(S->program, &code[at]);
+				break;
+			case 0x46: /* ILLTJZ */
+				next[n++] = *(uint32_t *)&code[at + 9];
+				next[n++] = at + Spy_instructionSize(S->program, &code[at]);
+				break;
+			case 0x47: /* ILCLTJZ */
+				next[n++] = *(uint32_t *)&code[at + 13];
+				next[n++] = at + Spy_instructionSize(S->program, &code[at]);
+				break;
+			default:
+				next[n++] = at + Spy_instructionSize(S->program, &code[at]);
+				break;
+		}
+		for (int i = 0; i < n; i++) {
+			if (next[i] < size && !J->region[next[i]]) {
+				J->region[next[i]] = 1;
+				work[nwork++] = next[i];
+			}
+		}
+	}
+	free(work);
+
+	/* templates, in code order so falling through needs no jump */
+	for (uint32_t at = 0; at < size; at += Spy_instructionSize(S->program, &code[at])) {
+		if (!J->region[at]) continue;
+		J->labels[at] = J->size;
+		if (!Jit_supported(code[at])) {
+			Jit_exit(J, S->program->code_map[at]);
+			continue;
+		}
+		if (Jit_instruction(J, &code[at], at)) {
+			uint32_t next = at + Spy_instructionSize(S->program, &code[at]);
+			if (next >= size) {
+				Jit_exit(J, S->program->code_map[size]); /* ran off the end, halt */
+			}
+		}
+	}
+
+	/* the epilogue, then a stub for every exit */
+	size_t epilogue = J->size;
+	Jit_sync(J);
+	EMIT(0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3); /* pop r15, r14, r13, r12, rbx; ret */
+	for (size_t i = 0; i < J->npatches; i++) {
+		JitPatch* patch = &J->patches[i];
+		size_t to = 0;
+		if (patch->exit == PATCH_LABEL && patch->target >= size) {
+			/* a jump to the end of the code halts */
+			patch->exit = PATCH_EXIT;
+			patch->target = S->program->code_map[size];
+		}
+		if (patch->exit == PATCH_LABEL) {
+			to = J->labels[patch->target];
+		} else if (patch->exit == PATCH_EXIT) {
+			to = J->size;
+			EMIT(0xB8); /* mov eax, cell */
+			Jit_emit32(J, patch->target);
+			EMIT(0xE9); /* jmp epilogue */
+			Jit_emit32(J, (uint32_t)(epilogue - (J->size + 4)));
+		} else if (patch->exit == PATCH_EPILOGUE) {
+			to = epilogue;
+		}
+		*(uint32_t *)&J->bytes[patch->at] = (uint32_t)(to - (patch->at + 4));
+	}
+
+	base = (uint8_t *)Jit_install(S, J->bytes, J->size);
+	for (uint32_t at = 0; at < size; at += Spy_instructionSize(S->program, &code[at])) {
+		if (J->region[at] && Jit_supported(code[at]) && !S->jit_entry[S->program->code_map[at]]) {
+			S->jit_entry[S->program->code_map[at]] = base + J->labels[at];
+		}
+	}
+	S->jit_regions++;
+	S->jit_bytes += J->size;
+
+	free(J->bytes);
+	free(J->region);
+	free(J->labels);
+	free(J->patches);
+	return 1;
+}
+
+/* CALL from native code.  pushes the frame like the interpreter does and
+ * runs the callee natively if it is (or just became) compiled.  returns
+ * the cell to continue at, the caller's return address unless the callee
+ * left native code or the budget is spent */
+int64_t
+Spy_jitCall(SpyState* S, int64_t target, int64_t nargs, int64_t ret) {
+	uint8_t* sp = S->sp;
+	*(int64_t *)(sp += 8) = nargs;
+	*(uint8_t **)(sp += 8) = S->bp;
+	*(int64_t *)(sp += 8) = ret;
+	S->sp = sp;
+	S->bp = sp;
+	if (Spy_charge(S, 1) < 0) {
+		return target;
+	}
+	if (S->jit_depth < JIT_MAXDEPTH && (S->jit_entry[target] ||
+		(++S->jit_counts[target] == S->jit_threshold && Spy_jitCompile(S, target)))) {
+		return Spy_jitRun(S, S->jit_entry[target]);
+	}
+	return target;
+}
+
+void
+Spy_jitFree(SpyState* S) {
+	SpyJitBlock* block = S->jit_blocks;
+	while (block) {
+		SpyJitBlock* next = block->next;
+		munmap(block->code, block->size);
+		free(block);
+		block = next;
+	}
+	S->jit_blocks = NULL;
+	free(S->jit_entry);
+	free(S->jit_counts);
+	S->jit_entry = NULL;
+	S->jit_counts = NULL;
+}
+
+static void
+Jit_emit(Jit* J, const uint8_t* bytes, size_t n) {
+	if (J->size + n > J->capacity) {
+		J->capacity = J->capacity ? J->capacity * 2 : 4096;
+		J->bytes = (uint8_t *)realloc(J->bytes, J->capacity);
+		if (!J->bytes) Spy_crash(J->S, "Out of memory\n");
+	}
+	memcpy(&J->bytes[J->size], bytes, n);
+	J->size += n;
+}
+
+static void
+Jit_emit32(Jit* J, uint32_t value) {
+	Jit_emit(J, (const uint8_t *)&value, 4);
+}
+
+static void
+Jit_emit64(Jit* J, uint64_t value) {
+	Jit_emit(J, (const uint8_t *)&value, 8);
+}
+
+/* emits a rel32 to be patched, see PATCH_* */
+static void
+Jit_jump(Jit* J, uint32_t target, int kind) {
+	if (J->npatches == J->patches_capacity) {
+		J->patches_capacity = J->patches_capacity ? J->patches_capacity * 2 : 64;
+		J->patches = (JitPatch *)realloc(J->patches, J->patches_capacity * sizeof(JitPatch));
+		if (!J->patches) Spy_crash(J->S, "Out of memory\n");
+	}
+	J->patches[J->npatches].at = J->size;
+	J->patches[J->npatches].target = target;
+	J->patches[J->npatches].exit = kind;
+	J->npatches++;
+	Jit_emit32(J, 0);
+}
+
+/* leaves native code, the interpreter continues at 'cell' */
+static void
+Jit_exit(Jit* J, uint32_t cell) {
+	EMIT(0xE9); /* jmp */
+	Jit_jump(J, cell, PATCH_EXIT);
+}
+
+/* jumps from the instruction at code offset 'at' to code offset 'target'
+ * on condition code 'cc' (the low nibble of jcc), always if it's -1.  a
+ * taken backward jump charges the instructions since the target to the
+ * budget and leaves native code at the target once it's spent */
+static void
+Jit_branch(Jit* J, int cc, uint32_t target, uint32_t at) {
+	const uint32_t* map = J->S->program->code_map;
+	if (target > at) {
+		if (cc < 0) {
+			EMIT(0xE9); /* jmp */
+		} else {
+			EMIT(0x0F, 0x80 | cc); /* jcc */
+		}
+		Jit_jump(J, target, PATCH_LABEL);
+		return;
+	}
+	if (cc >= 0) {
+		EMIT(0x70 | (cc ^ 1), 22); /* short jump past the charge on the opposite condition */
+	}
+	EMIT(0x49, 0x81, 0xAE); /* sub qword [r14 + budget], imm32 */
+	Jit_emit32(J, offsetof(SpyState, budget));
+	Jit_emit32(J, map[at] - map[target] + 1);
+	EMIT(0x0F, 0x8C); /* jl exit, the budget is spent */
+	Jit_jump(J, map[target], PATCH_EXIT);
+	EMIT(0xE9); /* jmp */
+	Jit_jump(J, target, PATCH_LABEL);
+}
+
+/* write sp and bp back to S */
+static void
+Jit_sync(Jit* J) {
+	EMIT(0x49, 0x89, 0x9E); /* mov [r14 + sp], rbx */
+	Jit_emit32(J, offsetof(SpyState, sp));
+	EMIT(0x4D, 0x89, 0xA6); /* mov [r14 + bp], r12 */
+	Jit_emit32(J, offsetof(SpyState, bp));
+}
+
+/* load sp, bp and memory from S */
+static void
+Jit_unsync(Jit* J) {
+	EMIT(0x49, 0x8B, 0x9E); /* mov rbx, [r14 + sp] */
+	Jit_emit32(J, offsetof(SpyState, sp));
+	EMIT(0x4D, 0x8B, 0xA6); /* mov r12, [r14 + bp] */
+	Jit_emit32(J, offsetof(SpyState, bp));
+	EMIT(0x4D, 0x8B, 0xAE); /* mov r13, [r14 + memory] */
+	Jit_emit32(J, offsetof(SpyState, memory));
+}
+
+/* calls a C helper with S in rdi, the other arguments must already be in
+ * rsi, rdx and rcx */
+static void
+Jit_callHelper(Jit* J, const void* function) {
+	Jit_sync(J);
+	EMIT(0x4C, 0x89, 0xF7); /* mov rdi, r14 */
+	EMIT(0x48, 0xB8); /* mov rax, function */
+	Jit_emit64(J, (uint64_t)(uintptr_t)function);
+	EMIT(0xFF, 0xD0); /* call rax */
+	Jit_unsync(J);
+}
+
+static int
+Jit_supported(uint8_t opcode) {
+	switch (opcode) {
+		case 0x32: /* LOG */
+		case 0x34: /* DBON */
+		case 0x35: /* DBOFF */
+		case 0x36: /* DBDS */
+		case 0x37: /* CJNZ */
+		case 0x38: /* CJZ */
+		case 0x39: /* CJMP */
+		case 0x3A: /* ILNSAVE */
+		case 0x3B: /* ILNLOAD */
+		case 0x18: /* CCALL, bound into NCALL before anything runs */
+		case 0x48: /* CONEW */
+		case 0x49: /* RESUME */
+		case 0x4A: /* YIELD */
+			return 0;
+	}
+	return instructions[opcode].name != NULL;
+}
+
+/* emits the template for the instruction at 'ins' (code offset 'at').
+ * returns 1 if execution can fall through to the next instruction */
+static int
+Jit_instruction(Jit* J, const uint8_t* ins, uint32_t at) {
+	SpyState* S = J->S;
+	const uint8_t* operands = ins + 1;
+	uint32_t u = *(uint32_t *)operands; /* most operands are a single int32 */
+	uint32_t next = at + Spy_instructionSize(S->program, ins);
+
+	/* slot numbers that don't fit a disp32 once scaled stay interpreted */
+	if (instructions[*ins].operands[0] == _INT32 && u >= (1u << 27)) {
+		Jit_exit(J, S->program->code_map[at]);
+		return 0;
+	}
+
+	switch (*ins) {
+		case 0x00: /* NOOP, the interpreter halts */
+			Jit_exit(J, S->program->code_map[at]);
+			return 0;
+
+		case 0x01: /* IPUSH */
+		case 0x19: /* FPUSH */
+			EMIT(0x48, 0xB8); /* mov rax, imm64 */
+			Jit_emit64(J, *(uint64_t *)operands);
+			PUSHRAX();
+			break;
+
+		case 0x02: POPRCX(); EMIT(0x48, 0x01, 0x0B); break; /* IADD: add [rbx], rcx */
+		case 0x03: POPRCX(); EMIT(0x48, 0x29, 0x0B); break; /* ISUB: sub [rbx], rcx */
+		case 0x09: POPRCX(); EMIT(0x48, 0x21, 0x0B); break; /* AND */
+		case 0x0A: POPRCX(); EMIT(0x48, 0x09, 0x0B); break; /* OR */
+		case 0x0B: POPRCX(); EMIT(0x48, 0x31, 0x0B); break; /* XOR */
+		case 0x07: POPRCX(); EMIT(0x48, 0xD3, 0x23); break; /* SHL: shl qword [rbx], cl */
+		case 0x08: POPRCX(); EMIT(0x48, 0xD3, 0x3B); break; /* SHR: sar qword [rbx], cl */
+		case 0x0C: EMIT(0x48, 0xF7, 0x13); break; /* NOT: not qword [rbx] */
+		case 0x0D: EMIT(0x48, 0xF7, 0x1B); break; /* NEG: neg qword [rbx] */
+
+		case 0x04: /* IMUL */
+			POPRCX();
+			EMIT(0x48, 0x8B, 0x03, 0x48, 0x0F, 0xAF, 0xC1); /* mov rax, [rbx]; imul rax, rcx */
+			SETTOP();
+			break;
+
+		case 0x05: /* IDIV */
+		case 0x06: /* MOD */
+			/* divisors 0 and -1 trap or need care, the interpreter has them */
+			EMIT(0x48, 0x8B, 0x0B, 0x48, 0x8D, 0x41, 0x01); /* mov rcx, [rbx]; lea rax, [rcx + 1] */
+			EMIT(0x48, 0x83, 0xF8, 0x01, 0x0F, 0x86); /* cmp rax, 1; jbe exit */
+			Jit_jump(J, S->program->code_map[at], PATCH_EXIT);
+			POPRCX();
+			EMIT(0x48, 0x8B, 0x03, 0x48, 0x99, 0x48, 0xF7, 0xF9); /* mov rax, [rbx]; cqo; idiv rcx */
+			if (*ins == 0x05) SETTOP();
+			else EMIT(0x48, 0x89, 0x13); /* mov [rbx], rdx */
+			break;
+
+		case 0x0E: /* IGT */
+		case 0x0F: /* IGE */
+		case 0x10: /* ILT */
+		case 0x11: /* ILE */
+		case 0x12: /* ICMP */
+		{
+			static const uint8_t setcc[] = {0x9F, 0x9D, 0x9C, 0x9E, 0x94};
+			POPRCX();
+			EMIT(0x31, 0xC0, 0x48, 0x39, 0x0B); /* xor eax, eax; cmp [rbx], rcx */
+			EMIT(0x0F, setcc[*ins - 0x0E], 0xC0); /* setcc al */
+			SETTOP();
+			break;
+		}
+
+		case 0x2E: /* LOR */
+			POPRCX();
+			EMIT(0x31, 0xC0, 0x48, 0x0B, 0x0B, 0x0F, 0x95, 0xC0); /* xor eax, eax; or rcx, [rbx]; setne al */
+			SETTOP();
+			break;
+
+		case 0x2F: /* LAND */
+			POPRCX();
+			EMIT(0x31, 0xC0, 0x31, 0xD2); /* xor eax, eax; xor edx, edx */
+			EMIT(0x48, 0x83, 0x3B, 0x00, 0x0F, 0x95, 0xC0); /* cmp qword [rbx], 0; setne al */
+			EMIT(0x48, 0x85, 0xC9, 0x0F, 0x95, 0xC2); /* test rcx, rcx; setne dl */
+			EMIT(0x21, 0xD0); /* and eax, edx */
+			SETTOP();
+			break;
+
+		case 0x42: /* LNOT */
+			EMIT(0x31, 0xC0, 0x48, 0x83, 0x3B, 0x00, 0x0F, 0x94, 0xC0); /* xor eax, eax; cmp qword [rbx], 0; sete al */
+			SETTOP();
+			break;
+
+		case 0x30: /* PADD */
+		case 0x31: /* PSUB */
+			POPRCX();
+			EMIT(0x48, 0xC1, 0xE1, 0x03); /* shl rcx, 3 */
+			if (*ins == 0x30) EMIT(0x48, 0x01, 0x0B); /* add [rbx], rcx */
+			else EMIT(0x48, 0x29, 0x0B); /* sub [rbx], rcx */
+			break;
+
+		case 0x2C: /* ICINC */
+			EMIT(0x48, 0xB8); /* mov rax, imm64 */
+			Jit_emit64(J, *(uint64_t *)operands);
+			EMIT(0x48, 0x01, 0x03); /* add [rbx], rax */
+			break;
+
+		case 0x13: /* JNZ */
+		case 0x14: /* JZ */
+			POPRAX();
+			EMIT(0x48, 0x85, 0xC0); /* test rax, rax */
+			Jit_branch(J, *ins == 0x13 ? 0x5 : 0x4, u, at); /* jnz/jz */
+			break;
+
+		case 0x15: /* JMP */
+			Jit_branch(J, -1, u, at);
+			return 0;
+
+		case 0x16: /* CALL */
+			EMIT(0x48, 0xBE); /* mov rsi, target cell */
+			Jit_emit64(J, S->program->code_map[u]);
+			EMIT(0x48, 0xBA); /* mov rdx, nargs */
+			Jit_emit64(J, *(uint32_t *)(operands + 4));
+			EMIT(0x48, 0xB9); /* mov rcx, return cell */
+			Jit_emit64(J, S->program->code_map[next]);
+			Jit_callHelper(J, (const void *)Spy_jitCall);
+			EMIT(0x48, 0x3D); /* cmp rax, return cell */
+			Jit_emit32(J, S->program->code_map[next]);
+			EMIT(0x0F, 0x85); /* jne epilogue, the callee left native code */
+			Jit_jump(J, 0, PATCH_EPILOGUE);
+			break;
+
+		case 0x43: /* NCALL, the arguments are already in order */
+			/* through the table, Spy_pushC may replace the function.  ip
+			 * is past the opcode, as in the interpreter, so errors the
+			 * function reports point at this call */
+			Jit_sync(J);
+			EMIT(0x49, 0x8B, 0x86); /* mov rax, [r14 + code] */
+			Jit_emit32(J, offsetof(SpyState, code));
+			EMIT(0x48, 0x05); /* add rax, (cell + 1) * sizeof(SpyCode) */
+			Jit_emit32(J, (S->program->code_map[at] + 1) * sizeof(SpyCode));
+			EMIT(0x49, 0x89, 0x86); /* mov [r14 + ip], rax */
+			Jit_emit32(J, offsetof(SpyState, ip));
+			EMIT(0x4C, 0x89, 0xF7); /* mov rdi, r14 */
+			EMIT(0x48, 0xB8); /* mov rax, &S->c_bound[index] */
+			Jit_emit64(J, (uint64_t)(uintptr_t)&S->c_bound[u]);
+			EMIT(0xFF, 0x10); /* call [rax] */
+			Jit_unsync(J);
+			break;
+
+		case 0x17: /* IRET */
+		case 0x23: /* FRET */
+		case 0x33: /* VRET */
+			EMIT(0x48, 0x8B, 0x03); /* mov rax, [rbx] (return value) */
+			EMIT(0x49, 0x8B, 0x14, 0x24); /* mov rdx, [r12] (return cell) */
+			EMIT(0x49, 0x8B, 0x4C, 0x24, 0xF0); /* mov rcx, [r12 - 16] (nargs) */
+			EMIT(0x48, 0xC1, 0xE1, 0x03); /* shl rcx, 3 */
+			if (*ins == 0x33) {
+				EMIT(0x49, 0x8D, 0x5C, 0x24, 0xE8); /* lea rbx, [r12 - 24] */
+			} else {
+				EMIT(0x49, 0x8D, 0x5C, 0x24, 0xF0); /* lea rbx, [r12 - 16] */
+			}
+			EMIT(0x48, 0x29, 0xCB); /* sub rbx, rcx */
+			EMIT(0x4D, 0x8B, 0x64, 0x24, 0xF8); /* mov r12, [r12 - 8] */
+			if (*ins != 0x33) SETTOP();
+			EMIT(0x48, 0x89, 0xD0, 0xE9); /* mov rax, rdx; jmp epilogue */
+			Jit_jump(J, 0, PATCH_EPILOGUE);
+			return 0;
+
+		case 0x1A: /* FADD */
+		case 0x1B: /* FSUB */
+		case 0x1C: /* FMUL */
+		case 0x1D: /* FDIV */
+		{
+			static const uint8_t op[] = {0x58, 0x5C, 0x59, 0x5E};
+			POPXMM();
+			EMIT(0xF2, 0x0F, op[*ins - 0x1A], 0xC1); /* op xmm0, xmm1 */
+			EMIT(0xF2, 0x0F, 0x11, 0x03); /* movsd [rbx], xmm0 */
+			break;
+		}
+
+		case 0x1E: /* FGT */
+		case 0x1F: /* FGE */
+		case 0x20: /* FLT */
+		case 0x21: /* FLE */
+			/* the result is a float, 1.0 or 0.0 */
+			POPXMM();
+			EMIT(0x31, 0xC0); /* xor eax, eax */
+			if (*ins <= 0x1F) EMIT(0x66, 0x0F, 0x2E, 0xC1); /* ucomisd xmm0, xmm1 */
+			else EMIT(0x66, 0x0F, 0x2E, 0xC8); /* ucomisd xmm1, xmm0 */
+			EMIT(0x0F, (*ins - 0x1E) % 2 ? 0x93 : 0x97, 0xC0); /* setae/seta al */
+			EMIT(0xF2, 0x48, 0x0F, 0x2A, 0xC0); /* cvtsi2sd xmm0, rax */
+			EMIT(0xF2, 0x0F, 0x11, 0x03); /* movsd [rbx], xmm0 */
+			break;
+
+		case 0x22: /* FCMP */
+			POPXMM();
+			EMIT(0x31, 0xC0, 0x31, 0xC9); /* xor eax, eax; xor ecx, ecx */
+			EMIT(0x66, 0x0F, 0x2E, 0xC1); /* ucomisd xmm0, xmm1 */
+			EMIT(0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8); /* sete al; setnp cl; and al, cl */
+			SETTOP();
+			break;
+
+		case 0x24: /* ILLOAD */
+		case 0x3C: /* FLLOAD */
+			EMIT(0x49, 0x8B, 0x84, 0x24); /* mov rax, [r12 + disp] */
+			Jit_emit32(J, LOCALDISP(u));
+			PUSHRAX();
+			break;
+
+		case 0x25: /* ILSAVE */
+		case 0x3D: /* FLSAVE */
+			POPRAX();
+			EMIT(0x49, 0x89, 0x84, 0x24); /* mov [r12 + disp], rax */
+			Jit_emit32(J, LOCALDISP(u));
+			break;
+
+		case 0x26: /* IARG */
+			EMIT(0x49, 0x8B, 0x84, 0x24); /* mov rax, [r12 - 24 - 8k] */
+			Jit_emit32(J, (uint32_t)(-24 - (int64_t)u * 8));
+			PUSHRAX();
+			break;
+
+		case 0x2A: /* LEA */
+			EMIT(0x49, 0x8D, 0x84, 0x24); /* lea rax, [r12 + disp] */
+			Jit_emit32(J, LOCALDISP(u));
+			EMIT(0x4C, 0x29, 0xE8); /* sub rax, r13 */
+			PUSHRAX();
+			break;
+
+		case 0x27: /* ILOAD */
+		case 0x2B: /* IDER */
+		case 0x40: /* FDER */
+			EMIT(0x48, 0x8B, 0x03, 0x49, 0x8B, 0x44, 0x05, 0x00); /* mov rax, [rbx]; mov rax, [r13 + rax] */
+			SETTOP();
+			break;
+
+		case 0x2D: /* CDER */
+			EMIT(0x48, 0x8B, 0x03, 0x41, 0x0F, 0xB6, 0x44, 0x05, 0x00); /* mov rax, [rbx]; movzx eax, byte [r13 + rax] */
+			SETTOP();
+			break;
+
+		case 0x28: /* ISAVE */
+		case 0x41: /* FSAVE */
+			EMIT(0x48, 0x8B, 0x03, 0x48, 0x8B, 0x4B, 0xF8); /* mov rax, [rbx]; mov rcx, [rbx - 8] */
+			EMIT(0x48, 0x83, 0xEB, 0x10); /* sub rbx, 16 */
+			EMIT(0x49, 0x89, 0x44, 0x0D, 0x00); /* mov [r13 + rcx], rax */
+			break;
+
+		case 0x29: /* RES */
+			EMIT(0x48, 0x8D, 0x83); /* lea rax, [rbx + n*8] */
+			Jit_emit32(J, (uint32_t)(u * 8));
+			if (!S->verified) {
+				/* a frame larger than the guard could skip over it, let
+				 * the interpreter report the overflow.  the guard moves
+				 * with the coroutine running */
+				EMIT(0x49, 0x3B, 0x86); /* cmp rax, [r14 + stack_end] */
+				Jit_emit32(J, offsetof(SpyState, stack_end));
+				EMIT(0x0F, 0x83); /* jae exit */
+				Jit_jump(J, S->program->code_map[at], PATCH_EXIT);
+			}
+			EMIT(0x48, 0x89, 0xC3); /* mov rbx, rax */
+			break;
+
+		case 0x3E: /* FTOI */
+			EMIT(0xF2, 0x48, 0x0F, 0x2C, 0x83); /* cvttsd2si rax, [rbx - 8k] */
+			Jit_emit32(J, (uint32_t)(-(int64_t)u * 8));
+			EMIT(0x48, 0x89, 0x83); /* mov [rbx - 8k], rax */
+			Jit_emit32(J, (uint32_t)(-(int64_t)u * 8));
+			break;
+
+		case 0x3F: /* ITOF */
+			EMIT(0xF2, 0x48, 0x0F, 0x2A, 0x83); /* cvtsi2sd xmm0, [rbx - 8k] */
+			Jit_emit32(J, (uint32_t)(-(int64_t)u * 8));
+			EMIT(0xF2, 0x0F, 0x11, 0x83); /* movsd [rbx - 8k], xmm0 */
+			Jit_emit32(J, (uint32_t)(-(int64_t)u * 8));
+			break;
+
+		/* superinstructions */
+		case 0x44: /* ILINC */
+			EMIT(0x48, 0xB8); /* mov rax, imm64 */
+			Jit_emit64(J, *(uint64_t *)(operands + 4));
+			EMIT(0x49, 0x01, 0x84, 0x24); /* add [r12 + disp], rax */
+			Jit_emit32(J, LOCALDISP(u));
+			break;
+
+		case 0x45: /* ILCINC */
+			EMIT(0x48, 0xB8); /* mov rax, imm64 */
+			Jit_emit64(J, *(uint64_t *)(operands + 4));
+			EMIT(0x49, 0x03, 0x84, 0x24); /* add rax, [r12 + disp] */
+			Jit_emit32(J, LOCALDISP(u));
+			PUSHRAX();
+			break;
+
+		case 0x46: /* ILLTJZ */
+			EMIT(0x49, 0x8B, 0x84, 0x24); /* mov rax, [r12 + x] */
+			Jit_emit32(J, LOCALDISP(u));
+			EMIT(0x49, 0x3B, 0x84, 0x24); /* cmp rax, [r12 + y] */
+			Jit_emit32(J, LOCALDISP(*(uint32_t *)(operands + 4)));
+			Jit_branch(J, 0xD, *(uint32_t *)(operands + 8), at); /* jge */
+			break;
+
+		case 0x47: /* ILCLTJZ */
+			EMIT(0x49, 0x8B, 0x84, 0x24); /* mov rax, [r12 + x] */
+			Jit_emit32(J, LOCALDISP(u));
+			EMIT(0x48, 0xB9); /* mov rcx, imm64 */
+			Jit_emit64(J, *(uint64_t *)(operands + 4));
+			EMIT(0x48, 0x39, 0xC8); /* cmp rax, rcx */
+			Jit_branch(J, 0xD, *(uint32_t *)(operands + 12), at); /* jge */
+			break;
+
+		default:
+			Jit_exit(J, S->program->code_map[at]);
+			return 0;
+	}
+	return 1;
+}
+
+/* copies machine code into its own executable mapping */
+static void*
+Jit_install(SpyState* S, const uint8_t* bytes, size_t size) {
+	SpyJitBlock* block = (SpyJitBlock *)malloc(sizeof(SpyJitBlock));
+	void* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!block || code == MAP_FAILED) Spy_crash(S, "Out of memory\n");
+	memcpy(code, bytes, size);
+	if (mprotect(code, size, PROT_READ | PROT_EXEC)) {
+		Spy_crash(S, "couldn't make JIT code executable\n");
+	}
+	block->code = code;
+	block->size = size;
+	block->next = S->jit_blocks;
+	S->jit_blocks = block;
+	return code;
+}
+
+#else
+
+/* no JIT for this platform, everything is interpreted */
+void
+Spy_jitInit(SpyState* S) {
+	S->jit_threshold = 0;
+}
+
+int
+Spy_jitCompile(SpyState* S, size_t cell) {
+	return 0;
+}
+
+int64_t
+Spy_jitRun(SpyState* S, const void* entry) {
+	return 0;
+}
+
+int64_t
+Spy_jitCall(SpyState* S, int64_t target, int64_t nargs, int64_t ret) {
+	return target;
+}
+
+void
+Spy_jitFree(SpyState* S) {
+}
+
+#endif
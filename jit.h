@@ -0,0 +1,51 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "spyre.h"
+
+typedef struct Jit Jit;
+typedef struct JitPatch JitPatch;
+
+/* a rel32 waiting for the native address of a code offset */
+struct JitPatch {
+	size_t			at; /* position of the rel32 in Jit.bytes */
+	uint32_t		target; /* code offset, or cell index for exits */
+	uint8_t			exit; /* jump to an exit stub for cell 'target' */
+};
+
+/* one region being compiled */
+struct Jit {
+	SpyState*		S;
+	uint8_t*		bytes;
+	size_t			size;
+	size_t			capacity;
+	uint8_t*		region; /* 1 at code offsets compiled into the region */
+	uint32_t*		labels; /* code offset -> position in bytes */
+	JitPatch*		patches;
+	size_t			npatches;
+	size_t			patches_capacity;
+};
+
+void		Spy_jitInit(SpyState*);
+int			Spy_jitCompile(SpyState*, size_t);
+int64_t		Spy_jitRun(SpyState*, const void*);
+void		Spy_jitFree(SpyState*);
+
+int64_t		Spy_jitCall(SpyState*, int64_t, int64_t, int64_t);
+
+static void		Jit_emit(Jit*, const uint8_t*, size_t);
+static void		Jit_emit32(Jit*, uint32_t);
+static void		Jit_emit64(Jit*, uint64_t);
+static void		Jit_jump(Jit*, uint32_t, int);
+static void		Jit_exit(Jit*, uint32_t);
+static void		Jit_branch(Jit*, int, uint32_t, uint32_t);
+static void		Jit_sync(Jit*);
+static void		Jit_unsync(Jit*);
+static void		Jit_callHelper(Jit*, const void*);
+static int		Jit_supported(uint8_t);
+static int		Jit_instruction(Jit*, const uint8_t*, uint32_t);
+static void*	Jit_install(SpyState*, const uint8_t*, size_t);
+
+#endif
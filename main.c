@@ -1,6 +1,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include "spyre.h"
+#include "batch.h"
+#include "profile.h"
 #include "assembler.h"
 #include "lex.h"
 #include "parse.h"
@@ -20,37 +22,107 @@ int main(int argc, char** argv) {
 
 	char* args[] = {argv[1]};
 
-	const unsigned int flags = SPY_NOFLAG;
+	unsigned int flags = SPY_NOFLAG;
+	unsigned long jit_threshold = SPY_JITTHRESHOLD;
+	unsigned long sample_rate = 0;
+	size_t stack_limit = 0;
+	size_t heap_limit = 0;
+	size_t output_size = SIZE_OUTPUT;
+	unsigned long threads = 0;
+	unsigned long quantum = SCHED_QUANTUM;
+	long long budget = 0;
+	int status = 0;
+	int file = 2;
 
 	ParseOptions options;
 	options.opt_level = OPT_THREE;
 	//options.opt_level = OPT_ZERO;
 	
-	if (strlen(argv[1]) == 1) {
+	if (strlen(argv[1]) == 1 || !strcmp(argv[1], "batch")) {
 	
-		if (argc < 3) {
+		/* options go between the command and the file name, e.g. 'spy r -n file.spyb' */
+		while (file < argc && argv[file][0] == '-') {
+			for (const char* opt = &argv[file][1]; *opt; opt++) {
+				switch (*opt) {
+					case 'd': flags |= SPY_DEBUG; break;
+					case 's': flags |= SPY_DEBUG | SPY_STEP; break;
+					case 'n': flags |= SPY_NOCACHE; break;
+					case 'p': flags |= SPY_PROFILE; break;
+					case 'g': flags |= SPY_CALLGRAPH; break;
+					case 'm': flags |= SPY_HEAPSTATS; break;
+					case 'a': flags |= SPY_ALLOCSITES; break;
+					case 'w': flags |= SPY_SNAPSHOT; break;
+					case 't': /* -t[N], sample N times per second of CPU time */
+						sample_rate = strtoul(opt + 1, (char **)&opt, 10);
+						if (!sample_rate) sample_rate = PROFILE_RATE;
+						opt--;
+						break;
+					case 'j': /* -jN, N calls or back-edges before compiling, -j0 disables the JIT */
+						jit_threshold = strtoul(opt + 1, (char **)&opt, 10);
+						opt--;
+						break;
+					case 'S': /* -SN, N kilobytes of stack */
+						stack_limit = strtoul(opt + 1, (char **)&opt, 10) << 10;
+						opt--;
+						break;
+					case 'H': /* -HN, N megabytes of heap at most */
+						heap_limit = strtoul(opt + 1, (char **)&opt, 10) << 20;
+						opt--;
+						break;
+					case 'o': /* -oN, buffer N kilobytes of output, -o0 writes every print through */
+						output_size = strtoul(opt + 1, (char **)&opt, 10) << 10;
+						opt--;
+						break;
+					case 'T': /* -TN, N threads for batch, one per CPU by default */
+						threads = strtoul(opt + 1, (char **)&opt, 10);
+						opt--;
+						break;
+					case 'Q': /* -QN, batch time slices of N microseconds, -Q0 runs every job to its end */
+						quantum = strtoul(opt + 1, (char **)&opt, 10);
+						opt--;
+						break;
+					case 'B': /* -BN, batch slices of N instructions at most */
+						budget = strtoll(opt + 1, (char **)&opt, 10);
+						opt--;
+						break;
+					default:
+						printf("unknown option '-%c'\n", *opt);
+						exit(1);
+				}
+			}
+			file++;
+		}
+
+		if (argc <= file) {
 			printf("expected file name\n");
 			exit(1);
 		}
 
-		size_t flen = strlen(argv[2]);
+		size_t flen = strlen(argv[file]);
 		char* outfile = malloc(flen + 2);
-		strcpy(outfile, argv[2]);
+		strcpy(outfile, argv[file]);
 		outfile[flen] = 's'; /* convert the output name to *.spys form */
 		outfile[flen + 1] = 0;
 
 		if (!strncmp(argv[1], "a", 1)) {
-			Assembler_generateBytecodeFile(argv[2]);
+			Assembler_generateBytecodeFile(argv[file]);
 		} else if (!strncmp(argv[1], "r", 1)) {
-			Spy_execute(argv[2], flags, 1, args);
+			status = Spy_execute(argv[file], flags, jit_threshold, sample_rate, stack_limit, heap_limit, output_size, 1, args);
+		} else if (!strncmp(argv[1], "b", 1)) {
+			/* the profilers, snapshots and reports are per process or per file */
+			if ((flags & ~SPY_NOCACHE) || sample_rate) {
+				printf("only -n, -j, -S, -H, -o, -T, -Q and -B work with batch\n");
+				exit(1);
+			}
+			status = Spy_batch(argv[file], flags, jit_threshold, stack_limit, heap_limit, output_size, threads, quantum, budget);
 		} else if (!strncmp(argv[1], "c", 1)) {
-			if (!correct_suffix(argv[2])) {
+			if (!correct_suffix(argv[file])) {
 				printf("expected Spyre source file\n");
 				exit(1);
 			}	
-			LexState* tokens = generate_tokens(argv[2]);	
+			LexState* tokens = generate_tokens(argv[file]);	
 			TreeNode* tree = generate_tree(tokens, &options);
-			generate_bytecode(tree, outfile);
+			generate_bytecode(tree, argv[file], outfile);
 		}
 	} else {
 		if (!correct_suffix(argv[1])) {
@@ -59,6 +131,6 @@ int main(int argc, char** argv) {
 		}	
 	}
 
-	return 0;
+	return status;
 
 }
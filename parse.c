@@ -7,10 +7,6 @@
 #define LEAF_LEFT (1)
 #define LEAF_RIGHT (2)
 
-#define MOD_STATIC (0x1 << 0)
-#define MOD_CONST (0x1 << 1)
-#define MOD_VOLATILE (0x1 << 2)
-#define MOD_CFUNC (0x1 << 3)
 #define MOD_COUNT 4
 
 #define GENERIC_TYPE ((TreeType *)-1)
@@ -3,6 +3,12 @@
 
 #include "spyconf.h"
 #include "lex.h"
+
+/* TreeType.modifier and TreeFunction.modifiers */
+#define MOD_STATIC (0x1 << 0)
+#define MOD_CONST (0x1 << 1)
+#define MOD_VOLATILE (0x1 << 2)
+#define MOD_CFUNC (0x1 << 3) /* a function registered in C, called with CCALL */
 	
 typedef struct ParseState ParseState;
 typedef struct ParseOptions ParseOptions;
@@ -0,0 +1,710 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "profile.h"
+#include "assembler.h"
+
+/* the opcode profiler.  with SPY_PROFILE the program runs in its own
+ * interpreter loop (Spy_runProfile, see execute.h) which, before every
+ * instruction, reads the clock, charges the time since the last reading
+ * to the previous instruction and counts the instruction and the pair
+ * it forms with the previous one.  the JIT is off while profiling, every
+ * instruction is interpreted.  none of this exists in the other loops.
+ *
+ * the report on stderr lists opcodes by time spent and the most frequent
+ * pairs, which are the candidates for superinstructions.  the same numbers
+ * go to a tab separated file next to the bytecode:
+ *
+ *	opcode	NAME	count	ticks
+ *	pair	FIRST	SECOND	count
+ *
+ * time spent in C
+ * functions is charged to the CCALL or NCALL that called them.  reading
+ * the clock isn't free, its cost is measured once and taken off the
+ * report (not the file) */
+
+/* file.spyb -> file.<extension> */
+static char*
+Profile_output(SpyState* S, const char* filename, const char* extension) {
+	size_t len = strlen(filename);
+	char* output = (char *)malloc(len + strlen(extension) + 1);
+	if (!output) Spy_crash(S, "Out of memory\n");
+	strcpy(output, filename);
+	if (len > 5 && !strcmp(&output[len - 5], ".spyb")) {
+		output[len - 5] = 0;
+	}
+	strcat(output, extension);
+	return output;
+}
+
+SpyProfile*
+Spy_newProfile(SpyState* S, const char* filename) {
+	SpyProfile* P = (SpyProfile *)calloc(1, sizeof(SpyProfile));
+	if (!P) Spy_crash(S, "Out of memory\n");
+	P->output = Profile_output(S, filename, ".prof");
+	P->pairs = (uint64_t (*)[SPY_OPCODES])calloc(SPY_OPCODES, sizeof(*P->pairs));
+	if (!P->pairs) Spy_crash(S, "Out of memory\n");
+
+	/* the cheapest back to back reading is what the clock costs */
+	P->overhead = UINT64_MAX;
+	for (int i = 0; i < 1000; i++) {
+		uint64_t a = PROFILE_CLOCK();
+		uint64_t b = PROFILE_CLOCK();
+		if (b - a < P->overhead) P->overhead = b - a;
+	}
+	return P;
+}
+
+/* maps cells to opcodes, the loop only sees handler addresses */
+void
+Spy_profileInit(SpyState* S) {
+	SpyProfile* P = S->profile;
+	if (P->ops) return;
+	P->ops = (uint8_t *)malloc(S->program->code_size);
+	if (!P->ops) Spy_crash(S, "Out of memory\n");
+	memset(P->ops, 0x00, S->program->code_size); /* the cell past the end halts, like NOOP */
+	for (size_t i = 0; i < S->program->bytecode_size; i++) {
+		if (S->program->code_map[i] != UINT32_MAX) {
+			P->ops[S->program->code_map[i]] = S->program->bytecode[i];
+		}
+	}
+}
+
+uint64_t
+Spy_profileClock(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* most time first, then most executed */
+static int
+Profile_compare(const void* a, const void* b) {
+	const ProfileEntry* x = (const ProfileEntry *)a;
+	const ProfileEntry* y = (const ProfileEntry *)b;
+	if (x->ticks != y->ticks) return x->ticks < y->ticks ? 1 : -1;
+	if (x->count != y->count) return x->count < y->count ? 1 : -1;
+	return 0;
+}
+
+static void
+Profile_write(SpyState* S) {
+	SpyProfile* P = S->profile;
+	FILE* f = fopen(P->output, "w");
+	if (!f) {
+		fprintf(stderr, "couldn't write profile '%s'\n", P->output);
+		return;
+	}
+	for (int i = 0; i < SPY_OPCODES; i++) {
+		if (P->counts[i]) {
+			fprintf(f, "opcode\t%s\t%llu\t%llu\n", instructions[i].name,
+				(unsigned long long)P->counts[i], (unsigned long long)P->ticks[i]);
+		}
+	}
+	for (int i = 0; i < SPY_OPCODES; i++) {
+		if (i == PROFILE_NONE) continue;
+		for (int j = 0; j < SPY_OPCODES; j++) {
+			if (P->pairs[i][j]) {
+				fprintf(f, "pair\t%s\t%s\t%llu\n", instructions[i].name, instructions[j].name,
+					(unsigned long long)P->pairs[i][j]);
+			}
+		}
+	}
+	fclose(f);
+}
+
+/* prints the report and writes the profile file */
+void
+Spy_profileReport(SpyState* S) {
+	SpyProfile* P = S->profile;
+	ProfileEntry* entries;
+	size_t count = 0;
+	uint64_t instructions_run = 0;
+	uint64_t ticks = 0;
+
+	Spy_flushOutput(S); /* keep the program's output before the report */
+	entries = (ProfileEntry *)malloc(SPY_OPCODES * SPY_OPCODES * sizeof(ProfileEntry));
+	if (!entries) Spy_crash(S, "Out of memory\n");
+
+	/* opcodes, minus what reading the clock cost them */
+	for (int i = 0; i < SPY_OPCODES; i++) {
+		if (!P->counts[i]) continue;
+		uint64_t spent = P->counts[i] * P->overhead;
+		entries[count].first = i;
+		entries[count].second = PROFILE_NONE;
+		entries[count].count = P->counts[i];
+		entries[count].ticks = P->ticks[i] > spent ? P->ticks[i] - spent : 0;
+		instructions_run += entries[count].count;
+		ticks += entries[count].ticks;
+		count++;
+	}
+	qsort(entries, count, sizeof(ProfileEntry), Profile_compare);
+	fprintf(stderr, "\nopcode profile, %llu instructions, %llu %s (%llu per clock reading taken off)\n",
+		(unsigned long long)instructions_run, (unsigned long long)ticks, PROFILE_UNIT,
+		(unsigned long long)P->overhead);
+	fprintf(stderr, "%-10s %14s %7s %16s %7s %8s\n", "opcode", "count", "%", PROFILE_UNIT, "%", "each");
+	for (size_t i = 0; i < count; i++) {
+		fprintf(stderr, "%-10s %14llu %6.2f%% %16llu %6.2f%% %8.2f\n",
+			instructions[entries[i].first].name,
+			(unsigned long long)entries[i].count,
+			100.0 * entries[i].count / (instructions_run ? instructions_run : 1),
+			(unsigned long long)entries[i].ticks,
+			100.0 * entries[i].ticks / (ticks ? ticks : 1),
+			(double)entries[i].ticks / entries[i].count);
+	}
+
+	/* pairs, by how often they ran */
+	count = 0;
+	for (int i = 0; i < SPY_OPCODES; i++) {
+		if (i == PROFILE_NONE) continue;
+		for (int j = 0; j < SPY_OPCODES; j++) {
+			if (!P->pairs[i][j]) continue;
+			entries[count].first = i;
+			entries[count].second = j;
+			entries[count].count = P->pairs[i][j];
+			entries[count].ticks = 0;
+			count++;
+		}
+	}
+	qsort(entries, count, sizeof(ProfileEntry), Profile_compare);
+	fprintf(stderr, "\nmost frequent opcode pairs\n");
+	fprintf(stderr, "%-20s %14s %7s\n", "pair", "count", "%");
+	for (size_t i = 0; i < count && i < PROFILE_PAIRS; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "%s %s", instructions[entries[i].first].name, instructions[entries[i].second].name);
+		fprintf(stderr, "%-20s %14llu %6.2f%%\n", name, (unsigned long long)entries[i].count,
+			100.0 * entries[i].count / (instructions_run ? instructions_run : 1));
+	}
+	fprintf(stderr, "profile written to '%s'\n", P->output);
+
+	free(entries);
+	Profile_write(S);
+}
+
+/* the call graph profiler.  with SPY_CALLGRAPH the program runs in
+ * Spy_runCallGraph, where CALL and the returns report to the functions
+ * below.  they keep a shadow stack of activations and a tree of calling
+ * contexts (every distinct path of calls from the entry point gets its
+ * own node), each with the ticks spent in it but not in its callees.
+ * per function there are calls, exclusive ticks and inclusive ticks,
+ * recursive activations inside an outer one aren't counted twice.
+ * instructions run at full speed in between, only calls and returns are
+ * timed.  time in C functions belongs to their caller.
+ *
+ * functions are named by the __FUNC__ labels the assembler keeps in the
+ * symbol table, anything else is shown as @offset.  the report on stderr
+ * lists the functions with the most inclusive time, file.folded gets one
+ * line per calling context in the folded stack format flame graph tools
+ * read:
+ *
+ *	(entry);main;fib;fib 1234
+ */
+
+SpyCallGraph*
+Spy_newCallGraph(SpyState* S, const char* filename) {
+	SpyCallGraph* G = (SpyCallGraph *)calloc(1, sizeof(SpyCallGraph));
+	if (!G) Spy_crash(S, "Out of memory\n");
+	G->output = Profile_output(S, filename, ".folded");
+	return G;
+}
+
+/* sets up the function table and the root of the tree, which stands for
+ * the code that runs before the first CALL */
+void
+Spy_callGraphInit(SpyState* S) {
+	SpyCallGraph* G = S->callgraph;
+	if (G->functions_by_cell) return;
+	G->functions_by_cell = (uint32_t *)malloc(S->program->code_size * sizeof(uint32_t));
+	if (!G->functions_by_cell) Spy_crash(S, "Out of memory\n");
+	memset(G->functions_by_cell, 0xFF, S->program->code_size * sizeof(uint32_t));
+	G->functions_capacity = 16;
+	G->functions = (ProfileFunction *)calloc(G->functions_capacity, sizeof(ProfileFunction));
+	G->nodes_capacity = 64;
+	G->nodes = (ProfileNode *)calloc(G->nodes_capacity, sizeof(ProfileNode));
+	G->frames_capacity = 64;
+	G->frames = (ProfileFrame *)malloc(G->frames_capacity * sizeof(ProfileFrame));
+	if (!G->functions || !G->nodes || !G->frames) Spy_crash(S, "Out of memory\n");
+	G->functions[0].name = "(entry)";
+	G->functions[0].calls = 1;
+	G->nfunctions = 1;
+	G->nnodes = 1;
+	Profile_push(S, 0, NULL, PROFILE_CLOCK());
+}
+
+/* the function starting at a cell, added the first time it's called */
+static uint32_t
+Profile_function(SpyState* S, size_t cell) {
+	SpyCallGraph* G = S->callgraph;
+	if (G->functions_by_cell[cell] != PROFILE_UNKNOWN) {
+		return G->functions_by_cell[cell];
+	}
+	if (G->nfunctions == G->functions_capacity) {
+		G->functions_capacity *= 2;
+		G->functions = (ProfileFunction *)realloc(G->functions, G->functions_capacity * sizeof(ProfileFunction));
+		if (!G->functions) Spy_crash(S, "Out of memory\n");
+	}
+	ProfileFunction* F = &G->functions[G->nfunctions];
+	memset(F, 0, sizeof(ProfileFunction));
+	F->entry = S->program->cell_offsets[cell];
+	F->name = Spy_functionName(S, F->entry);
+	G->functions_by_cell[cell] = G->nfunctions;
+	return G->nfunctions++;
+}
+
+/* the child of 'parent' for calls to 'function' */
+static uint32_t
+Profile_node(SpyState* S, uint32_t parent, uint32_t function) {
+	SpyCallGraph* G = S->callgraph;
+	for (uint32_t i = G->nodes[parent].child; i; i = G->nodes[i].sibling) {
+		if (G->nodes[i].function == function) {
+			return i;
+		}
+	}
+	if (G->nnodes == G->nodes_capacity) {
+		G->nodes_capacity *= 2;
+		G->nodes = (ProfileNode *)realloc(G->nodes, G->nodes_capacity * sizeof(ProfileNode));
+		if (!G->nodes) Spy_crash(S, "Out of memory\n");
+	}
+	ProfileNode* N = &G->nodes[G->nnodes];
+	N->function = function;
+	N->parent = parent;
+	N->child = 0;
+	N->sibling = G->nodes[parent].child;
+	N->exclusive = 0;
+	G->nodes[parent].child = G->nnodes;
+	return G->nnodes++;
+}
+
+static void
+Profile_push(SpyState* S, uint32_t node, uint8_t* bp, uint64_t now) {
+	SpyCallGraph* G = S->callgraph;
+	if (G->nframes == G->frames_capacity) {
+		G->frames_capacity *= 2;
+		G->frames = (ProfileFrame *)realloc(G->frames, G->frames_capacity * sizeof(ProfileFrame));
+		if (!G->frames) Spy_crash(S, "Out of memory\n");
+	}
+	ProfileFrame* F = &G->frames[G->nframes++];
+	F->node = node;
+	F->bp = bp;
+	F->start = now;
+	F->callees = 0;
+	G->functions[G->nodes[node].function].active++;
+}
+
+static void
+Profile_pop(SpyState* S, uint64_t now) {
+	SpyCallGraph* G = S->callgraph;
+	ProfileFrame* F = &G->frames[--G->nframes];
+	ProfileFunction* function = &G->functions[G->nodes[F->node].function];
+	uint64_t elapsed = now - F->start;
+	uint64_t exclusive = elapsed > F->callees ? elapsed - F->callees : 0;
+	G->nodes[F->node].exclusive += exclusive;
+	function->exclusive += exclusive;
+	if (--function->active == 0) {
+		function->inclusive += elapsed;
+	}
+	if (G->nframes) {
+		G->frames[G->nframes - 1].callees += elapsed;
+	}
+}
+
+/* CALL to 'cell', the callee runs with 'bp' */
+void
+Spy_callGraphEnter(SpyState* S, size_t cell, uint8_t* bp) {
+	SpyCallGraph* G = S->callgraph;
+	uint64_t now = PROFILE_CLOCK();
+	uint32_t function = Profile_function(S, cell);
+	G->functions[function].calls++;
+	Profile_push(S, Profile_node(S, G->frames[G->nframes - 1].node, function), bp, now);
+}
+
+/* IRET, FRET or VRET out of the frame at 'bp'.  frames entered while the
+ * profiler wasn't looking (the debug loop) don't match and are ignored */
+void
+Spy_callGraphLeave(SpyState* S, uint8_t* bp) {
+	SpyCallGraph* G = S->callgraph;
+	if (G->nframes > 1 && G->frames[G->nframes - 1].bp == bp) {
+		Profile_pop(S, PROFILE_CLOCK());
+	}
+}
+
+static void
+Profile_printName(SpyState* S, FILE* f, uint32_t function) {
+	const ProfileFunction* F = &S->callgraph->functions[function];
+	if (F->name) {
+		fputs(F->name, f);
+	} else {
+		fprintf(f, "@%u", F->entry);
+	}
+}
+
+/* most inclusive time first */
+static int
+Profile_compareFunctions(const void* a, const void* b) {
+	const ProfileFunction* x = (const ProfileFunction *)a;
+	const ProfileFunction* y = (const ProfileFunction *)b;
+	if (x->inclusive != y->inclusive) return x->inclusive < y->inclusive ? 1 : -1;
+	if (x->exclusive != y->exclusive) return x->exclusive < y->exclusive ? 1 : -1;
+	return 0;
+}
+
+/* one line per calling context that spent any time of its own */
+static void
+Profile_writeFolded(SpyState* S, FILE* f) {
+	SpyCallGraph* G = S->callgraph;
+	uint32_t* path = (uint32_t *)malloc(G->nnodes * sizeof(uint32_t));
+	if (!path) Spy_crash(S, "Out of memory\n");
+	for (uint32_t i = 0; i < G->nnodes; i++) {
+		size_t depth = 0;
+		if (!G->nodes[i].exclusive) continue;
+		for (uint32_t n = i; ; n = G->nodes[n].parent) {
+			path[depth++] = G->nodes[n].function;
+			if (!n) break;
+		}
+		while (depth--) {
+			Profile_printName(S, f, path[depth]);
+			fputc(depth ? ';' : ' ', f);
+		}
+		fprintf(f, "%llu\n", (unsigned long long)G->nodes[i].exclusive);
+	}
+	free(path);
+}
+
+/* closes the frames still open, prints the report and writes the folded
+ * stacks */
+void
+Spy_callGraphReport(SpyState* S) {
+	SpyCallGraph* G = S->callgraph;
+	uint64_t now = PROFILE_CLOCK();
+	if (!G->functions_by_cell) return;
+	while (G->nframes) {
+		Profile_pop(S, now);
+	}
+	uint64_t total = G->functions[0].inclusive;
+
+	FILE* f = fopen(G->output, "w");
+	if (f) {
+		Profile_writeFolded(S, f);
+		fclose(f);
+	} else {
+		fprintf(stderr, "couldn't write profile '%s'\n", G->output);
+	}
+
+	/* sorting loses the indices the nodes use, so it's the last step */
+	qsort(G->functions, G->nfunctions, sizeof(ProfileFunction), Profile_compareFunctions);
+	Spy_flushOutput(S);
+	fprintf(stderr, "\ncall graph profile, %zu functions, %llu %s\n",
+		G->nfunctions, (unsigned long long)total, PROFILE_UNIT);
+	fprintf(stderr, "%-20s %12s %16s %7s %16s %7s %10s  %s\n",
+		"function", "calls", "inclusive", "%", "exclusive", "%", "each", "source");
+	for (size_t i = 0; i < G->nfunctions && i < PROFILE_FUNCTIONS; i++) {
+		const ProfileFunction* F = &G->functions[i];
+		char name[32];
+		if (F->name) {
+			snprintf(name, sizeof(name), "%s", F->name);
+		} else {
+			snprintf(name, sizeof(name), "@%u", F->entry);
+		}
+		SpyLocation location;
+		Spy_locateOffset(S, F->entry, &location);
+		fprintf(stderr, "%-20s %12llu %16llu %6.2f%% %16llu %6.2f%% %10.1f  ",
+			name,
+			(unsigned long long)F->calls,
+			(unsigned long long)F->inclusive,
+			100.0 * F->inclusive / (total ? total : 1),
+			(unsigned long long)F->exclusive,
+			100.0 * F->exclusive / (total ? total : 1),
+			(double)F->inclusive / (F->calls ? F->calls : 1));
+		if (location.file) {
+			fprintf(stderr, "%s:%u", location.file, location.line);
+		}
+		fputc('\n', stderr);
+	}
+	fprintf(stderr, "folded stacks written to '%s'\n", G->output);
+}
+
+/* the sampling profiler.  the instrumenting profilers above change what
+ * they measure, every instruction or call pays for the clock.  sampling
+ * runs the program in Spy_runSample, which does nothing between
+ * instructions but store ip and bp into S where a SIGPROF handler can
+ * find them.  an ITIMER_PROF timer raises the signal S->sampler->rate
+ * times per second of CPU time the process uses, and each sample counts
+ * the instruction about to run and walks the chain of saved bps, charging
+ * every function on the stack once.  the handler only adds to counters
+ * allocated before the timer started.
+ *
+ * the report on stderr lists functions by samples with them anywhere on
+ * the stack (total) and in them (self), and the instructions most samples
+ * landed on with their source lines.  file.samples gets all of it:
+ *
+ *	function	NAME	self	total
+ *	instruction	OFFSET	OPCODE	samples	FILE:LINE
+ *
+ * time in C functions belongs to the CCALL or NCALL that called them.
+ * the JIT is off, native code doesn't keep ip in S */
+
+/* the state the timer samples, the handler has no other way to find it */
+static SpyState* volatile profile_sampled = NULL;
+
+SpySampler*
+Spy_newSampler(SpyState* S, const char* filename, uint32_t rate) {
+	SpySampler* Z = (SpySampler *)calloc(1, sizeof(SpySampler));
+	if (!Z) Spy_crash(S, "Out of memory\n");
+	Z->output = Profile_output(S, filename, ".samples");
+	Z->rate = rate > 1000000 ? 1000000 : rate;
+	return Z;
+}
+
+/* arms the timer, a rate of 0 stops it */
+static void
+Profile_timer(uint32_t rate) {
+	struct itimerval timer;
+	uint64_t usec = rate ? 1000000 / rate : 0;
+	timer.it_interval.tv_sec = usec / 1000000;
+	timer.it_interval.tv_usec = usec % 1000000;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static void
+Profile_signal(int sig) {
+	SpyState* S = profile_sampled;
+	(void)sig;
+	if (!S) return;
+	SpySampler* Z = S->sampler;
+	const SpyCode* ip = *(const SpyCode* volatile *)&S->ip;
+	uint8_t* bp = *(uint8_t* volatile *)&S->bp;
+	const SpyCode* code = S->code;
+	uint64_t sample = ++Z->samples;
+
+	/* outside of the loop or between variants */
+	if (!code || ip < code || ip >= code + S->program->code_size) {
+		Z->lost++;
+		return;
+	}
+	size_t cell = ip - code;
+	ProfileSampled* F = &Z->functions[Z->functions_by_cell[cell]];
+	Z->cells[cell]++;
+	F->self++;
+	F->total++;
+	F->seen = sample;
+
+	/* every frame holds its return address at bp and the caller's bp
+	 * below it, the frame Spy_execute fakes for the entry point has junk
+	 * there and ends the walk */
+	uint8_t* const low = &S->memory[START_STACK + 8];
+	uint8_t* const high = &S->memory[S->heap_start - SIZE_GUARD - 8];
+	for (int depth = 0; bp >= low && bp <= high; depth++) {
+		int64_t ret = *(int64_t *)bp;
+		if (ret <= 0 || (uint64_t)ret >= S->program->code_size) break;
+		if (depth == PROFILE_DEPTH) {
+			Z->truncated++;
+			break;
+		}
+		/* the cell before the return address is the caller's CALL */
+		F = &Z->functions[Z->functions_by_cell[ret - 1]];
+		if (F->seen != sample) {
+			F->total++;
+			F->seen = sample;
+		}
+		bp = *(uint8_t **)(bp - 8);
+	}
+}
+
+/* maps cells to functions and starts the timer, the first time the
+ * sampling loop runs.  functions come from the symbol table, or from the
+ * verifier if there is none */
+void
+Spy_samplerInit(SpyState* S) {
+	SpySampler* Z = S->sampler;
+	struct sigaction action;
+	if (Z->cells) return;
+	size_t count = S->program->symbol_count ? S->program->symbol_count : S->program->function_count;
+	Z->cells = (uint64_t *)calloc(S->program->code_size, sizeof(uint64_t));
+	Z->functions_by_cell = (uint32_t *)malloc(S->program->code_size * sizeof(uint32_t));
+	Z->functions = (ProfileSampled *)calloc(count + 1, sizeof(ProfileSampled));
+	if (!Z->cells || !Z->functions_by_cell || !Z->functions) Spy_crash(S, "Out of memory\n");
+	Z->functions[0].name = "(entry)";
+	for (size_t i = 0; i < count; i++) {
+		ProfileSampled* F = &Z->functions[i + 1];
+		F->entry = S->program->symbol_count ? S->program->symbols[i].offset : S->program->functions[i].entry;
+		F->name = Spy_functionName(S, F->entry);
+	}
+	Z->nfunctions = count + 1;
+
+	/* both are sorted, the function of a cell is the last one starting at
+	 * or before it */
+	size_t function = 0;
+	for (size_t cell = 0; cell < S->program->code_size; cell++) {
+		while (function + 1 < Z->nfunctions && Z->functions[function + 1].entry <= S->program->cell_offsets[cell]) {
+			function++;
+		}
+		Z->functions_by_cell[cell] = function;
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = Profile_signal;
+	action.sa_flags = SA_RESTART; /* C functions reading files shouldn't see EINTR */
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, NULL);
+	profile_sampled = S;
+	Profile_timer(Z->rate);
+}
+
+/* most total samples first */
+static int
+Profile_compareSampled(const void* a, const void* b) {
+	const ProfileSampled* x = (const ProfileSampled *)a;
+	const ProfileSampled* y = (const ProfileSampled *)b;
+	if (x->total != y->total) return x->total < y->total ? 1 : -1;
+	if (x->self != y->self) return x->self < y->self ? 1 : -1;
+	return 0;
+}
+
+static void
+Profile_writeSamples(SpyState* S, FILE* f) {
+	SpySampler* Z = S->sampler;
+	for (size_t i = 0; i < Z->nfunctions; i++) {
+		const ProfileSampled* F = &Z->functions[i];
+		if (!F->total) continue;
+		if (F->name) {
+			fprintf(f, "function\t%s", F->name);
+		} else {
+			fprintf(f, "function\t@%u", F->entry);
+		}
+		fprintf(f, "\t%llu\t%llu\n", (unsigned long long)F->self, (unsigned long long)F->total);
+	}
+	for (size_t cell = 0; cell < S->program->code_size; cell++) {
+		if (!Z->cells[cell]) continue;
+		SpyLocation location;
+		Spy_locateOffset(S, S->program->cell_offsets[cell], &location);
+		fprintf(f, "instruction\t%u\t%s\t%llu\t", location.offset,
+			location.offset < S->program->bytecode_size ? instructions[S->program->bytecode[location.offset]].name : "end",
+			(unsigned long long)Z->cells[cell]);
+		if (location.file) {
+			fprintf(f, "%s:%u", location.file, location.line);
+		}
+		fputc('\n', f);
+	}
+}
+
+/* stops the timer, prints the report and writes the histograms */
+void
+Spy_samplerReport(SpyState* S) {
+	SpySampler* Z = S->sampler;
+	ProfileEntry* entries;
+	size_t count = 0;
+	Profile_timer(0);
+	profile_sampled = NULL;
+	if (!Z->cells) return;
+	uint64_t taken = Z->samples - Z->lost;
+
+	FILE* f = fopen(Z->output, "w");
+	if (f) {
+		Profile_writeSamples(S, f);
+		fclose(f);
+	} else {
+		fprintf(stderr, "couldn't write profile '%s'\n", Z->output);
+	}
+
+	Spy_flushOutput(S);
+	fprintf(stderr, "\nsampling profile, %llu samples at %u Hz", (unsigned long long)Z->samples, Z->rate);
+	if (Z->lost) fprintf(stderr, ", %llu outside of the interpreter", (unsigned long long)Z->lost);
+	if (Z->truncated) fprintf(stderr, ", %llu stacks cut off at %d frames", (unsigned long long)Z->truncated, PROFILE_DEPTH);
+	fputc('\n', stderr);
+	qsort(Z->functions, Z->nfunctions, sizeof(ProfileSampled), Profile_compareSampled);
+	fprintf(stderr, "%-20s %10s %7s %10s %7s  %s\n", "function", "total", "%", "self", "%", "source");
+	for (size_t i = 0; i < Z->nfunctions && i < PROFILE_FUNCTIONS && Z->functions[i].total; i++) {
+		const ProfileSampled* F = &Z->functions[i];
+		char name[32];
+		if (F->name) {
+			snprintf(name, sizeof(name), "%s", F->name);
+		} else {
+			snprintf(name, sizeof(name), "@%u", F->entry);
+		}
+		SpyLocation location;
+		Spy_locateOffset(S, F->entry, &location);
+		fprintf(stderr, "%-20s %10llu %6.2f%% %10llu %6.2f%%  ",
+			name,
+			(unsigned long long)F->total,
+			100.0 * F->total / (taken ? taken : 1),
+			(unsigned long long)F->self,
+			100.0 * F->self / (taken ? taken : 1));
+		if (location.file) {
+			fprintf(stderr, "%s:%u", location.file, location.line);
+		}
+		fputc('\n', stderr);
+	}
+
+	/* instructions, by samples */
+	for (size_t cell = 0; cell < S->program->code_size; cell++) {
+		if (Z->cells[cell]) count++;
+	}
+	entries = (ProfileEntry *)malloc((count ? count : 1) * sizeof(ProfileEntry));
+	if (!entries) Spy_crash(S, "Out of memory\n");
+	count = 0;
+	for (size_t cell = 0; cell < S->program->code_size; cell++) {
+		if (!Z->cells[cell]) continue;
+		entries[count].first = cell;
+		entries[count].second = PROFILE_NONE;
+		entries[count].count = Z->cells[cell];
+		entries[count].ticks = 0;
+		count++;
+	}
+	qsort(entries, count, sizeof(ProfileEntry), Profile_compare);
+	fprintf(stderr, "\nhottest instructions\n");
+	fprintf(stderr, "%8s %-10s %10s %7s  %s\n", "offset", "opcode", "samples", "%", "source");
+	for (size_t i = 0; i < count && i < PROFILE_CELLS; i++) {
+		SpyLocation location;
+		Spy_locateOffset(S, S->program->cell_offsets[entries[i].first], &location);
+		fprintf(stderr, "%8u %-10s %10llu %6.2f%%  ", location.offset,
+			location.offset < S->program->bytecode_size ? instructions[S->program->bytecode[location.offset]].name : "end",
+			(unsigned long long)entries[i].count,
+			100.0 * entries[i].count / (taken ? taken : 1));
+		if (location.file) {
+			fprintf(stderr, "%s:%u", location.file, location.line);
+		}
+		if (location.function) {
+			fprintf(stderr, " in %s", location.function);
+		}
+		fputc('\n', stderr);
+	}
+	fprintf(stderr, "samples written to '%s'\n", Z->output);
+	free(entries);
+}
+
+/* whatever profilers S has, a sampler that is still running is stopped */
+void
+Spy_profileFree(SpyState* S) {
+	if (S->profile) {
+		free((char *)S->profile->output);
+		free(S->profile->ops);
+		free(S->profile->pairs);
+		free(S->profile);
+	}
+	if (S->callgraph) {
+		free((char *)S->callgraph->output);
+		free(S->callgraph->functions_by_cell);
+		free(S->callgraph->functions);
+		free(S->callgraph->nodes);
+		free(S->callgraph->frames);
+		free(S->callgraph);
+	}
+	if (S->sampler) {
+		if (profile_sampled == S) {
+			Profile_timer(0);
+			profile_sampled = NULL;
+		}
+		free((char *)S->sampler->output);
+		free(S->sampler->cells);
+		free(S->sampler->functions_by_cell);
+		free(S->sampler->functions);
+		free(S->sampler);
+	}
+	S->profile = NULL;
+	S->callgraph = NULL;
+	S->sampler = NULL;
+}
@@ -0,0 +1,133 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "spyre.h"
+
+#define PROFILE_NONE	0xFF /* previous opcode at the start of a run */
+#define PROFILE_PAIRS	20 /* pairs listed in the report */
+
+/* the profiling loop reads the clock before every instruction */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK()	__rdtsc()
+#define PROFILE_UNIT	"cycles"
+#else
+#define PROFILE_CLOCK()	Spy_profileClock()
+#define PROFILE_UNIT	"ns"
+#endif
+
+#define PROFILE_FUNCTIONS	20 /* functions listed in the call graph report */
+#define PROFILE_UNKNOWN		UINT32_MAX /* cell not known to start a function yet */
+
+#define PROFILE_RATE		1000 /* default samples per second of CPU time */
+#define PROFILE_DEPTH		1024 /* frames walked per sample */
+#define PROFILE_CELLS		20 /* instructions listed in the sampling report */
+
+typedef struct ProfileEntry ProfileEntry;
+typedef struct ProfileFunction ProfileFunction;
+typedef struct ProfileNode ProfileNode;
+typedef struct ProfileFrame ProfileFrame;
+typedef struct ProfileSampled ProfileSampled;
+
+/* one line of the report */
+struct ProfileEntry {
+	uint32_t		first;
+	uint32_t		second; /* PROFILE_NONE for single opcodes */
+	uint64_t		count;
+	uint64_t		ticks;
+};
+
+/* a function seen by the call graph profiler */
+struct ProfileFunction {
+	uint32_t		entry; /* code offset */
+	const char*		name; /* NULL if the bytecode didn't name it */
+	uint64_t		calls;
+	uint64_t		inclusive; /* ticks, counted for the outermost activation only */
+	uint64_t		exclusive; /* ticks not spent in callees */
+	uint32_t		active; /* activations on the stack */
+};
+
+/* a calling context, one path of calls from the entry point */
+struct ProfileNode {
+	uint32_t		function;
+	uint32_t		parent;
+	uint32_t		child; /* first callee, 0 if none (node 0 is the root) */
+	uint32_t		sibling;
+	uint64_t		exclusive;
+};
+
+/* an activation on the profiler's shadow stack */
+struct ProfileFrame {
+	uint32_t		node;
+	uint8_t*		bp; /* callee's bp, the return that leaves the frame runs with it */
+	uint64_t		start;
+	uint64_t		callees; /* ticks spent in calls made from this frame */
+};
+
+struct SpyCallGraph {
+	const char*		output; /* folded stacks are written here */
+	uint32_t*		functions_by_cell; /* cell index -> function, PROFILE_UNKNOWN if not called yet */
+	ProfileFunction*	functions;
+	size_t			nfunctions;
+	size_t			functions_capacity;
+	ProfileNode*	nodes;
+	size_t			nnodes;
+	size_t			nodes_capacity;
+	ProfileFrame*	frames;
+	size_t			nframes;
+	size_t			frames_capacity;
+};
+
+/* a function seen by the sampling profiler */
+struct ProfileSampled {
+	uint32_t		entry; /* code offset */
+	const char*		name; /* NULL if the bytecode didn't name it */
+	uint64_t		self; /* samples taken in the function itself */
+	uint64_t		total; /* samples with the function anywhere on the stack */
+	uint64_t		seen; /* last sample that counted it in 'total' */
+};
+
+/* everything the signal handler touches is allocated before the timer
+ * starts */
+struct SpySampler {
+	const char*		output; /* the histograms are written here */
+	uint32_t		rate; /* samples per second of CPU time */
+	uint64_t*		cells; /* cell index -> samples with ip there */
+	uint32_t*		functions_by_cell; /* cell index -> function */
+	ProfileSampled*	functions; /* 0 is the code outside of any function */
+	size_t			nfunctions;
+	uint64_t		samples;
+	uint64_t		lost; /* samples taken outside of the interpreter */
+	uint64_t		truncated; /* stacks deeper than PROFILE_DEPTH */
+};
+
+SpyProfile*	Spy_newProfile(SpyState*, const char*);
+void		Spy_profileInit(SpyState*);
+void		Spy_profileReport(SpyState*);
+uint64_t	Spy_profileClock(void);
+SpyCallGraph*	Spy_newCallGraph(SpyState*, const char*);
+void		Spy_callGraphInit(SpyState*);
+void		Spy_callGraphEnter(SpyState*, size_t, uint8_t*);
+void		Spy_callGraphLeave(SpyState*, uint8_t*);
+void		Spy_callGraphReport(SpyState*);
+SpySampler*	Spy_newSampler(SpyState*, const char*, uint32_t);
+void		Spy_samplerInit(SpyState*);
+void		Spy_samplerReport(SpyState*);
+void		Spy_profileFree(SpyState*);
+static int	Profile_compare(const void*, const void*);
+static void	Profile_write(SpyState*);
+static char*	Profile_output(SpyState*, const char*, const char*);
+static uint32_t	Profile_function(SpyState*, size_t);
+static uint32_t	Profile_node(SpyState*, uint32_t, uint32_t);
+static void	Profile_push(SpyState*, uint32_t, uint8_t*, uint64_t);
+static void	Profile_pop(SpyState*, uint64_t);
+static void	Profile_printName(SpyState*, FILE*, uint32_t);
+static int	Profile_compareFunctions(const void*, const void*);
+static void	Profile_writeFolded(SpyState*, FILE*);
+static void	Profile_signal(int);
+static void	Profile_timer(uint32_t);
+static int	Profile_compareSampled(const void*, const void*);
+static void	Profile_writeSamples(SpyState*, FILE*);
+
+#endif
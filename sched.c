@@ -0,0 +1,258 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "sched.h"
+
+/* M programs on N threads.  every worker thread has a queue of tasks
+ * that are ready to run.  a task runs for a slice, Spy_resume with the
+ * scheduler's budget, and goes to the back of its worker's queue if it
+ * yielded, so the tasks on a worker take turns.  a worker whose queue is
+ * empty steals half of another worker's, tasks only move between threads
+ * then.
+ *
+ * time slices are cut by a ticker thread that wakes every quantum and
+ * preempts the task in any slice it already saw on its last tick, so a
+ * slice lasts one to two quanta and a task that never ends can't keep
+ * the others on its worker from running.  a slice stops at the first
+ * call or backward jump after it was preempted, see Spy_resume.
+ *
+ * every slice runs under Spy_protect, a task that crashes or calls
+ * exit() ends just itself */
+
+/* 'threads' workers cutting slices after 'quantum' microseconds (0 for
+ * no time slices) or 'budget' instructions (0 for no limit) */
+SpyScheduler*
+Spy_newScheduler(uint32_t threads, uint32_t quantum, int64_t budget) {
+	SpyScheduler* Z = (SpyScheduler *)calloc(1, sizeof(SpyScheduler));
+	if (!Z) Spy_crash(NULL, "Out of memory\n");
+	Z->threads = threads ? threads : 1;
+	Z->quantum = quantum;
+	Z->budget = budget > 0 ? budget : SPY_UNLIMITED;
+	Z->workers = (SchedWorker *)calloc(Z->threads, sizeof(SchedWorker));
+	if (!Z->workers) Spy_crash(NULL, "Out of memory\n");
+	for (uint32_t i = 0; i < Z->threads; i++) {
+		Z->workers[i].scheduler = Z;
+		pthread_mutex_init(&Z->workers[i].lock, NULL);
+	}
+	pthread_mutex_init(&Z->idle_lock, NULL);
+	pthread_cond_init(&Z->idle, NULL);
+	return Z;
+}
+
+/* the tasks are the owner's, 'done' has been called for every one */
+void
+Spy_freeScheduler(SpyScheduler* Z) {
+	for (uint32_t i = 0; i < Z->threads; i++) {
+		pthread_mutex_destroy(&Z->workers[i].lock);
+		free(Z->workers[i].queue);
+	}
+	pthread_mutex_destroy(&Z->idle_lock);
+	pthread_cond_destroy(&Z->idle);
+	free(Z->workers);
+	free(Z);
+}
+
+/* adds a task, before Spy_runScheduler.  tasks are dealt to the workers
+ * in turn */
+void
+Spy_schedule(SpyScheduler* Z, SpyTask* T) {
+	T->state = NULL;
+	T->status = 0;
+	T->slices = 0;
+	Sched_push(&Z->workers[Z->next++ % Z->threads], T);
+	Z->pending++;
+}
+
+/* runs every task to its end, returns once 'done' was called for all */
+void
+Spy_runScheduler(SpyScheduler* Z) {
+	pthread_t ticker;
+	for (uint32_t i = 0; i < Z->threads; i++) {
+		if (pthread_create(&Z->workers[i].thread, NULL, Sched_worker, &Z->workers[i])) {
+			Spy_crash(NULL, "couldn't start a thread\n");
+		}
+	}
+	if (Z->quantum && pthread_create(&ticker, NULL, Sched_ticker, Z)) {
+		Spy_crash(NULL, "couldn't start a thread\n");
+	}
+	for (uint32_t i = 0; i < Z->threads; i++) {
+		pthread_join(Z->workers[i].thread, NULL);
+	}
+	if (Z->quantum) {
+		__atomic_store_n(&Z->stop, 1, __ATOMIC_RELAXED);
+		pthread_join(ticker, NULL);
+	}
+}
+
+/* puts T at the back of W's queue, returns how many tasks are in it */
+static size_t
+Sched_push(SchedWorker* W, SpyTask* T) {
+	size_t count;
+	pthread_mutex_lock(&W->lock);
+	if (W->count == W->capacity) {
+		size_t capacity = W->capacity ? W->capacity * 2 : 16;
+		SpyTask** queue = (SpyTask **)malloc(capacity * sizeof(SpyTask *));
+		if (!queue) Spy_crash(NULL, "Out of memory\n");
+		for (size_t i = 0; i < W->count; i++) {
+			queue[i] = W->queue[(W->head + i) % W->capacity];
+		}
+		free(W->queue);
+		W->queue = queue;
+		W->head = 0;
+		W->capacity = capacity;
+	}
+	W->queue[(W->head + W->count) % W->capacity] = T;
+	count = ++W->count;
+	pthread_mutex_unlock(&W->lock);
+	return count;
+}
+
+/* the next task for W to run, from its own queue or stolen.  waits while
+ * every task left is running on another worker, NULL once all are done */
+static SpyTask*
+Sched_next(SchedWorker* W) {
+	SpyScheduler* Z = W->scheduler;
+	const size_t self = W - Z->workers;
+	for (;;) {
+		SpyTask* T = NULL;
+		size_t stolen = 0;
+		struct timespec until;
+		pthread_mutex_lock(&W->lock);
+		if (W->count) {
+			T = W->queue[W->head];
+			W->head = (W->head + 1) % W->capacity;
+			W->count--;
+		}
+		pthread_mutex_unlock(&W->lock);
+		if (T) return T;
+
+		for (uint32_t i = 1; i < Z->threads && !stolen; i++) {
+			stolen = Sched_steal(W, &Z->workers[(self + i) % Z->threads]);
+		}
+		if (stolen) continue;
+
+		pthread_mutex_lock(&Z->idle_lock);
+		if (!Z->pending) {
+			pthread_mutex_unlock(&Z->idle_lock);
+			return NULL;
+		}
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += SCHED_IDLE * 1000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		__atomic_add_fetch(&Z->sleepers, 1, __ATOMIC_RELAXED);
+		pthread_cond_timedwait(&Z->idle, &Z->idle_lock, &until);
+		__atomic_sub_fetch(&Z->sleepers, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&Z->idle_lock);
+	}
+}
+
+/* moves up to half of victim's queue, from its back, to the back of W's.
+ * returns how many tasks moved */
+static size_t
+Sched_steal(SchedWorker* W, SchedWorker* victim) {
+	SpyTask* stolen[SCHED_STEAL];
+	size_t n;
+	pthread_mutex_lock(&victim->lock);
+	n = (victim->count + 1) / 2;
+	if (n > SCHED_STEAL) n = SCHED_STEAL;
+	for (size_t i = 0; i < n; i++) {
+		victim->count--;
+		stolen[i] = victim->queue[(victim->head + victim->count) % victim->capacity];
+	}
+	pthread_mutex_unlock(&victim->lock);
+	/* the back of the victim's queue is first, keep their order */
+	for (size_t i = n; i-- > 0;) {
+		Sched_push(W, stolen[i]);
+	}
+	W->steals += n;
+	return n;
+}
+
+static void*
+Sched_worker(void* arg) {
+	SchedWorker* W = (SchedWorker *)arg;
+	SpyScheduler* Z = W->scheduler;
+	SpyTask* T;
+	while ((T = Sched_next(W))) {
+		int status = T->state ? 0 : Spy_protect(Sched_start, T);
+		W->yielded = 0;
+		if (!status && T->state) {
+			pthread_mutex_lock(&W->lock);
+			W->running = T;
+			W->slice++;
+			pthread_mutex_unlock(&W->lock);
+			T->slices++;
+			status = Spy_protect(Sched_slice, W);
+			/* the ticker won't touch T once it's off 'running' */
+			pthread_mutex_lock(&W->lock);
+			W->running = NULL;
+			pthread_mutex_unlock(&W->lock);
+		}
+
+		if (W->yielded) {
+			/* wake a worker with nothing to do if there's a task to spare */
+			if (Sched_push(W, T) > 1 && __atomic_load_n(&Z->sleepers, __ATOMIC_RELAXED)) {
+				pthread_cond_signal(&Z->idle);
+			}
+			continue;
+		}
+		T->status = status;
+		if (T->done) T->done(T);
+		pthread_mutex_lock(&Z->idle_lock);
+		if (!--Z->pending) pthread_cond_broadcast(&Z->idle);
+		pthread_mutex_unlock(&Z->idle_lock);
+	}
+	return NULL;
+}
+
+/* a task's first turn, protected */
+static void
+Sched_start(void* arg) {
+	SpyTask* T = (SpyTask *)arg;
+	T->start(T);
+}
+
+/* one slice of the task W is running, protected.  W->yielded is only
+ * set if the slice returns with the program still going */
+static void
+Sched_slice(void* arg) {
+	SchedWorker* W = (SchedWorker *)arg;
+	W->yielded = !Spy_resume(W->running->state, W->scheduler->budget);
+}
+
+/* wakes every quantum until the workers are done */
+static void*
+Sched_ticker(void* arg) {
+	SpyScheduler* Z = (SpyScheduler *)arg;
+	struct timespec quantum;
+	quantum.tv_sec = Z->quantum / 1000000;
+	quantum.tv_nsec = (Z->quantum % 1000000) * 1000;
+	while (!__atomic_load_n(&Z->stop, __ATOMIC_RELAXED)) {
+		struct timespec left = quantum;
+		while (nanosleep(&left, &left) && errno == EINTR) {
+			/* interrupted, sleep the rest */
+		}
+		Sched_tick(Z);
+	}
+	return NULL;
+}
+
+/* preempts every slice that was already running at the last tick.  it's
+ * done again on every tick the slice goes on, Spy_preempt may be lost */
+static void
+Sched_tick(SpyScheduler* Z) {
+	for (uint32_t i = 0; i < Z->threads; i++) {
+		SchedWorker* W = &Z->workers[i];
+		pthread_mutex_lock(&W->lock);
+		if (W->running && W->slice == W->seen) {
+			Spy_preempt(W->running->state);
+		}
+		W->seen = W->slice;
+		pthread_mutex_unlock(&W->lock);
+	}
+}
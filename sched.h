@@ -0,0 +1,71 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "spyre.h"
+
+#define SCHED_QUANTUM	10000 /* default time slice, in microseconds */
+#define SCHED_IDLE		1000 /* longest an idle worker waits before it looks for work again, in microseconds */
+#define SCHED_STEAL		32 /* most tasks taken from another worker at once */
+
+typedef struct SpyScheduler SpyScheduler;
+typedef struct SpyTask SpyTask;
+typedef struct SchedWorker SchedWorker;
+
+/* a program the scheduler runs a slice at a time.  the owner fills in
+ * 'start', 'done' and 'data', the rest belongs to the scheduler until
+ * 'done' is called */
+struct SpyTask {
+	SpyState*		state; /* NULL until 'start' sets it */
+	void			(*start)(SpyTask*); /* makes and starts the state, on the task's first turn */
+	void			(*done)(SpyTask*); /* the program ended, however it did */
+	void*			data; /* the owner's */
+	int				status; /* exit status, once done */
+	uint64_t		slices; /* slices it took */
+};
+
+/* a thread and its run queue, a ring of tasks.  the worker takes tasks
+ * from the front and puts the ones that yielded at the back, thieves
+ * take from the back */
+struct SchedWorker {
+	SpyScheduler*	scheduler;
+	pthread_t		thread;
+	pthread_mutex_t	lock; /* held to touch the queue or 'running' */
+	SpyTask**		queue;
+	size_t			head;
+	size_t			count;
+	size_t			capacity;
+	SpyTask*		running; /* the task in its slice, NULL between slices */
+	uint64_t		slice; /* slices started */
+	uint64_t		seen; /* 'slice' at the ticker's last tick */
+	uint8_t			yielded; /* the last slice's task can go on, see Sched_slice */
+	uint64_t		steals; /* tasks taken from other workers */
+};
+
+struct SpyScheduler {
+	SchedWorker*	workers;
+	uint32_t		threads;
+	uint32_t		quantum; /* microseconds a slice lasts at least, 0 for no time slices */
+	int64_t			budget; /* instructions a slice lasts at most */
+	size_t			next; /* worker the next task goes to */
+	size_t			pending; /* tasks not done yet */
+	uint32_t		sleepers; /* workers waiting on 'idle' */
+	uint8_t			stop; /* ends the ticker */
+	pthread_mutex_t	idle_lock;
+	pthread_cond_t	idle; /* there may be work to steal, or none left */
+};
+
+SpyScheduler*	Spy_newScheduler(uint32_t, uint32_t, int64_t);
+void			Spy_freeScheduler(SpyScheduler*);
+void			Spy_schedule(SpyScheduler*, SpyTask*);
+void			Spy_runScheduler(SpyScheduler*);
+
+static size_t	Sched_push(SchedWorker*, SpyTask*);
+static SpyTask*	Sched_next(SchedWorker*);
+static size_t	Sched_steal(SchedWorker*, SchedWorker*);
+static void*	Sched_worker(void*);
+static void		Sched_start(void*);
+static void		Sched_slice(void*);
+static void*	Sched_ticker(void*);
+static void		Sched_tick(SpyScheduler*);
+
+#endif
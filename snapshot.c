@@ -0,0 +1,201 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+/* warm starts.  with SPY_SNAPSHOT the program's first call to snapshot()
+ * writes its memory and registers to file.snap next to file.spyb, and
+ * the next run of the same bytecode with the same arguments maps that
+ * file over its memory and resumes right after the call instead of
+ * starting from the top.  the ROM isn't saved, it's the program's own.
+ *
+ * VM memory holds VM addresses, except for the frame pointers CALL
+ * saves, which are rebased when the snapshot is restored.  what C
+ * functions keep outside of VM memory (open files) isn't saved, a
+ * program should take its snapshot before it opens any.  frames on
+ * coroutine stacks aren't rebased, there's no snapshot while a
+ * coroutine is alive */
+
+SpySnapshot*
+Spy_newSnapshot(SpyState* S, const char* filename, int argc, char** argv) {
+	SpySnapshot* N = (SpySnapshot *)calloc(1, sizeof(SpySnapshot));
+	size_t len = strlen(filename);
+	if (!N) Spy_crash(S, "Out of memory\n");
+	N->output = (char *)malloc(len + 6);
+	if (!N->output) Spy_crash(S, "Out of memory\n");
+	strcpy(N->output, filename);
+	if (len > 5 && !strcmp(&N->output[len - 5], ".spyb")) {
+		N->output[len - 5] = 0;
+	}
+	strcat(N->output, ".snap");
+	N->arguments = Snapshot_hash(argc, argv);
+	return N;
+}
+
+void
+Spy_freeSnapshot(SpyState* S) {
+	if (!S->snapshot) return;
+	free(S->snapshot->output);
+	free(S->snapshot);
+	S->snapshot = NULL;
+}
+
+/* writes S's stack, heap and registers, S is inside a C function called
+ * by the program.  the file is written next to the old one and renamed
+ * over it, a run restoring at the same time sees one or the other */
+void
+Spy_saveSnapshot(SpyState* S) {
+	SpySnapshot* N = S->snapshot;
+	SpyProgram* P = S->program;
+	SnapshotHeader header;
+	struct stat st;
+	char* temporary;
+	size_t cell, offset;
+	int fd, ok;
+	if (!N || N->written || !S->code || !S->ip) return;
+	N->written = 1;
+	if (S->coroutines) {
+		fprintf(stderr, "couldn't write the snapshot '%s', coroutines are alive\n", N->output);
+		return;
+	}
+
+	/* the interpreter leaves ip past the call, compiled code on its
+	 * first operand, either way the run resumes at the next instruction */
+	cell = S->ip - 1 - S->code;
+	offset = P->cell_offsets[cell];
+	offset += Spy_instructionSize(P, &P->bytecode[offset]);
+
+	memset(&header, 0, sizeof(header));
+	if (stat(P->filename, &st) < 0) return;
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.arguments = N->arguments;
+	header.program_size = st.st_size;
+	header.program_mtime = st.st_mtim.tv_sec;
+	header.program_mtime_ns = st.st_mtim.tv_nsec;
+	header.program_inode = st.st_ino;
+	header.heap_start = S->heap_start;
+	header.heap_size = S->heap_size;
+	header.stack_committed = S->stack_committed;
+	header.heap_committed = S->heap_committed;
+	header.stack_offset = SNAPSHOT_ALIGN;
+	header.heap_offset = (SNAPSHOT_ALIGN + S->stack_committed + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+	header.memory = (uint64_t)(uintptr_t)S->memory;
+	header.start = P->code_map[offset];
+	header.sp = S->sp - S->memory;
+	header.bp = S->bp - S->memory;
+
+	temporary = (char *)malloc(strlen(N->output) + 5);
+	if (!temporary) Spy_crash(S, "Out of memory\n");
+	sprintf(temporary, "%s.new", N->output);
+	fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ok = fd >= 0 &&
+		pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+		pwrite(fd, &S->memory[START_STACK], S->stack_committed, header.stack_offset) == (ssize_t)S->stack_committed &&
+		pwrite(fd, &S->memory[S->heap_start], S->heap_committed, header.heap_offset) == (ssize_t)S->heap_committed &&
+		!ftruncate(fd, header.heap_offset + S->heap_committed);
+	if (fd >= 0) close(fd);
+	if (!ok || rename(temporary, N->output)) {
+		fprintf(stderr, "couldn't write the snapshot '%s'\n", N->output);
+		unlink(temporary);
+	}
+	free(temporary);
+}
+
+/* replaces S's stack, heap and registers with the snapshot's if there is
+ * one for this program and these arguments, before S first runs.  the
+ * memory is mapped from the file, pages are read as they're touched and
+ * copied when they're written.  returns 0 if there's no usable snapshot,
+ * S is left as it was */
+int
+Spy_restoreSnapshot(SpyState* S) {
+	SpySnapshot* N = S->snapshot;
+	SnapshotHeader header;
+	uint8_t* old;
+	int fd;
+	if (!N || S->alloc_sites) return 0; /* blocks in the snapshot have no sites */
+	fd = open(N->output, O_RDONLY);
+	if (fd < 0) return 0;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || !Snapshot_identify(S, fd, &header)) {
+		close(fd);
+		return 0;
+	}
+	if (mmap(&S->memory[START_STACK], header.stack_committed, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+			fd, header.stack_offset) == MAP_FAILED ||
+		(header.heap_committed && mmap(&S->memory[S->heap_start], header.heap_committed, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, header.heap_offset) == MAP_FAILED)) {
+		Spy_crash(S, "couldn't map the snapshot '%s'", N->output);
+	}
+	close(fd);
+	if (header.stack_committed > S->stack_committed) S->stack_committed = header.stack_committed;
+	S->heap_committed = header.heap_committed;
+	old = (uint8_t *)(uintptr_t)header.memory;
+	S->sp = &S->memory[header.sp];
+	S->bp = &S->memory[header.bp];
+	Snapshot_relocate(S, old, S->bp);
+	S->ip = NULL;
+	S->start = header.start;
+	N->written = 1;
+	return 1;
+}
+
+/* FNV-1a over the arguments and their lengths */
+static uint64_t
+Snapshot_hash(int argc, char** argv) {
+	uint64_t hash = 0xCBF29CE484222325;
+	for (int i = 0; i < argc; i++) {
+		const char* at = argv[i];
+		do {
+			hash = (hash ^ (uint8_t)*at) * 0x100000001B3;
+		} while (*at++);
+	}
+	return hash;
+}
+
+/* whether the snapshot was taken of S's program with S's arguments and
+ * fits S's memory, and the file holds all of it */
+static int
+Snapshot_identify(SpyState* S, int fd, SnapshotHeader* header) {
+	SpyProgram* P = S->program;
+	struct stat st;
+	if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION ||
+		header->arguments != S->snapshot->arguments) {
+		return 0;
+	}
+	if (stat(P->filename, &st) < 0 || header->program_size != (uint64_t)st.st_size ||
+		header->program_mtime != st.st_mtim.tv_sec || header->program_mtime_ns != st.st_mtim.tv_nsec ||
+		header->program_inode != st.st_ino) {
+		return 0;
+	}
+	if (header->heap_start != S->heap_start || header->heap_size != S->heap_size ||
+		header->stack_committed > S->heap_start - SIZE_GUARD - START_STACK ||
+		header->heap_committed > S->heap_size || header->start >= P->code_size ||
+		header->sp < START_STACK || header->sp >= START_STACK + header->stack_committed ||
+		header->bp < START_STACK || header->bp >= START_STACK + header->stack_committed) {
+		return 0;
+	}
+	return !(header->stack_offset % SNAPSHOT_ALIGN) && !(header->heap_offset % SNAPSHOT_ALIGN) &&
+		header->heap_offset >= header->stack_offset + header->stack_committed &&
+		!fstat(fd, &st) && (uint64_t)st.st_size >= header->heap_offset + header->heap_committed;
+}
+
+/* rebases the frame pointers saved in the frames from 'bp' down, they
+ * point into the memory at 'old'.  the frame Spy_execute fakes for the
+ * entry point has junk for a return address and ends the walk */
+static void
+Snapshot_relocate(SpyState* S, uint8_t* old, uint8_t* bp) {
+	uint8_t* const low = &S->memory[START_STACK + 8];
+	uint8_t* const high = &S->memory[S->heap_start - SIZE_GUARD - 8];
+	while (bp >= low && bp <= high) {
+		int64_t ret = *(int64_t *)bp;
+		uint8_t** saved = (uint8_t **)(bp - 8);
+		if (ret <= 0 || (uint64_t)ret >= S->program->code_size) break;
+		*saved = &S->memory[*saved - old];
+		bp = *saved;
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "spyre.h"
+
+#define SNAPSHOT_MAGIC		0x50414E53595053 /* "SPYSNAP" */
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_ALIGN		0x10000 /* file offset of the memory images, a multiple of any page size */
+
+typedef struct SnapshotHeader SnapshotHeader;
+
+/* what a state needs to write or restore a snapshot, see snapshot.c */
+struct SpySnapshot {
+	char*			output; /* file the snapshot is written to and restored from */
+	uint64_t		arguments; /* hash of the command line, a snapshot is only good for the same one */
+	uint8_t			written; /* snapshot() only saves the first time it's called */
+};
+
+/* the start of a snapshot file.  the stack and the heap follow at
+ * SNAPSHOT_ALIGN boundaries, each as many bytes as were committed */
+struct SnapshotHeader {
+	uint64_t		magic;
+	uint64_t		version;
+	uint64_t		arguments;
+	uint64_t		program_size; /* the .spyb the snapshot was taken of */
+	int64_t			program_mtime;
+	int64_t			program_mtime_ns;
+	uint64_t		program_inode;
+	uint64_t		heap_start;
+	uint64_t		heap_size;
+	uint64_t		stack_committed;
+	uint64_t		heap_committed;
+	uint64_t		stack_offset;
+	uint64_t		heap_offset;
+	uint64_t		memory; /* host address of the memory, saved frame pointers are relative to it */
+	uint64_t		start; /* cell to resume at */
+	uint64_t		sp; /* VM addresses */
+	uint64_t		bp;
+};
+
+SpySnapshot*	Spy_newSnapshot(SpyState*, const char*, int, char**);
+void			Spy_freeSnapshot(SpyState*);
+void			Spy_saveSnapshot(SpyState*);
+int				Spy_restoreSnapshot(SpyState*);
+
+static uint64_t	Snapshot_hash(int, char**);
+static int		Snapshot_identify(SpyState*, int, SnapshotHeader*);
+static void		Snapshot_relocate(SpyState*, uint8_t*, uint8_t*);
+
+#endif
@@ -1,27 +1,308 @@
+#define _GNU_SOURCE /* mmap, sigaction, sigsetjmp, memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "spyre.h"
 #include "api.h"
+#include "heap.h"
+#include "snapshot.h"
+#include "coroutine.h"
+#include "io.h"
 #include "assembler.h"
+#include "verify.h"
+#include "jit.h"
+#include "profile.h"
+
+/* interpreter return codes */
+#define SPY_HALT	0
+#define SPY_SWITCH	1 /* debugging was switched on or off, continue in another loop */
+#define SPY_YIELD	2 /* the budget is spent, see Spy_resume */
+
+/* faults caught while interpreting */
+#define SPY_OVERFLOW	1 /* touched the stack guard */
+#define SPY_ROMWRITE	2 /* wrote to the read-only ROM */
+#define SPY_UNMAPPED	3 /* touched memory that isn't the ROM, stack or heap */
+
+/* state being interpreted by this thread and where to go when it faults */
+static __thread SpyState* spy_running = NULL;
+static __thread sigjmp_buf spy_fault;
+static __thread uint64_t spy_fault_address;
+
+/* where Spy_exit goes instead of ending the process, see Spy_protect.
+ * spy_locked is the program whose lock this thread holds, if any */
+static __thread jmp_buf* spy_exit = NULL;
+static __thread int spy_status;
+static __thread SpyProgram* spy_locked = NULL;
+
+/* makes the first 'needed' bytes of a reserved range accessible, in
+ * SIZE_COMMIT steps but never past 'limit'.  'committed' bytes already
+ * are.  returns 0 if the memory couldn't be committed */
+static int
+Spy_commit(uint8_t* base, size_t* committed, size_t needed, size_t limit) {
+	size_t to = (needed + SIZE_COMMIT - 1) & ~(size_t)(SIZE_COMMIT - 1);
+	if (needed > limit) return 0;
+	if (to > limit) to = limit;
+	if (to <= *committed) return 1;
+	if (mprotect(&base[*committed], to - *committed, PROT_READ | PROT_WRITE)) return 0;
+	*committed = to;
+	return 1;
+}
+
+/* makes S's stack accessible up to 'top'.  the interpreter's pushes commit
+ * it from the fault handler, code writing to the stack outside of a run
+ * calls this first */
+static int
+Spy_commitStack(SpyState* S, const uint8_t* top) {
+	return Spy_commit(&S->memory[START_STACK], &S->stack_committed, top - &S->memory[START_STACK],
+		S->heap_start - SIZE_GUARD - START_STACK);
+}
+
+/* makes S's heap accessible up to VM address 'end', returns 0 if that's
+ * past the heap limit or the memory couldn't be committed */
+int
+Spy_commitHeap(SpyState* S, uint64_t end) {
+	if (end < S->heap_start) return 1;
+	return Spy_commit(&S->memory[S->heap_start], &S->heap_committed, end - S->heap_start, S->heap_size);
+}
+
+/* puts the program's ROM at the bottom of S's memory, read-only.  the
+ * pages are the program's own, shared by every state, unless the
+ * platform can't share them, then each state gets a copy */
+static void
+Spy_mapROM(SpyState* S) {
+	SpyProgram* P = S->program;
+	if (!P->rom_mapped) return;
+	if (P->rom_fd >= 0) {
+		if (mmap(&S->memory[START_ROM], P->rom_mapped, PROT_READ, MAP_SHARED | MAP_FIXED, P->rom_fd, 0) == MAP_FAILED) {
+			Spy_crash(S, "couldn't map the ROM\n");
+		}
+		return;
+	}
+	if (mprotect(&S->memory[START_ROM], P->rom_mapped, PROT_READ | PROT_WRITE)) {
+		Spy_crash(S, "couldn't map the ROM\n");
+	}
+	memcpy(&S->memory[START_ROM], P->rom, P->rom_size);
+	if (mprotect(&S->memory[START_ROM], P->rom_mapped, PROT_READ)) {
+		Spy_crash(S, "couldn't protect the ROM\n");
+	}
+}
+
+static void
+Spy_faultHandler(int sig, siginfo_t* info, void* context) {
+	SpyState* S = spy_running;
+	uint8_t* addr = (uint8_t *)info->si_addr;
+	if (!S || addr < S->memory || addr >= &S->memory[S->heap_start + S->heap_size]) {
+		/* not the VM's fault, let it happen again with the default action */
+		signal(sig, SIG_DFL);
+		return;
+	}
+	if (addr >= &S->memory[S->heap_start - SIZE_GUARD] && addr < &S->memory[S->heap_start]) {
+		siglongjmp(spy_fault, SPY_OVERFLOW);
+	}
+	if (S->coroutine) {
+		uint8_t* end = &S->memory[((SpyCoroutine *)&S->memory[S->coroutine])->end];
+		if (addr >= end && addr < end + SIZE_GUARD) {
+			siglongjmp(spy_fault, SPY_OVERFLOW);
+		}
+	}
+	if (addr >= &S->memory[START_STACK] && addr < &S->memory[S->heap_start - SIZE_GUARD] &&
+		Spy_commitStack(S, addr + 1)) {
+		return; /* the stack grew, try again */
+	}
+	if (addr < &S->memory[START_ROM + S->program->rom_mapped]) {
+		siglongjmp(spy_fault, SPY_ROMWRITE);
+	}
+	spy_fault_address = addr - S->memory;
+	siglongjmp(spy_fault, SPY_UNMAPPED);
+}
+
+static void
+Spy_setFaultHandler(void) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = Spy_faultHandler;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, NULL);
+	sigaction(SIGBUS, &action, NULL);
+}
+
+/* the handler is the process's, faults reach it on the thread that
+ * caused them and it finds that thread's state in spy_running */
+static void
+Spy_installFaultHandler(void) {
+	static pthread_once_t installed = PTHREAD_ONCE_INIT;
+	pthread_once(&installed, Spy_setFaultHandler);
+}
+
+/* reserves S's address space: the ROM, the stack and its guard, then the
+ * heap.  nothing but the ROM and the bottom of the stack is accessible,
+ * the rest is committed as it's used */
+static void
+Spy_reserveMemory(SpyState* S) {
+	S->memory = mmap(NULL, S->heap_start + S->heap_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (S->memory == MAP_FAILED) {
+		Spy_crash(S, "couldn't reserve memory\n");
+	}
+	S->stack_committed = 0;
+	S->heap_committed = 0;
+	Spy_mapROM(S);
+	S->sp = &S->memory[START_STACK + 2]; /* stack grows upwards */
+	S->bp = &S->memory[START_STACK + 2];
+	S->main.end = S->heap_start - SIZE_GUARD;
+	if (!Spy_commitStack(S, &S->memory[START_STACK + SIZE_COMMIT])) {
+		Spy_crash(S, "couldn't allocate memory\n");
+	}
+}
+
+/* sets how many bytes of stack (the guard not included) and heap S may
+ * use, both are rounded up to SIZE_COMMIT.  S gets a new address space,
+ * so this only works before S first runs or allocates */
+void
+Spy_setLimits(SpyState* S, size_t stack, size_t heap) {
+	if (S->c_bound || S->heap_committed) {
+		Spy_crash(S, "memory limits can only be set before a state runs");
+	}
+	stack = (stack + SIZE_COMMIT - 1) & ~(size_t)(SIZE_COMMIT - 1);
+	heap = (heap + SIZE_COMMIT - 1) & ~(size_t)(SIZE_COMMIT - 1);
+	if (stack < SIZE_COMMIT) stack = SIZE_COMMIT;
+	if (stack > SIZE_MAXSTACK) stack = SIZE_MAXSTACK;
+	if (heap > SIZE_MAXHEAP) heap = SIZE_MAXHEAP;
+	munmap(S->memory, S->heap_start + S->heap_size);
+	S->heap_start = START_STACK + stack + SIZE_GUARD;
+	S->heap_size = heap;
+	Spy_reserveMemory(S);
+}
+
+/* makes print and println write to f through a buffer of 'size' bytes,
+ * at least SIZE_MINOUTPUT.  the buffer goes to f when it's full, when the
+ * program ends and before anything else writes to stdout, and after
+ * every line if f is a terminal.  a size of 0 writes every call through.
+ * what S buffered for the last file goes to it first */
+void
+Spy_setOutput(SpyState* S, FILE* f, size_t size) {
+	const size_t capacity = size < SIZE_MINOUTPUT ? SIZE_MINOUTPUT : size;
+	char* buffer;
+	Spy_flushOutput(S);
+	buffer = (char *)realloc(S->output_buffer, capacity);
+	if (!buffer) Spy_crash(S, "Out of memory\n");
+	S->output = f;
+	S->output_buffer = buffer;
+	S->output_size = capacity;
+	if (!size) {
+		S->output_flush = SPY_FLUSHCALLS;
+	} else {
+		S->output_flush = isatty(fileno(f)) ? SPY_FLUSHLINES : SPY_FLUSHFULL;
+	}
+}
+
+/* appends 'bytes' bytes of text to S's output buffer */
+void
+Spy_write(SpyState* S, const char* text, size_t bytes) {
+	if (S->output_used + bytes > S->output_size) {
+		Spy_flushOutput(S);
+		if (bytes > S->output_size) {
+			fwrite(text, 1, bytes, S->output);
+			return;
+		}
+	}
+	memcpy(&S->output_buffer[S->output_used], text, bytes);
+	S->output_used += bytes;
+}
 
+void
+Spy_flushOutput(SpyState* S) {
+	if (S->output_used) {
+		fwrite(S->output_buffer, 1, S->output_used, S->output);
+		S->output_used = 0;
+	}
+	fflush(S->output);
+}
+
+/* a state to run P in, with its own memory holding a copy of the ROM and
+ * the standard library registered.  more C functions may be registered
+ * with Spy_pushC before the state first runs */
 SpyState*
-Spy_newState(uint32_t option_flags) {
+Spy_newState(SpyProgram* P, uint32_t option_flags) {
 	SpyState* S = (SpyState *)malloc(sizeof(SpyState));
-	S->memory = (uint8_t *)calloc(1, SIZE_MEMORY);
+	if (!S) Spy_crash(NULL, "Out of memory\n");
+	S->program = P;
+	S->output = stdout; /* runtime errors go here from now on */
+	S->output_buffer = NULL;
+	S->output_size = 0;
+	S->output_used = 0;
+	S->output_flush = SPY_FLUSHCALLS;
 	S->ip = NULL; /* to be assigned when code is executed */
-	S->sp = &S->memory[START_STACK - 1]; /* stack grows upwards */
-	S->bp = &S->memory[START_STACK - 1];
+	S->code = NULL;
+	S->start = 0;
+	S->verified = 0;
+	S->budget = SPY_UNLIMITED;
+	S->coroutine = 0;
+	S->coroutine_floor = 0;
+	S->coroutines = 0;
+	memset(&S->main, 0, sizeof(SpyCoroutine));
+	S->main.status = COROUTINE_RUNNING;
+	S->stack_end = NULL;
+	S->io = NULL;
+	S->heap_start = START_STACK + SIZE_STACK;
+	S->heap_size = SIZE_HEAP;
+	Spy_reserveMemory(S);
+	S->jit_threshold = SPY_JITTHRESHOLD;
+	S->jit_entry = NULL;
+	S->jit_counts = NULL;
+	S->jit_depth = 0;
+	S->jit_trampoline = NULL;
+	S->jit_blocks = NULL;
+	S->jit_regions = 0;
+	S->jit_bytes = 0;
+	S->profile = (option_flags & SPY_PROFILE) ? Spy_newProfile(S, P->filename) : NULL;
+	S->callgraph = (option_flags & SPY_CALLGRAPH) ? Spy_newCallGraph(S, P->filename) : NULL;
+	S->sampler = NULL;
+	S->alloc_sites = (option_flags & SPY_ALLOCSITES) ? Spy_newAllocSites(S) : NULL;
+	S->snapshot = NULL;
+	Spy_setOutput(S, stdout, (option_flags & SPY_DEBUG) ? 0 : SIZE_OUTPUT);
 	S->option_flags = option_flags;
 	S->runtime_flags = 0;
 	S->c_functions = NULL;
-	S->memory_chunks = NULL;
+	S->c_buckets = 0;
+	S->c_count = 0;
+	S->c_bound = NULL;
 	SpyL_initializeStandardLibrary(S);
 	return S;
 }
 
+/* everything S allocated, the program stays loaded */
+void
+Spy_freeState(SpyState* S) {
+	Spy_flushOutput(S);
+	free(S->output_buffer);
+	Spy_ioFree(S);
+	Spy_jitFree(S);
+	Spy_profileFree(S);
+	Spy_freeAllocSites(S);
+	Spy_freeSnapshot(S);
+	munmap(S->memory, S->heap_start + S->heap_size);
+	for (size_t i = 0; i < S->c_buckets; i++) {
+		SpyCFunction* at = S->c_functions[i];
+		while (at) {
+			SpyCFunction* next = at->next;
+			free(at);
+			at = next;
+		}
+	}
+	free(S->c_functions);
+	free(S->c_bound);
+	free(S);
+}
+
 void 
 Spy_log(SpyState* S, const char* format, ...) {
 	if (!(S->option_flags | SPY_DEBUG)) return;
@@ -33,13 +314,71 @@ Spy_log(SpyState* S, const char* format, ...) {
 
 void
 Spy_crash(SpyState* S, const char* format, ...) {
-	printf("SPYRE RUNTIME ERROR: ");
+	FILE* out = S ? S->output : stdout;
+	if (S) Spy_flushOutput(S); /* what the program printed comes first */
+	fprintf(out, "SPYRE RUNTIME ERROR: ");
 	va_list list;
 	va_start(list, format);
-	vprintf(format, list);
+	vfprintf(out, format, list);
 	va_end(list);
-	putc('\n', stdout);
-	exit(1);
+	putc('\n', out);
+	/* the instruction that was running, ip is already past its opcode */
+	if (S && S->code && S->ip > S->code) {
+		SpyLocation location;
+		Spy_locate(S, S->ip - 1, &location);
+		if (location.file) {
+			fprintf(out, "\tat %s:%u", location.file, location.line);
+		} else {
+			fprintf(out, "\tat offset %u", location.offset);
+		}
+		if (location.function) {
+			fprintf(out, " in %s", location.function);
+		}
+		putc('\n', out);
+	}
+	Spy_exit(S, 1);
+}
+
+/* ends the program S is running with 'status'.  that ends the process
+ * unless the program runs under Spy_protect */
+void
+Spy_exit(SpyState* S, int status) {
+	if (S) Spy_flushOutput(S);
+	if (spy_exit) {
+		spy_status = status;
+		longjmp(*spy_exit, 1);
+	}
+	exit(status);
+}
+
+/* calls 'body' with 'arg', returning the status Spy_exit or Spy_crash
+ * were called with if they were, 0 otherwise.  nothing that was running
+ * then gets to finish, body has to leave what it needs to clean up where
+ * the caller can find it.  this is how many programs share a process,
+ * see batch.c.  a C function may protect a call back into its state, the
+ * run it was called from keeps its fault context */
+int
+Spy_protect(void (*body)(void*), void* arg) {
+	jmp_buf to;
+	jmp_buf* const outer = spy_exit;
+	SpyState* const running = spy_running;
+	sigjmp_buf fault;
+	int status = 0;
+	memcpy(fault, spy_fault, sizeof(sigjmp_buf));
+	if (setjmp(to)) {
+		status = spy_status;
+		spy_running = running;
+		memcpy(spy_fault, fault, sizeof(sigjmp_buf));
+		if (spy_locked) {
+			pthread_mutex_unlock(&spy_locked->lock);
+			spy_locked = NULL;
+		}
+	} else {
+		spy_exit = &to;
+		body(arg);
+	}
+	spy_exit = outer;
+	return status;
 }
 
 inline void
@@ -48,16 +387,14 @@ Spy_pushInt(SpyState* S, int64_t value) {
 	*(int64_t *)S->sp = value;
 }
 
-inline uint64_t
-Spy_readInt32(SpyState* S) {
-	S->ip += 4;
-	return (uint64_t)(*(uint32_t *)(S->ip - 4));
+inline int64_t
+Spy_readInt(SpyState* S) {
+	return (S->ip++)->i;
 }
 
-inline uint64_t
-Spy_readInt64(SpyState* S) {
-	S->ip += 8;
-	return *(uint64_t *)(S->ip - 8);
+inline const SpyCode*
+Spy_readTarget(SpyState* S) {
+	return (S->ip++)->target;
 }
 
 inline int64_t
@@ -104,8 +441,7 @@ Spy_pushFloat(SpyState* S, double value) {
 
 inline double
 Spy_readFloat(SpyState* S) {
-	S->ip += 8;
-	return *(double *)(S->ip - 8);
+	return (S->ip++)->f;
 }
 
 inline double
@@ -129,7 +465,9 @@ Spy_popString(SpyState* S) {
 
 void
 Spy_dumpStack(SpyState* S) {
-	for (const uint8_t* i = &S->memory[SIZE_ROM] + 2; i <= S->sp + 7; i++) {
+	const uint8_t* bottom = S->coroutine ? &S->memory[S->coroutine + sizeof(SpyCoroutine)] : &S->memory[SIZE_ROM] + 2;
+	Spy_flushOutput(S);
+	for (const uint8_t* i = bottom; i <= S->sp + 7; i++) {
 		printf("0x%08lx: %02x | %c | ", i - S->memory, *i, isprint(*i) ? *i : '.');	
 		if ((&S->memory[SIZE_ROM] - i + 1) % 8 == 0) {
 			fputc('\n', stdout);
@@ -141,520 +479,937 @@ Spy_dumpStack(SpyState* S) {
 	}
 }
 
-void
-Spy_dumpHeap(SpyState* S) {
-	SpyMemoryChunk* at = S->memory_chunks;
-	int index = 0;
-	while (at) {
-		printf("chunk %d:\n\t%zu pages\n\t%lu bytes\n\t", index, at->pages, at->pages * SIZE_PAGE);
-		int filled = 0;
-		for (int i = 0; i < at->pages * SIZE_PAGE; i++) {
-			if (at->absolute_address[i]) {
-				filled++;
-			}
+static uint32_t
+Spy_hashString(const char* str) {
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	while (*str) {
+		hash ^= (uint8_t)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void
+Spy_rehashC(SpyState* S, size_t buckets) {
+	SpyCFunction** table = (SpyCFunction **)calloc(buckets, sizeof(SpyCFunction *));
+	if (!table) Spy_crash(S, "Out of memory\n");
+	for (size_t i = 0; i < S->c_buckets; i++) {
+		SpyCFunction* at = S->c_functions[i];
+		while (at) {
+			SpyCFunction* next = at->next;
+			at->next = table[at->hash & (buckets - 1)];
+			table[at->hash & (buckets - 1)] = at;
+			at = next;
 		}
-		printf("%lu%% non-zero\n\tvm address: 0x%llX\n\t", (100 * filled) / (at->pages * SIZE_PAGE), at->vm_address);
-		printf("absolute address: 0x%lX\n", (uintptr_t)at->absolute_address);
-		at = at->next;
-		index++;
 	}
+	free(S->c_functions);
+	S->c_functions = table;
+	S->c_buckets = buckets;
+}
+
+SpyCFunction*
+Spy_findC(SpyState* S, const char* identifier) {
+	if (!S->c_buckets) return NULL;
+	uint32_t hash = Spy_hashString(identifier);
+	SpyCFunction* at = S->c_functions[hash & (S->c_buckets - 1)];
+	while (at && (at->hash != hash || strcmp(at->identifier, identifier))) at = at->next;
+	return at;
 }
 
+/* registers a C function callable with CCALL.  'results' is the number
+ * of values it pushes after popping its arguments, or SPY_ANYRESULTS if
+ * that isn't fixed, which keeps programs calling it from being verified */
 void
-Spy_pushC(SpyState* S, const char* identifier, uint32_t (*function)(SpyState*)) {
-	SpyCFunction* container = (SpyCFunction *)malloc(sizeof(SpyCFunction));
+Spy_pushC(SpyState* S, const char* identifier, uint32_t (*function)(SpyState*), int32_t results) {
+	/* registering a name twice replaces the old function */
+	SpyCFunction* container = Spy_findC(S, identifier);
+	if (container) {
+		container->function = function;
+		container->results = results;
+		if (container->bound_index >= 0) {
+			S->c_bound[container->bound_index] = function;
+			/* the program was verified with the old result count */
+			if (results != S->program->import_results[container->bound_index]) {
+				S->verified = 0;
+			}
+		}
+		return;
+	}
+	if (S->c_count >= S->c_buckets / 2) {
+		Spy_rehashC(S, S->c_buckets ? S->c_buckets * 2 : SIZE_CBUCKETS);
+	}
+	container = (SpyCFunction *)malloc(sizeof(SpyCFunction));
+	if (!container) Spy_crash(S, "Out of memory\n");
 	container->identifier = identifier;
+	container->hash = Spy_hashString(identifier);
 	container->function = function;
-	container->next = NULL;
-	if (!S->c_functions) {
-		S->c_functions = container;
-	} else {
-		SpyCFunction* at = S->c_functions;
-		while (at->next) at = at->next;
-		at->next = container;
+	container->results = results;
+	container->bound_index = -1;
+	container->next = S->c_functions[container->hash & (S->c_buckets - 1)];
+	S->c_functions[container->hash & (S->c_buckets - 1)] = container;
+	S->c_count++;
+}
+
+/* returns the size in bytes of the instruction at 'at', including operands */
+size_t
+Spy_instructionSize(const SpyProgram* P, const uint8_t* at) {
+	const AssemblerInstruction* ins = &instructions[*at];
+	size_t size = 1;
+	if (!ins->name) {
+		Spy_crash(NULL, "invalid opcode 0x%02X at code offset %zu", *at, (size_t)(at - P->bytecode));
+	}
+	for (int i = 0; i < 4 && ins->operands[i] != NO_OPERAND; i++) {
+		size += ins->operands[i] == _INT32 || ins->operands[i] == _ADDR32 ? 4 : 8;
+	}
+	return size;
+}
+
+/* collects the C functions the code calls.  every CCALL is rewritten in
+ * place into an NCALL whose first operand indexes P->imports, each name
+ * is listed once.  states bind the imports to their own C functions, see
+ * Spy_bindCFunctions */
+static void
+Spy_importCFunctions(SpyProgram* P) {
+	uint8_t* at = P->bytecode;
+	uint8_t* end = P->bytecode + P->bytecode_size;
+	size_t capacity = 0;
+	while (at < end) {
+		size_t size = Spy_instructionSize(P, at);
+		if (at + size > end) {
+			Spy_crash(NULL, "truncated instruction at code offset %zu", (size_t)(at - P->bytecode));
+		}
+		if (*at == 0x43) {
+			Spy_crash(NULL, "NCALL is not valid in a bytecode file (code offset %zu)", (size_t)(at - P->bytecode));
+		} else if (*at == 0x18) { /* CCALL */
+			uint32_t name_index = *(uint32_t *)&at[1];
+			const char* name;
+			size_t i;
+			if (name_index >= P->rom_size || !memchr(&P->rom[name_index], 0, P->rom_size - name_index)) {
+				Spy_crash(NULL, "invalid C function name at code offset %zu", (size_t)(at - P->bytecode));
+			}
+			name = (const char *)&P->rom[name_index];
+			for (i = 0; i < P->nimports && strcmp(P->imports[i], name); i++);
+			if (i == P->nimports) {
+				if (P->nimports == capacity) {
+					capacity = capacity ? capacity * 2 : 16;
+					P->imports = (const char **)realloc(P->imports, capacity * sizeof(char *));
+					if (!P->imports) Spy_crash(NULL, "Out of memory\n");
+				}
+				P->imports[P->nimports++] = name;
+			}
+			at[0] = 0x43; /* NCALL */
+			*(uint32_t *)&at[1] = (uint32_t)i;
+		}
+		at += size;
+	}
+	P->import_results = (int32_t *)calloc(P->nimports ? P->nimports : 1, sizeof(int32_t));
+	if (!P->import_results) Spy_crash(NULL, "Out of memory\n");
+}
+
+/* resolves the program's imports against the C functions registered in
+ * S, NCALL then calls through S->c_bound without looking up names.  all
+ * unknown names are reported before crashing */
+static void
+Spy_bindCFunctions(SpyState* S) {
+	SpyProgram* P = S->program;
+	int unresolved = 0;
+	S->c_bound = calloc(P->nimports ? P->nimports : 1, sizeof(*S->c_bound));
+	if (!S->c_bound) Spy_crash(S, "Out of memory\n");
+	for (size_t i = 0; i < P->nimports; i++) {
+		SpyCFunction* cf = Spy_findC(S, P->imports[i]);
+		if (!cf) {
+			/* report where it's first called */
+			const uint8_t* at = P->bytecode;
+			while (at[0] != 0x43 || *(uint32_t *)&at[1] != i) {
+				at += Spy_instructionSize(P, at);
+			}
+			Spy_flushOutput(S);
+			fprintf(S->output, "undefined C function '%s' (code offset %zu)\n", P->imports[i], (size_t)(at - P->bytecode));
+			unresolved++;
+		} else {
+			cf->bound_index = i;
+			S->c_bound[i] = cf->function;
+		}
+	}
+	if (unresolved) {
+		Spy_crash(S, "%d unresolved C function reference%s", unresolved, unresolved == 1 ? "" : "s");
+	}
+}
+
+/* assigns a cell index to every instruction.  P->code_map maps code byte
+ * offsets to cell indices for jumps computed at run time (CJMP etc.),
+ * offsets that don't start an instruction map to UINT32_MAX */
+static void
+Spy_mapCode(SpyProgram* P) {
+	const uint8_t* end = P->bytecode + P->bytecode_size;
+	size_t cells = 0;
+	P->code_map = (uint32_t *)malloc((P->bytecode_size + 1) * sizeof(uint32_t));
+	if (!P->code_map) Spy_crash(NULL, "Out of memory\n");
+	memset(P->code_map, 0xFF, (P->bytecode_size + 1) * sizeof(uint32_t));
+	for (const uint8_t* at = P->bytecode; at < end; at += Spy_instructionSize(P, at)) {
+		const AssemblerInstruction* ins = &instructions[*at];
+		P->code_map[at - P->bytecode] = cells++;
+		for (int i = 0; i < 4 && ins->operands[i] != NO_OPERAND; i++) {
+			cells++;
+		}
+	}
+	/* jumping to the end of the code halts, just like running off of it */
+	P->code_map[P->bytecode_size] = cells;
+	P->code_size = cells + 1;
+}
+
+/* P's lock guards what the first state to need it builds, a crash
+ * while it's held lets go of it, see Spy_protect */
+static void
+Spy_lockProgram(SpyProgram* P) {
+	pthread_mutex_lock(&P->lock);
+	spy_locked = P;
+}
+
+static void
+Spy_unlockProgram(SpyProgram* P) {
+	spy_locked = NULL;
+	pthread_mutex_unlock(&P->lock);
+}
+
+/* translates the bytecode into an array of cells holding handler
+ * addresses followed by their pre-decoded operands.  JNZ, JZ, JMP and
+ * CALL targets (all _ADDR32 operands) become direct cell pointers.  every
+ * interpreter variant gets its own copy built from its own handlers, the
+ * cells of all copies line up with P->code_map.  the copies are shared by
+ * every state running P and read-only once built.  returns the copy for
+ * 'variant', building it the first time it's asked for */
+static SpyCode*
+Spy_translate(SpyProgram* P, int variant, const void* const* handlers) {
+	const uint8_t* at;
+	const uint8_t* end = P->bytecode + P->bytecode_size;
+	SpyCode* code = __atomic_load_n(&P->codes[variant], __ATOMIC_ACQUIRE);
+	if (code) return code;
+
+	/* states starting side by side build it once */
+	Spy_lockProgram(P);
+	if (P->codes[variant]) {
+		Spy_unlockProgram(P);
+		return P->codes[variant];
+	}
+	code = mmap(NULL, P->code_size * sizeof(SpyCode), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) Spy_crash(NULL, "Out of memory\n");
+
+	SpyCode* out = code;
+	for (at = P->bytecode; at < end;) {
+		const uint8_t opcode = *at;
+		const AssemblerInstruction* ins = &instructions[*at++];
+		(out++)->handler = handlers[opcode];
+		for (int i = 0; i < 4 && ins->operands[i] != NO_OPERAND; i++) {
+			switch (ins->operands[i]) {
+				case _INT32:
+				case _ADDR32:
+					out->i = *(uint32_t *)at;
+					at += 4;
+					break;
+				case _INT64:
+					out->i = *(int64_t *)at;
+					at += 8;
+					break;
+				case _FLOAT64:
+					out->f = *(double *)at;
+					at += 8;
+					break;
+			}
+			if (ins->operands[i] == _ADDR32) {
+				/* Spy_verify made sure the target is an instruction */
+				out->target = &code[P->code_map[out->i]];
+			}
+			out++;
+		}
+	}
+	out->handler = handlers[0x00]; /* NOOP */
+	/* every state runs these cells, none may change them */
+	if (mprotect(code, P->code_size * sizeof(SpyCode), PROT_READ)) {
+		Spy_crash(NULL, "couldn't protect the code\n");
+	}
+	__atomic_store_n(&P->codes[variant], code, __ATOMIC_RELEASE);
+	Spy_unlockProgram(P);
+	return code;
+}
+
+static inline double
+Spy_bitsToFloat(int64_t bits) {
+	union { int64_t i; double f; } u;
+	u.i = bits;
+	return u.f;
+}
+
+static inline int64_t
+Spy_floatToBits(double value) {
+	union { int64_t i; double f; } u;
+	u.f = value;
+	return u.i;
+}
+
+/* the interpreter loops, see execute.h */
+#define SPY_VARIANT Spy_run
+#define SPY_VARIANT_ID 0
+#define SPY_TOS 1
+#define SPY_DEBUGLOOP 0
+#define SPY_CHECKED 1
+#define SPY_PROFILELOOP 0
+#define SPY_CALLGRAPHLOOP 0
+#define SPY_SAMPLELOOP 0
+#include "execute.h"
+#undef SPY_VARIANT
+#undef SPY_VARIANT_ID
+#undef SPY_TOS
+#undef SPY_DEBUGLOOP
+#undef SPY_CHECKED
+#undef SPY_PROFILELOOP
+#undef SPY_CALLGRAPHLOOP
+#undef SPY_SAMPLELOOP
+
+#define SPY_VARIANT Spy_runUnchecked
+#define SPY_VARIANT_ID 3
+#define SPY_TOS 1
+#define SPY_DEBUGLOOP 0
+#define SPY_CHECKED 0
+#define SPY_PROFILELOOP 0
+#define SPY_CALLGRAPHLOOP 0
+#define SPY_SAMPLELOOP 0
+#include "execute.h"
+#undef SPY_VARIANT
+#undef SPY_VARIANT_ID
+#undef SPY_TOS
+#undef SPY_DEBUGLOOP
+#undef SPY_CHECKED
+#undef SPY_PROFILELOOP
+#undef SPY_CALLGRAPHLOOP
+#undef SPY_SAMPLELOOP
+
+#define SPY_VARIANT Spy_runUncached
+#define SPY_VARIANT_ID 1
+#define SPY_TOS 0
+#define SPY_DEBUGLOOP 0
+#define SPY_CHECKED 1
+#define SPY_PROFILELOOP 0
+#define SPY_CALLGRAPHLOOP 0
+#define SPY_SAMPLELOOP 0
+#include "execute.h"
+#undef SPY_VARIANT
+#undef SPY_VARIANT_ID
+#undef SPY_TOS
+#undef SPY_DEBUGLOOP
+#undef SPY_CHECKED
+#undef SPY_PROFILELOOP
+#undef SPY_CALLGRAPHLOOP
+#undef SPY_SAMPLELOOP
+
+#define SPY_VARIANT Spy_runProfile
+#define SPY_VARIANT_ID 4
+#define SPY_TOS 1
+#define SPY_DEBUGLOOP 0
+#define SPY_CHECKED 1
+#define SPY_PROFILELOOP 1
+#define SPY_CALLGRAPHLOOP 0
+#define SPY_SAMPLELOOP 0
+#include "execute.h"
+#undef SPY_VARIANT
+#undef SPY_VARIANT_ID
+#undef SPY_TOS
+#undef SPY_DEBUGLOOP
+#undef SPY_CHECKED
+#undef SPY_PROFILELOOP
+#undef SPY_CALLGRAPHLOOP
+#undef SPY_SAMPLELOOP
+
+#define SPY_VARIANT Spy_runCallGraph
+#define SPY_VARIANT_ID 5
+#define SPY_TOS 1
+#define SPY_DEBUGLOOP 0
+#define SPY_CHECKED 1
+#define SPY_PROFILELOOP 0
+#define SPY_CALLGRAPHLOOP 1
+#define SPY_SAMPLELOOP 0
+#include "execute.h"
+#undef SPY_VARIANT
+#undef SPY_VARIANT_ID
+#undef SPY_TOS
+#undef SPY_DEBUGLOOP
+#undef SPY_CHECKED
+#undef SPY_PROFILELOOP
+#undef SPY_CALLGRAPHLOOP
+#undef SPY_SAMPLELOOP
+
+#define SPY_VARIANT Spy_runSample
+#define SPY_VARIANT_ID 6
+#define SPY_TOS 1
+#define SPY_DEBUGLOOP 0
+#define SPY_CHECKED 1
+#define SPY_PROFILELOOP 0
+#define SPY_CALLGRAPHLOOP 0
+#define SPY_SAMPLELOOP 1
+#include "execute.h"
+#undef SPY_VARIANT
+#undef SPY_VARIANT_ID
+#undef SPY_TOS
+#undef SPY_DEBUGLOOP
+#undef SPY_CHECKED
+#undef SPY_PROFILELOOP
+#undef SPY_CALLGRAPHLOOP
+#undef SPY_SAMPLELOOP
+
+#define SPY_VARIANT Spy_runDebug
+#define SPY_VARIANT_ID 2
+#define SPY_TOS 0
+#define SPY_DEBUGLOOP 1
+#define SPY_CHECKED 1
+#define SPY_PROFILELOOP 0
+#define SPY_CALLGRAPHLOOP 0
+#define SPY_SAMPLELOOP 0
+#include "execute.h"
+#undef SPY_VARIANT
+#undef SPY_VARIANT_ID
+#undef SPY_TOS
+#undef SPY_DEBUGLOOP
+#undef SPY_CHECKED
+#undef SPY_PROFILELOOP
+#undef SPY_CALLGRAPHLOOP
+#undef SPY_SAMPLELOOP
+
+/* reads the sections the assembler appends after the code.  each one
+ * ends with its own start and a magic number, so they're taken off the
+ * end of the file one at a time:
+ *
+ *	symbols		{uint32 offset, name NUL}*  uint32 count  uint32 start  uint32 SPY_SYMBOLMAGIC
+ *	lines		see Assembler_addLine, uint32 start  uint32 SPY_LINEMAGIC
+ *
+ * returns where the code ends.  files without them are fine, their
+ * functions are nameless and their code has no lines */
+static size_t
+Spy_loadSections(SpyProgram* P, const uint8_t* file, size_t flen) {
+	const uint32_t code_start = *(uint32_t *)&file[8];
+	size_t end = flen;
+	while (end >= (size_t)code_start + 8) {
+		uint32_t magic = *(uint32_t *)&file[end - 4];
+		uint32_t start = *(uint32_t *)&file[end - 8];
+		if (magic != SPY_SYMBOLMAGIC && magic != SPY_LINEMAGIC) break;
+		if (start < code_start || (size_t)start + 4 > end - 8) {
+			Spy_crash(NULL, "Malformed section in bytecode file\n");
+		}
+		const uint8_t* section_end = &file[end - 8];
+		if (magic == SPY_SYMBOLMAGIC) {
+			uint32_t count = *(uint32_t *)&file[end - 12];
+			const uint8_t* at = &file[start];
+			section_end -= 4;
+			P->symbols = (SpySymbol *)malloc((count ? count : 1) * sizeof(SpySymbol));
+			if (!P->symbols) Spy_crash(NULL, "Out of memory\n");
+			for (uint32_t i = 0; i < count; i++) {
+				const uint8_t* name = at + 4;
+				const uint8_t* name_end = NULL;
+				if (name < section_end) {
+					name_end = memchr(name, 0, section_end - name);
+				}
+				if (!name_end) Spy_crash(NULL, "Malformed symbol table\n");
+				P->symbols[i].offset = *(uint32_t *)at;
+				P->symbols[i].name = (const char *)name;
+				at = name_end + 1;
+			}
+			P->symbol_count = count;
+		} else {
+			uint32_t count = *(uint32_t *)&file[start];
+			const uint8_t* at = &file[start + 4];
+			P->files = (const char **)malloc((count ? count : 1) * sizeof(char *));
+			if (!P->files) Spy_crash(NULL, "Out of memory\n");
+			for (uint32_t i = 0; i < count; i++) {
+				const uint8_t* name_end = NULL;
+				if (at < section_end) {
+					name_end = memchr(at, 0, section_end - at);
+				}
+				if (!name_end) Spy_crash(NULL, "Malformed line table\n");
+				P->files[i] = (const char *)at;
+				at = name_end + 1;
+			}
+			P->file_count = count;
+			P->lines = at;
+			P->lines_size = section_end - at;
+		}
+		end = start;
+	}
+	return end;
+}
+
+/* name of the function starting at a code offset, NULL if it has none */
+const char*
+Spy_functionName(SpyState* S, uint32_t offset) {
+	size_t low = 0;
+	size_t high = S->program->symbol_count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (S->program->symbols[mid].offset == offset) {
+			return S->program->symbols[mid].name;
+		} else if (S->program->symbols[mid].offset < offset) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return NULL;
+}
+
+/* builds P->cell_offsets.  every cell of an instruction, operands too,
+ * maps to the offset the instruction starts at */
+void
+Spy_mapCells(SpyProgram* P) {
+	if (P->cell_offsets) return;
+	P->cell_offsets = (uint32_t *)malloc(P->code_size * sizeof(uint32_t));
+	if (!P->cell_offsets) Spy_crash(NULL, "Out of memory\n");
+	memset(P->cell_offsets, 0xFF, P->code_size * sizeof(uint32_t));
+	for (size_t i = 0; i <= P->bytecode_size; i++) {
+		if (P->code_map[i] != UINT32_MAX) {
+			P->cell_offsets[P->code_map[i]] = i;
+		}
+	}
+	/* operand cells belong to the instruction before them */
+	for (size_t cell = 1; cell < P->code_size; cell++) {
+		if (P->cell_offsets[cell] == UINT32_MAX) {
+			P->cell_offsets[cell] = P->cell_offsets[cell - 1];
+		}
 	}
 }
 
+static uint32_t
+Spy_readVarint(const uint8_t** at, const uint8_t* end) {
+	uint32_t value = 0;
+	for (int shift = 0; *at < end && shift < 32; shift += 7) {
+		uint8_t byte = *(*at)++;
+		value |= (uint32_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) break;
+	}
+	return value;
+}
+
+/* file, line and function of the instruction at a code offset.  replays
+ * the line table up to the last row at or before the offset */
 void
-Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv) {
+Spy_locateOffset(SpyState* S, uint32_t offset, SpyLocation* location) {
+	const uint8_t* at = S->program->lines;
+	const uint8_t* end = S->program->lines + S->program->lines_size;
+	uint32_t row_offset = 0;
+	uint32_t line = 0;
+	uint32_t file = 0;
+	location->offset = offset;
+	location->file = NULL;
+	location->line = 0;
+	while (at < end) {
+		uint32_t step = Spy_readVarint(&at, end);
+		uint32_t next_file = (step & 1) ? Spy_readVarint(&at, end) : file;
+		uint32_t delta = Spy_readVarint(&at, end);
+		if (row_offset + (step >> 1) > offset) break;
+		row_offset += step >> 1;
+		file = next_file;
+		line += (int32_t)((delta >> 1) ^ -(delta & 1));
+		if (file < S->program->file_count) {
+			location->file = S->program->files[file];
+			location->line = line;
+		}
+	}
 
-	SpyState S;
+	/* the function is the last one starting at or before the offset */
+	location->function = NULL;
+	size_t low = 0;
+	size_t high = S->program->symbol_count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (S->program->symbols[mid].offset <= offset) {
+			location->function = S->program->symbols[mid].name;
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+}
+
+/* file, line and function of the instruction 'ip' is in */
+void
+Spy_locate(SpyState* S, const SpyCode* ip, SpyLocation* location) {
+	Spy_locateOffset(S, S->program->cell_offsets[ip - S->code], location);
+}
 
-	S.memory = (uint8_t *)calloc(1, SIZE_MEMORY);
-	if (!S.memory) {
-		Spy_crash(&S, "couldn't allocate memory\n");
+/* copies the ROM into a sealed memory file once, Spy_mapROM maps the same
+ * pages into every state.  without memfd_create P->rom_fd stays -1 */
+static void
+Spy_shareROM(SpyProgram* P) {
+	const size_t page = sysconf(_SC_PAGESIZE);
+	P->rom_fd = -1;
+	P->rom_mapped = (P->rom_size + page - 1) & ~(page - 1);
+	if (!P->rom_mapped) return;
+#ifdef MFD_ALLOW_SEALING
+	int fd = memfd_create("spyre-rom", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) return;
+	if (ftruncate(fd, P->rom_mapped) || pwrite(fd, P->rom, P->rom_size, 0) != (ssize_t)P->rom_size ||
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+		close(fd);
+		return;
 	}
-	S.ip = NULL; /* to be assigned when code is executed */
-	S.sp = &S.memory[START_STACK + 2]; /* stack grows upwards */
-	S.bp = &S.memory[START_STACK + 2];
-	S.option_flags = option_flags;
-	S.runtime_flags = 0;
-	S.c_functions = NULL;
-	S.memory_chunks = NULL;
-	SpyL_initializeStandardLibrary(&S);
+	P->rom_fd = fd;
+#endif
+}
 
-	FILE* f;
-	unsigned long long flen;
+/* maps a .spyb into a program any number of states can run.  the file
+ * is mapped privately and read in place: the ROM and the sections after
+ * the code are used where they are, the code is checked for valid
+ * instructions, its C function calls are collected (the only bytes ever
+ * written, copying just the pages they're on) and its cells are numbered.
+ * the mapping is read-only from then on */
+SpyProgram*
+Spy_load(const char* filename) {
+	SpyProgram* P = (SpyProgram *)calloc(1, sizeof(SpyProgram));
+	struct stat st;
 	uint32_t code_start;
-	f = fopen(filename, "rb");
-	if (!f) Spy_crash(&S, "Couldn't open input file '%s'", filename);
-	fseek(f, 0, SEEK_END);
-	flen = ftell(f);
-	fseek(f, 0, SEEK_SET);
-	S.bytecode = (uint8_t *)malloc(flen + 1);
-	fread(S.bytecode, 1, flen, f);
-	S.bytecode[flen] = 0;
-	fclose(f);
-	
-	for (int i = 12; i < *(uint32_t *)&S.bytecode[8]; i++) {
-		S.memory[i - 12] = S.bytecode[i];
-	}
-
-	/* prepare instruction pointer, point it to code */	
-	S.bytecode = &S.bytecode[*(uint32_t *)&S.bytecode[8]];
-	S.ip = S.bytecode;
-
-	/* push command line arguments */
-	for (int i = argc - 1; i >= 0; i--) {
-		Spy_pushInt(&S, strlen(argv[i]));
-		SpyL_malloc(&S);
-		/* allocated space for the string, now find tail of malloc blocks */
-		SpyMemoryChunk* chunk = S.memory_chunks;
-		while (chunk->next) chunk = chunk->next;
-		strcpy((char *)chunk->absolute_address, argv[i]);
-	}
-
-	/* push ng */
-	Spy_pushInt(&S, argc);
-
-	/* push junk for ng, ip, and bp onto the stack to maintain alignment for arg instruction */
-	Spy_pushInt(&S, 0x7369DB6469766164);
-	Spy_pushInt(&S, 0xDB6C6F6F63DB61DB);
-	Spy_pushInt(&S, 0x212121212164696B);
-	/* assign BP to SP to simulate a function call */
-	S.bp = S.sp;
-
-	/* general purpose vars for interpretation */
-	int64_t a, c;
-	double b, d;
-	uint8_t *pa, *pb;
-
-	/* IP saver */
-	uint8_t ipsave = 0;
-
-	/* pointers to labels, (direct threading, significantly faster than switch/case) */
-	static const void* opcodes[] = {
-		&&noop, &&ipush, &&iadd, &&isub,
-		&&imul, &&idiv, &&mod, &&shl, 
-		&&shr, &&and, &&or, &&xor, &&not,
-		&&neg, &&igt, &&ige, &&ilt,
-		&&ile, &&icmp, &&jnz, &&jz,
-		&&jmp, &&call, &&iret, &&ccall,
-		&&fpush, &&fadd, &&fsub, &&fmul,
-		&&fdiv, &&fgt, &&fge, &&flt, 
-		&&fle, &&fcmp, &&fret, &&ilload,
-		&&ilsave, &&iarg, &&iload, &&isave,
-		&&res, &&lea, &&ider, &&icinc, &&cder,
-		&&lor, &&land, &&padd, &&psub, &&log,
-		&&vret, &&dbon, &&dboff, &&dbds, &&cjnz,
-		&&cjz, &&cjmp, &&ilnsave, &&ilnload,
-		&&flload, &&flsave, &&ftoi, &&itof,
-		&&fder, &&fsave, &&lnot
-	};
-
-	int total = 0;
-
-	/* main interpreter loop */
-	dispatch:
-	total++;
-	if (S.sp >= &S.memory[START_HEAP]) {
-		Spy_crash(&S, "stack overflow");
-	}
-	if (option_flags & SPY_STEP && option_flags & SPY_DEBUG) {
-		for (int i = 0; i < 100; i++) {
-			fputc('\n', stdout);
+	int fd;
+	if (!P) Spy_crash(NULL, "Out of memory\n");
+	P->filename = strdup(filename);
+	pthread_mutex_init(&P->lock, NULL);
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) Spy_crash(NULL, "Couldn't open input file '%s'", filename);
+	if (fstat(fd, &st) < 0 || st.st_size < 12) {
+		Spy_crash(NULL, "Couldn't read bytecode file '%s'", filename);
+	}
+	P->file = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (P->file == MAP_FAILED) {
+		Spy_crash(NULL, "Couldn't read bytecode file '%s'", filename);
+	}
+	P->file_size = st.st_size;
+	code_start = *(uint32_t *)&P->file[8];
+	if (*(uint32_t *)P->file != SPY_MAGIC || code_start < 12 || code_start > P->file_size) {
+		Spy_crash(NULL, "'%s' is not a bytecode file", filename);
+	}
+	if (code_start - 12 > SIZE_ROM) {
+		Spy_crash(NULL, "The ROM of '%s' is larger than %d bytes", filename, SIZE_ROM);
+	}
+	P->rom = &P->file[12];
+	P->rom_size = code_start - 12;
+	P->bytecode = &P->file[code_start];
+	P->bytecode_size = Spy_loadSections(P, P->file, P->file_size) - code_start;
+	Spy_shareROM(P);
+	P->stack_bound = SPY_UNBOUNDED;
+	Spy_importCFunctions(P);
+	mprotect(P->file, P->file_size, PROT_READ);
+	Spy_mapCode(P);
+	Spy_mapCells(P);
+	return P;
+}
+
+/* no state may be running P anymore */
+void
+Spy_freeProgram(SpyProgram* P) {
+	for (int i = 0; i < SPY_VARIANTS; i++) {
+		if (P->codes[i]) {
+			munmap(P->codes[i], P->code_size * sizeof(SpyCode));
 		}
-		Spy_dumpStack(&S);
-		printf("\nexecuted %s\n", instructions[ipsave].name);
-		getchar();
-	}
-	ipsave = *S.ip;
-	goto *opcodes[*S.ip++];
-
-	noop:
-	goto done;
-	
-	ipush:
-	Spy_pushInt(&S, Spy_readInt64(&S));
-	goto dispatch;
-
-	iadd:
-	Spy_pushInt(&S, Spy_popInt(&S) + Spy_popInt(&S));
-	goto dispatch;
-
-	isub:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) - a);
-	goto dispatch;
-
-	imul:
-	Spy_pushInt(&S, Spy_popInt(&S) * Spy_popInt(&S));
-	goto dispatch;
-
-	idiv:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) / a);
-	goto dispatch;
-
-	mod:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) % a);
-	goto dispatch;
-
-	shl:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) << a);
-	goto dispatch;
-	
-	shr:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) >> a);
-	goto dispatch;
-
-	and:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) & a);
-	goto dispatch;
-
-	or:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) | a);
-	goto dispatch;
-
-	xor:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) ^ a);
-	goto dispatch;
-
-	not:
-	Spy_pushInt(&S, ~Spy_popInt(&S));
-	goto dispatch;
-
-	neg:
-	Spy_pushInt(&S, -Spy_popInt(&S));
-	goto dispatch;
-
-	igt:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) > a);
-	goto dispatch;
-
-	ige:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) >= a);
-	goto dispatch;
-
-	ilt:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) < a);
-	goto dispatch;
-
-	ile:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) <= a);
-	goto dispatch;
-
-	icmp:
-	Spy_pushInt(&S, Spy_popInt(&S) == Spy_popInt(&S));
-	goto dispatch;
-
-	jnz:
-	a = Spy_readInt32(&S);
-	if (Spy_popInt(&S)) {
-		S.ip = (uint8_t *)&S.bytecode[a];
-	}
-	goto dispatch;
-
-	jz:
-	a = Spy_readInt32(&S);
-	if (!Spy_popInt(&S)) {
-		S.ip = (uint8_t *)&S.bytecode[a];
-	}
-	goto dispatch;
-
-	jmp:
-	S.ip = (uint8_t *)&S.bytecode[Spy_readInt32(&S)];
-	goto dispatch;
-
-	call:
-	{
-		a = Spy_readInt32(&S);
-		uint32_t num_args = Spy_readInt32(&S);
-		int64_t* pops = malloc(num_args * 8);
-		/* flip the arguments */
-		for (int i = 0; i < num_args; i++) {
-			pops[i] = *(int64_t *)Spy_popRaw(&S);
-		}
-		for (int i = 0; i < num_args; i++) {
-			Spy_pushInt(&S, pops[i]);
-		}
-		free(pops);
-		Spy_pushInt(&S, num_args); /* push number of arguments */
-		Spy_pushPointer(&S, (void *)S.bp); /* push base pointer */
-		Spy_pushPointer(&S, (void *)S.ip); /* push return address */
-		S.bp = S.sp;
-		S.ip = (uint8_t *)&S.bytecode[a];
-	}
-	goto dispatch;
-
-	iret:
-	a = Spy_popInt(&S); /* return value */
-	S.sp = S.bp;
-	S.ip = (uint8_t *)Spy_popPointer(&S);	
-	S.bp = (uint8_t *)Spy_popPointer(&S);
-	S.sp -= Spy_popInt(&S) * 8;
-	Spy_pushInt(&S, a);
-	goto dispatch;	
-
-	ccall:
-	{
-		uint32_t name_index = Spy_readInt32(&S);
-		uint32_t num_args = Spy_readInt32(&S);
-		int64_t* pops = malloc(num_args * 8);
-		/* flip the arguments */
-		for (int i = 0; i < num_args; i++) {
-			pops[i] = *(int64_t *)Spy_popRaw(&S);
-		}
-		for (int i = 0; i < num_args; i++) {
-			Spy_pushInt(&S, pops[i]);
-		}
-		free(pops);
-		SpyCFunction* cf = S.c_functions;
-		while (cf && strcmp(cf->identifier, (const char *)&S.memory[name_index])) cf = cf->next;
-		if (!cf) {
-			printf("%d\n", name_index);
-			Spy_crash(&S, "Attempt to call undefined C function '%s'\n", &S.memory[name_index]);
-		}
-		cf->function(&S);
-	}
-	goto dispatch;
-		
-	fpush:
-	Spy_pushFloat(&S, Spy_readFloat(&S));
-	goto dispatch;
-
-	fadd:
-	Spy_pushFloat(&S, Spy_popFloat(&S) + Spy_popFloat(&S));
-	goto dispatch;
-
-	fsub:
-	b = Spy_popFloat(&S);
-	Spy_pushFloat(&S, Spy_popFloat(&S) - b);
-	goto dispatch;
-
-	fmul:
-	Spy_pushFloat(&S, Spy_popFloat(&S) * Spy_popFloat(&S));
-	goto dispatch;
-
-	fdiv:
-	b = Spy_popFloat(&S);
-	Spy_pushFloat(&S, Spy_popFloat(&S) / b);
-	goto dispatch;
-
-	fgt:
-	b = Spy_popFloat(&S);
-	Spy_pushFloat(&S, Spy_popFloat(&S) > b);
-	goto dispatch;
-
-	fge:
-	b = Spy_popFloat(&S);
-	Spy_pushFloat(&S, Spy_popFloat(&S) >= b);
-	goto dispatch;
-
-	flt:
-	b = Spy_popFloat(&S);
-	Spy_pushFloat(&S, Spy_popFloat(&S) < b);
-	goto dispatch;
-
-	fle:
-	b = Spy_popFloat(&S);
-	Spy_pushFloat(&S, Spy_popFloat(&S) <= b);
-	goto dispatch;
-
-	fcmp:
-	Spy_pushInt(&S, Spy_popFloat(&S) == Spy_popFloat(&S));
-	goto dispatch;
-
-	fret:
-	b = Spy_popFloat(&S); /* return value */
-	S.sp = S.bp;
-	S.ip = (uint8_t *)Spy_popPointer(&S);	
-	S.bp = (uint8_t *)Spy_popPointer(&S);
-	S.sp -= Spy_popInt(&S);
-	Spy_pushFloat(&S, a);
-	goto dispatch;	
-
-	ilload:
-	Spy_pushInt(&S, *(int64_t *)&S.bp[Spy_readInt32(&S)*8 + 8]);
-	goto dispatch;
-
-	ilsave:
-	Spy_saveInt(&S, &S.bp[Spy_readInt32(&S)*8 + 8], Spy_popInt(&S));
-	goto dispatch;
-
-	iarg:
-	Spy_pushInt(&S, *(int64_t *)&S.bp[-3*8 - Spy_readInt32(&S)*8]);
-	goto dispatch;
-
-	iload:
-	Spy_pushInt(&S, *(int64_t *)&S.memory[(uint64_t)Spy_popInt(&S)]);
-	goto dispatch;
-
-	isave:
-	a = Spy_popInt(&S); /* pop value */
-	Spy_saveInt(&S, &S.memory[Spy_popInt(&S)], a);
-	goto dispatch;
-
-	res:
-	S.sp += Spy_readInt32(&S) * 8;
-	goto dispatch;
-
-	lea:
-	Spy_pushPointer(&S, (void *)(&S.bp[Spy_readInt32(&S)*8 + 8] - S.memory));
-	goto dispatch;
-
-	ider:
-	Spy_pushInt(&S, *(uint64_t *)&S.memory[Spy_popInt(&S)]);
-	goto dispatch;
-
-	icinc:
-	Spy_pushInt(&S, Spy_popInt(&S) + Spy_readInt64(&S));
-	goto dispatch;
-
-	cder:
-	Spy_pushInt(&S, *(uint8_t *)&S.memory[Spy_popInt(&S)]);
-	goto dispatch;
-	
-	lor:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) || a);
-	goto dispatch;
-
-	land:
-	a = Spy_popInt(&S);
-	Spy_pushInt(&S, Spy_popInt(&S) && a);
-	goto dispatch;
-
-	padd:
-	a = Spy_popInt(&S) * 8;
-	Spy_pushInt(&S, Spy_popInt(&S) + a);
-	goto dispatch;
-
-	psub:
-	a = Spy_popInt(&S) * 8;
-	Spy_pushInt(&S, Spy_popInt(&S) - a);
-	goto dispatch;
-
-	log:
-	printf("%llu\n", Spy_readInt32(&S));
-	goto dispatch;
-
-	vret:
-	S.sp = S.bp;
-	S.ip = (uint8_t *)Spy_popPointer(&S);	
-	S.bp = (uint8_t *)Spy_popPointer(&S);
-	S.sp -= Spy_popInt(&S) * 8;
-	goto dispatch;
-
-	dbon:
-	option_flags |= (SPY_DEBUG | SPY_STEP);
-	goto dispatch;
-
-	dboff:
-	option_flags &= ~SPY_DEBUG;
-	option_flags &= ~SPY_STEP;
-	goto dispatch;
-
-	dbds:
-	Spy_dumpStack(&S);
-	goto dispatch;
-
-	cjnz:
-	a = Spy_popInt(&S); /* location */
-	c = Spy_popInt(&S); /* condition */
-	if (c) {
-		S.ip = (uint8_t *)&S.bytecode[a];
-	}
-	goto dispatch;
-
-	cjz:
-	a = Spy_popInt(&S); /* location */
-	c = Spy_popInt(&S); /* condition */
-	if (!c) {
-		S.ip = (uint8_t *)&S.bytecode[a];
-	}
-	goto dispatch;
-
-	cjmp:
-	S.ip = (uint8_t *)&S.bytecode[Spy_popInt(&S)];
-	goto dispatch;
-
-	ilnsave:
-	{
-		uint32_t addr = Spy_readInt32(&S);
-		uint32_t numsave = Spy_readInt32(&S);
-		uint64_t* pops = (uint64_t *)malloc(numsave * 8);
-		for (int i = numsave - 1; i >= 0; i--) {
-			pops[i] = Spy_popInt(&S);
-		}
-		memcpy(&S.bp[addr*8 + 8], pops, numsave * 8);
-		free(pops);
-	}
-	goto dispatch;
-
-	ilnload:
-	goto dispatch;
-
-	flload:
-	Spy_pushFloat(&S, *(double *)&S.bp[Spy_readInt32(&S)*8 + 8]);
-	goto dispatch;
-
-	flsave:
-	Spy_saveFloat(&S, &S.bp[Spy_readInt32(&S)*8 + 8], Spy_popFloat(&S));
-	goto dispatch;
-
-	/* ***NOTE*** THIS ADDRESSES OFF THE TOP OF THE STACK */
-	ftoi:
-	a = Spy_readInt32(&S);
-	Spy_saveInt(&S, &S.sp[-a*8], (int64_t)(*(double *)&S.sp[-a*8]));
-	goto dispatch;
-	
-	/* ***NOTE*** THIS ADDRESSES OFF THE TOP OF THE STACK */
-	itof:
-	a = Spy_readInt32(&S);
-	Spy_saveFloat(&S, &S.sp[-a*8], (double)(*(int64_t *)&S.sp[-a*8]));
-	goto dispatch;
-
-	fder:
-	Spy_pushFloat(&S, *(double *)&S.memory[Spy_popInt(&S)]);
-	goto dispatch;
-
-	fsave:
-	b = Spy_popFloat(&S); /* pop value */
-	Spy_saveFloat(&S, &S.memory[Spy_popInt(&S)], b);
-	goto dispatch;
+	}
+	if (P->rom_fd >= 0) {
+		close(P->rom_fd);
+	}
+	free(P->code_map);
+	free(P->cell_offsets);
+	free(P->imports);
+	free(P->import_results);
+	free(P->functions);
+	free(P->symbols);
+	free(P->files);
+	munmap(P->file, P->file_size);
+	pthread_mutex_destroy(&P->lock);
+	free(P->filename);
+	free(P);
+}
 
-	lnot:
-	Spy_pushInt(&S, !Spy_popInt(&S));
-	goto dispatch;
+/* binds the C functions the first time S runs and verifies the program
+ * the first time any state runs it.  S may skip checks if the program
+ * passed, S's C functions push as many results as the ones it was
+ * verified with and its stack passes Spy_verifyStack.  returns why the
+ * program or S's stack didn't pass if the program was just verified,
+ * NULL otherwise */
+static const char*
+Spy_prepare(SpyState* S, uint32_t entry_args) {
+	SpyProgram* P = S->program;
+	const char* unverified = NULL;
+	int verifying;
+	if (S->c_bound) return NULL;
+	Spy_bindCFunctions(S);
+	Spy_lockProgram(P);
+	verifying = !P->checked;
+	if (verifying) {
+		unverified = Spy_verify(S, entry_args);
+	}
+	Spy_unlockProgram(P);
+	S->verified = P->verified;
+	for (size_t i = 0; i < P->nimports; i++) {
+		if (Spy_findC(S, P->imports[i])->results != P->import_results[i]) {
+			S->verified = 0;
+		}
+	}
+	if (S->verified) {
+		const char* stack = Spy_verifyStack(S, entry_args);
+		if (stack) {
+			S->verified = 0;
+			if (verifying) unverified = stack;
+		}
+	}
+	return unverified;
+}
+
+/* runs S until it halts or yields, moving between the release and the
+ * debug loop whenever debugging is switched on or off.  the loop without
+ * checks is only used if 'unchecked' is set.  returns SPY_HALT or
+ * SPY_YIELD.  a C function may call back into S through
+ * Spy_callFunction, the outer run gets its fault context back after */
+static int
+Spy_interpret(SpyState* S, int unchecked) {
+	SpyState* const outer = spy_running;
+	sigjmp_buf outer_fault;
+	int status;
+	memcpy(outer_fault, spy_fault, sizeof(sigjmp_buf));
+	Spy_installFaultHandler();
+	spy_running = S;
+	int fault = sigsetjmp(spy_fault, 1);
+	if (fault) {
+		/* S->ip is from the last time the loop synced, not where it faulted */
+		S->ip = NULL;
+		if (fault == SPY_ROMWRITE) {
+			Spy_crash(S, "write to the read-only ROM");
+		}
+		if (fault == SPY_UNMAPPED) {
+			Spy_crash(S, "access to unallocated memory at 0x%llx", (unsigned long long)spy_fault_address);
+		}
+		Spy_crash(S, "stack overflow (run with -d to see where)");
+	}
+	do {
+		if (S->option_flags & SPY_DEBUG) {
+			status = Spy_runDebug(S);
+		} else if (S->profile) {
+			status = Spy_runProfile(S);
+		} else if (S->callgraph) {
+			status = Spy_runCallGraph(S);
+		} else if (S->sampler) {
+			status = Spy_runSample(S);
+		} else if (S->option_flags & SPY_NOCACHE) {
+			status = Spy_runUncached(S);
+		} else if (unchecked) {
+			status = Spy_runUnchecked(S);
+		} else {
+			status = Spy_run(S);
+		}
+	} while (status == SPY_SWITCH);
+	spy_running = outer;
+	memcpy(spy_fault, outer_fault, sizeof(sigjmp_buf));
+	return status;
+}
+
+/* calls the function the symbol table names 'name' and runs S until it
+ * returns.  'types' has a character per argument following it, 'i' for
+ * an int64_t and 'f' for a double.  returns the number of results the
+ * function left on the stack (0 or 1), they're popped with Spy_popInt or
+ * Spy_popFloat.  if the program halts inside the function (NOOP, exit)
+ * the stack is put back as it was and 0 is returned.  functions that no
+ * CALL in the program reaches weren't verified and always run with checks */
+uint32_t
+Spy_callFunction(SpyState* S, const char* name, const char* types, ...) {
+	SpyProgram* P = S->program;
+	const SpySymbol* symbol = NULL;
+	const SpyFunction* function = NULL;
+	const size_t nargs = strlen(types);
+	uint8_t* const sp = S->sp;
+	uint8_t* const bp = S->bp;
+	const SpyCode* const ip = S->ip; /* a C function calling back, NCALL reloads it */
+	const uint32_t start = S->start;
+	const uint64_t outer_floor = S->coroutine_floor;
+	int64_t budget;
+	va_list list;
+
+	for (size_t i = 0; i < P->symbol_count && !symbol; i++) {
+		if (!strcmp(P->symbols[i].name, name)) {
+			symbol = &P->symbols[i];
+		}
+	}
+	if (!symbol || symbol->offset >= P->bytecode_size || P->code_map[symbol->offset] == UINT32_MAX) {
+		Spy_crash(S, "no function named '%s'", name);
+	}
+	Spy_prepare(S, 0);
+	if (sp + (nargs + 3) * 8 >= &S->memory[Spy_context(S, S->coroutine)->end]) {
+		Spy_crash(S, "stack overflow calling '%s'", name);
+	}
+	/* a coroutine's stack is heap memory, accessible already */
+	if (!S->coroutine && !Spy_commitStack(S, sp + (nargs + 4) * 8)) {
+		Spy_crash(S, "couldn't allocate memory\n");
+	}
+
+	/* arguments go in callee order, the first one on top */
+	va_start(list, types);
+	for (size_t i = 0; i < nargs; i++) {
+		uint8_t* slot = sp + (nargs - i) * 8;
+		switch (types[i]) {
+			case 'i': *(int64_t *)slot = va_arg(list, int64_t); break;
+			case 'f': *(double *)slot = va_arg(list, double); break;
+			default:
+				va_end(list);
+				Spy_crash(S, "invalid argument type '%c' calling '%s'", types[i], name);
+		}
+	}
+	va_end(list);
+	S->sp = sp + nargs * 8;
+
+	/* a frame like CALL's, returning to the NOOP past the end of the code */
+	Spy_pushInt(S, nargs);
+	Spy_pushPointer(S, bp);
+	Spy_pushInt(S, P->code_size - 1);
+	S->bp = S->sp;
+	S->ip = NULL;
+	S->start = P->code_map[symbol->offset];
+
+	for (size_t low = 0, high = P->function_count; low < high;) {
+		size_t mid = (low + high) / 2;
+		if (P->functions[mid].entry == symbol->offset) {
+			function = &P->functions[mid];
+			break;
+		} else if (P->functions[mid].entry < symbol->offset) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	/* the function may use coroutines, but the one it runs on can't yield
+	 * past this C frame */
+	S->coroutine_floor = S->coroutine;
+	budget = __atomic_exchange_n(&S->budget, SPY_UNLIMITED, __ATOMIC_RELAXED);
+	while (Spy_interpret(S, S->verified && function && nargs >= function->nargs) == SPY_YIELD) {
+		/* preempted, functions always run to the end */
+		__atomic_store_n(&S->budget, SPY_UNLIMITED, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&S->budget, budget, __ATOMIC_RELAXED);
+
+	if (S->ip != &S->code[P->code_size]) {
+		/* it halted, maybe on another coroutine's stack */
+		S->sp = sp;
+		S->bp = bp;
+		S->coroutine = S->coroutine_floor;
+		S->coroutine_floor = outer_floor;
+		S->ip = ip;
+		S->start = start;
+		return 0;
+	}
+	S->coroutine_floor = outer_floor;
+	S->ip = ip;
+	S->start = start;
+	return (S->sp - sp) / 8;
+}
 
-	done:
-	if (option_flags & SPY_DEBUG) {
-		printf("\nSpyre process terminated\n");
-		printf("%d instructions were executed\n", total);
+/* sets S up to run its program from the top with the command line
+ * arguments, or from its snapshot.  nothing runs until Spy_resume.  S
+ * may not have run yet */
+void
+Spy_startProgram(SpyState* S, int argc, char** argv) {
+	SpyProgram* P = S->program;
+
+	/* resolve C function names and check the code before anything runs */
+	const char* unverified = Spy_prepare(S, argc + 1);
+	if (S->option_flags & SPY_DEBUG) {
+		if (unverified) {
+			printf("bytecode not verified, running with checks: %s\n", unverified);
+		} else if (P->stack_bound == SPY_UNBOUNDED) {
+			printf("bytecode verified, recursive\n");
+		} else {
+			printf("bytecode verified, uses at most %llu bytes of stack\n", (unsigned long long)P->stack_bound);
+		}
 	}
 
-	return;
+	/* a snapshot has the arguments on its stack already */
+	if (!Spy_restoreSnapshot(S)) {
+		/* push command line arguments */
+		for (int i = argc - 1; i >= 0; i--) {
+			uint64_t string = Spy_heapAlloc(S, strlen(argv[i]) + 1);
+			if (!string) Spy_crash(S, "Out of memory\n");
+			strcpy((char *)&S->memory[string], argv[i]);
+			Spy_pushInt(S, string);
+		}
+
+		/* push ng */
+		Spy_pushInt(S, argc);
+
+		/* push junk for ng, ip, and bp onto the stack to maintain alignment for arg instruction */
+		Spy_pushInt(S, 0x7369DB6469766164);
+		Spy_pushInt(S, 0xDB6C6F6F63DB61DB);
+		Spy_pushInt(S, 0x212121212164696B);
+		/* assign BP to SP to simulate a function call */
+		S->bp = S->sp;
+	}
+}
+
+/* runs S from where it stopped for about 'budget' more instructions.
+ * returns 1 once the program has halted, 0 if it yielded first and can
+ * be resumed later, from this thread or any other.  instructions are
+ * only counted at safe points (calls and backward jumps, a loop's body
+ * at a time) so a run stops at the first of those past its budget.  a
+ * halted program isn't resumed again */
+int
+Spy_resume(SpyState* S, int64_t budget) {
+	__atomic_store_n(&S->budget, budget, __ATOMIC_RELAXED);
+	return Spy_interpret(S, S->verified) == SPY_HALT;
+}
+
+/* makes S's run yield at its next safe point, as if its budget were
+ * spent.  for time slices, any thread may call it while S runs.  the
+ * safe point's own update of the budget may overwrite this one, a
+ * caller that must be sure calls it again while S still runs, see
+ * sched.c */
+void
+Spy_preempt(SpyState* S) {
+	__atomic_store_n(&S->budget, 0, __ATOMIC_RELAXED);
+}
 
+/* runs S's program from the top with the command line arguments to the
+ * end, then prints the reports S was created to collect.  S may not have
+ * run yet */
+void
+Spy_runProgram(SpyState* S, int argc, char** argv) {
+	Spy_startProgram(S, argc, argv);
+	while (!Spy_resume(S, SPY_UNLIMITED)) {
+		/* preempted from another thread, carry on */
+	}
+	if (S->profile) {
+		Spy_profileReport(S);
+	}
+	if (S->callgraph) {
+		Spy_callGraphReport(S);
+	}
+	if (S->sampler) {
+		Spy_samplerReport(S);
+	}
+	if (S->option_flags & (SPY_HEAPSTATS | SPY_ALLOCSITES)) {
+		Spy_heapReport(S);
+	}
 }
 
+/* loads and runs one program, returns its exit status.  the program may
+ * end the process with exit() or a crash before this returns */
+int
+Spy_execute(const char* filename, uint32_t option_flags, uint32_t jit_threshold, uint32_t sample_rate,
+			size_t stack_limit, size_t heap_limit, size_t output_size, int argc, char** argv) {
+
+	SpyProgram* P = Spy_load(filename);
+	SpyState* S = Spy_newState(P, option_flags);
+	if (stack_limit || heap_limit) {
+		Spy_setLimits(S, stack_limit ? stack_limit : SIZE_STACK - SIZE_GUARD, heap_limit ? heap_limit : SIZE_HEAP);
+	}
+	S->jit_threshold = jit_threshold;
+	if (!(option_flags & SPY_DEBUG)) {
+		Spy_setOutput(S, stdout, output_size);
+	}
+	S->sampler = sample_rate ? Spy_newSampler(S, filename, sample_rate) : NULL;
+	S->snapshot = (option_flags & SPY_SNAPSHOT) ? Spy_newSnapshot(S, filename, argc, argv) : NULL;
+	Spy_runProgram(S, argc, argv);
+	Spy_freeState(S);
+	Spy_freeProgram(P);
+	return 0;
+
+}
@@ -3,61 +3,241 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
 
 /* option flags */
 #define SPY_NOFLAG	0x00
 #define SPY_DEBUG	0x01
 #define SPY_STEP	0x02
+#define SPY_NOCACHE	0x04 /* don't keep the top of the stack in a register */
+#define SPY_PROFILE	0x08 /* count and time every opcode, see profile.c */
+#define SPY_CALLGRAPH	0x10 /* time every function call, see profile.c */
+#define SPY_HEAPSTATS	0x20 /* report heap statistics at exit, see Spy_heapReport */
+#define SPY_ALLOCSITES	0x40 /* also record where every heap block was allocated */
+#define SPY_SNAPSHOT	0x80 /* start from the snapshot snapshot() wrote, see snapshot.c */
 
 /* runtime flags */
 #define SPY_CMPRESULT 0x01
 
+/* SpyState.output_flush, when print and println flush the output buffer
+ * besides when it's full */
+#define SPY_FLUSHFULL	0
+#define SPY_FLUSHLINES	1 /* after a line, the output is a terminal */
+#define SPY_FLUSHCALLS	2 /* after every call, see Spy_setOutput */
+
 /* constants */
-#define SIZE_MEMORY 0x500000
-#define SIZE_STACK	0x100000
 #define SIZE_ROM	0x100000
-#define SIZE_PAGE	8
+#define SIZE_STACK	0x100000 /* default stack, guard included, see Spy_setLimits */
+#define SIZE_HEAP	0x40000000 /* default most heap */
+#define SIZE_MAXSTACK	0x40000000
+#define SIZE_MAXHEAP	((size_t)1 << 40) /* block sizes share their header with an allocation site, see heap.h */
+#define SIZE_GUARD	0x10000 /* inaccessible bytes at the top of the stack */
+#define SIZE_COMMIT	0x10000 /* reserved memory is made accessible in steps this large */
+#define SPY_ANYRESULTS -1 /* see Spy_pushC */
+#define SPY_JITTHRESHOLD 1000 /* default for SpyState.jit_threshold */
+#define SIZE_CBUCKETS 64 /* initial C function hash buckets, must be a power of two */
+#define SIZE_OUTPUT	0x10000 /* default output buffer, see Spy_setOutput */
+#define SIZE_MINOUTPUT	0x400 /* smallest output buffer, print needs room for any number */
 
 #define START_ROM	0
 #define START_STACK	(SIZE_ROM)
-#define START_HEAP	(SIZE_ROM + SIZE_STACK)
+
+#define SPY_VARIANTS 7 /* interpreter loops, see execute.h */
+#define SPY_OPCODES 0x100
+#define SPY_MAGIC 0x5950535F /* "_SPY", starts every .spyb */
+#define SPY_SYMBOLMAGIC 0x534D5953 /* "SYMS", ends the symbol table of a .spyb */
+#define SPY_LINEMAGIC 0x454E494C /* "LINE", ends the line table of a .spyb */
+#define SPY_UNBOUNDED UINT64_MAX /* stack use of recursive code, see Spy_verify */
+#define SPY_UNLIMITED INT64_MAX /* budget of a run that never yields, see Spy_resume */
 
 typedef struct SpyState SpyState;
+typedef struct SpyProgram SpyProgram;
 typedef struct SpyCFunction SpyCFunction;
-typedef struct SpyMemoryChunk SpyMemoryChunk;
+typedef struct SpyFunction SpyFunction;
+typedef struct SpyJitBlock SpyJitBlock;
+typedef struct SpyProfile SpyProfile;
+typedef struct SpyCallGraph SpyCallGraph;
+typedef struct SpySampler SpySampler;
+typedef struct SpyAllocSites SpyAllocSites;
+typedef struct SpySnapshot SpySnapshot;
+typedef struct SpyCoroutine SpyCoroutine;
+typedef struct SpyIO SpyIO;
+typedef struct SpySymbol SpySymbol;
+typedef struct SpyLocation SpyLocation;
+typedef union SpyCode SpyCode;
+
+/* one cell of pre-decoded code, an instruction is its handler cell
+ * followed by one cell per operand */
+union SpyCode {
+	const void*		handler;
+	int64_t			i;
+	double			f;
+	const SpyCode*	target; /* pre-resolved jump target */
+};
 
 
 struct SpyCFunction {
 	const char*		identifier;
+	uint32_t		hash;
 	uint32_t		(*function)(SpyState*);
-	SpyCFunction*	next;
+	int32_t			results; /* values pushed, SPY_ANYRESULTS if unknown */
+	int64_t			bound_index; /* index into SpyState.c_bound, -1 if not bound */
+	SpyCFunction*	next; /* next entry in the same hash bucket */
 };
 
-struct SpyMemoryChunk {
-	size_t			pages;
-	uint8_t*		absolute_address;
-	uint64_t		vm_address;
-	SpyMemoryChunk*	next;
-	SpyMemoryChunk*	prev;
+/* a function name from the .spyb symbol table */
+struct SpySymbol {
+	uint32_t		offset; /* code offset of the function */
+	const char*		name;
 };
 
+/* where a piece of code came from, see Spy_locate */
+struct SpyLocation {
+	uint32_t		offset; /* code offset of the instruction */
+	const char*		file; /* NULL if the bytecode has no line table */
+	uint32_t		line;
+	const char*		function; /* NULL outside of named functions */
+};
+
+/* what the verifier learned about a function */
+struct SpyFunction {
+	uint32_t		entry; /* code offset */
+	uint32_t		nargs; /* fewest arguments any CALL passes */
+	int32_t			results; /* 1 for IRET/FRET, 0 for VRET, -1 if it never returns */
+	uint32_t		max_depth; /* most stack slots in use above bp */
+	uint64_t		max_stack; /* bytes above bp including callees, or SPY_UNBOUNDED */
+};
+
+/* the registers of a coroutine that isn't running and who resumed it.
+ * coroutines keep theirs at the bottom of their own stack in VM memory,
+ * the main stack in SpyState.main, see coroutine.c.  addresses are VM
+ * addresses */
+struct SpyCoroutine {
+	uint64_t		magic;
+	uint64_t		block; /* heap block holding the coroutine */
+	uint64_t		end; /* top of its stack, the guard is right above it */
+	uint64_t		caller; /* coroutine that resumed it, 0 for the main stack */
+	uint64_t		status; /* COROUTINE_FRESH and on, see coroutine.h */
+	uint64_t		ip; /* cell it goes on at */
+	uint64_t		sp;
+	uint64_t		bp;
+};
+
+/* an executable mapping holding JIT compiled code */
+struct SpyJitBlock {
+	void*			code;
+	size_t			size;
+	SpyJitBlock*	next;
+};
+
+/* what the profiling loop measured */
+struct SpyProfile {
+	const char*		output; /* file the profile is written to */
+	uint8_t*		ops; /* cell index -> opcode */
+	uint64_t		counts[SPY_OPCODES];
+	uint64_t		ticks[SPY_OPCODES]; /* clock ticks until the next instruction started */
+	uint64_t		(*pairs)[SPY_OPCODES]; /* [previous][opcode] */
+	uint64_t		overhead; /* ticks one clock reading takes */
+};
+
+/* a loaded .spyb, see Spy_load.  it only holds what every run of the
+ * program shares, any number of states can run it one after another or
+ * side by side.  the cells of an interpreter variant are built the first
+ * time a state runs in it, everything else is done by Spy_load and the
+ * first Spy_verify */
+struct SpyProgram {
+	char*			filename;
+	uint8_t*		file; /* the whole .spyb, mapped privately */
+	size_t			file_size;
+	const uint8_t*	rom; /* mapped read-only at START_ROM in every state, see Spy_mapROM */
+	size_t			rom_size;
+	size_t			rom_mapped; /* rom_size in whole pages */
+	int				rom_fd; /* memory file holding the ROM pages, -1 if there is none */
+	uint8_t*		bytecode; /* CCALLs are rewritten into NCALLs, see Spy_importCFunctions */
+	size_t			bytecode_size;
+	SpyCode*		codes[SPY_VARIANTS]; /* cells per variant, built on first use */
+	size_t			code_size; /* in cells */
+	uint32_t*		code_map; /* code byte offset -> cell index */
+	uint32_t*		cell_offsets; /* cell index -> offset of the instruction, see Spy_mapCells */
+	const char**	imports; /* C functions the code calls, NCALL's first operand indexes this */
+	int32_t*		import_results; /* the result counts the program was verified with */
+	size_t			nimports;
+	SpyFunction*	functions; /* sorted by entry, see Spy_verify */
+	size_t			function_count;
+	uint64_t		stack_bound; /* stack bytes above the entry bp, or SPY_UNBOUNDED */
+	uint8_t			checked; /* Spy_verify has run */
+	uint8_t			verified; /* and found the code safe to run without checks */
+	SpySymbol*		symbols; /* sorted by offset */
+	size_t			symbol_count;
+	const uint8_t*	lines; /* line table rows, see Assembler_addLine */
+	size_t			lines_size;
+	const char**	files; /* source files the line table refers to */
+	uint32_t		file_count;
+	pthread_mutex_t	lock; /* held while building codes or verifying */
+};
+
+/* one run of a program: its memory, registers and C functions */
 struct SpyState {
-	size_t			static_memory_size;
-	uint8_t*		static_memory;
-	uint8_t*		bytecode;
-	uint8_t*		memory;
-	const uint8_t*	ip;
+	SpyProgram*		program;
+	uint8_t*		memory; /* reserved, made accessible as it's used, see Spy_setLimits */
+	uint64_t		heap_start; /* VM address of the heap, the stack guard is right below it */
+	size_t			heap_size; /* most bytes of heap */
+	size_t			stack_committed; /* accessible bytes from START_STACK */
+	size_t			heap_committed; /* accessible bytes from heap_start, see heap.c */
+	SpyCode*		code; /* cells of the running interpreter variant */
+	uint32_t		start; /* cell the next run starts at, see Spy_callFunction */
+	uint8_t			verified; /* this run may skip checks, see Spy_prepare */
+	int64_t			budget; /* instructions left before the run yields, see Spy_resume */
+	uint32_t		jit_threshold; /* calls or back-edges before code is compiled, 0 disables the JIT */
+	const void**	jit_entry; /* native code per cell, see jit.c */
+	uint32_t*		jit_counts; /* calls or back-edges per cell */
+	uint32_t		jit_depth; /* native code nested on the C stack */
+	void*			jit_trampoline;
+	SpyJitBlock*	jit_blocks;
+	size_t			jit_regions;
+	size_t			jit_bytes;
+	SpyProfile*		profile; /* NULL unless SPY_PROFILE */
+	SpyCallGraph*	callgraph; /* NULL unless SPY_CALLGRAPH */
+	SpySampler*		sampler; /* NULL unless sampling, see Spy_newSampler */
+	SpyAllocSites*	alloc_sites; /* NULL unless SPY_ALLOCSITES */
+	SpySnapshot*	snapshot; /* NULL unless SPY_SNAPSHOT, see Spy_newSnapshot */
+	FILE*			output; /* the program's standard output, stdout unless the host changes it */
+	char*			output_buffer; /* what print and println wrote that 'output' doesn't have yet */
+	size_t			output_size;
+	size_t			output_used;
+	uint8_t			output_flush; /* SPY_FLUSH... */
+	uint64_t		coroutine; /* VM address of the running coroutine, 0 on the main stack */
+	uint64_t		coroutine_floor; /* the coroutine Spy_callFunction was called on, it can't yield */
+	size_t			coroutines; /* not freed yet */
+	SpyCoroutine	main; /* the main stack while a coroutine runs */
+	uint8_t*		stack_end; /* guard of the stack in use, for compiled code */
+	SpyIO*			io; /* NULL until the program starts asynchronous I/O, see io.c */
+	const SpyCode*	ip;
 	uint8_t*		sp;
 	uint8_t*		bp;
 	uint32_t		option_flags;
 	uint32_t		runtime_flags;
-	SpyCFunction*	c_functions;
-	SpyMemoryChunk*	memory_chunks;
+	SpyCFunction**	c_functions; /* hash buckets */
+	size_t			c_buckets;
+	size_t			c_count;
+	uint32_t		(**c_bound)(SpyState*); /* per import of the program, see NCALL */
 };
 
-SpyState*	Spy_newState(uint32_t);
+SpyProgram*	Spy_load(const char*);
+void		Spy_freeProgram(SpyProgram*);
+SpyState*	Spy_newState(SpyProgram*, uint32_t);
+void		Spy_setLimits(SpyState*, size_t, size_t);
+void		Spy_setOutput(SpyState*, FILE*, size_t);
+void		Spy_write(SpyState*, const char*, size_t);
+void		Spy_flushOutput(SpyState*);
+int			Spy_commitHeap(SpyState*, uint64_t);
+void		Spy_freeState(SpyState*);
+uint32_t	Spy_callFunction(SpyState*, const char*, const char*, ...);
 void		Spy_log(SpyState*, const char*, ...);
 void		Spy_crash(SpyState*, const char*, ...);
+void		Spy_exit(SpyState*, int);
+int			Spy_protect(void (*)(void*), void*);
 void		Spy_dumpStack(SpyState*);
 void		Spy_dumpHeap(SpyState*);
 
@@ -65,8 +245,8 @@ void		Spy_pushInt(SpyState*, int64_t);
 int64_t 	Spy_popInt(SpyState*);
 void		Spy_saveInt(SpyState*, uint8_t*, int64_t);
 void		Spy_saveFloat(SpyState*, uint8_t*, double);
-uint64_t	Spy_readInt32(SpyState*);
-uint64_t	Spy_readInt64(SpyState*);
+int64_t		Spy_readInt(SpyState*);
+const SpyCode*	Spy_readTarget(SpyState*);
 
 void		Spy_pushPointer(SpyState*, void*);
 void*		Spy_popPointer(SpyState*);
@@ -80,7 +260,27 @@ char*		Spy_popString(SpyState*);
 
 uint8_t*	Spy_popRaw(SpyState*);
 
-void		Spy_pushC(SpyState*, const char*, uint32_t (*)(SpyState*));
-void		Spy_execute(const char*, uint32_t, int, char**);
+void		Spy_pushC(SpyState*, const char*, uint32_t (*)(SpyState*), int32_t);
+SpyCFunction*	Spy_findC(SpyState*, const char*);
+size_t		Spy_instructionSize(const SpyProgram*, const uint8_t*);
+const char*	Spy_functionName(SpyState*, uint32_t);
+void		Spy_mapCells(SpyProgram*);
+void		Spy_locate(SpyState*, const SpyCode*, SpyLocation*);
+void		Spy_locateOffset(SpyState*, uint32_t, SpyLocation*);
+void		Spy_startProgram(SpyState*, int, char**);
+int			Spy_resume(SpyState*, int64_t);
+void		Spy_preempt(SpyState*);
+void		Spy_runProgram(SpyState*, int, char**);
+int			Spy_execute(const char*, uint32_t, uint32_t, uint32_t, size_t, size_t, size_t, int, char**);
+
+/* takes 'n' instructions off S's budget and returns what's left, the run
+ * yields once it's below 0.  Spy_preempt stores to the budget from other
+ * threads, the rare store that lands between this load and store is lost */
+static inline int64_t
+Spy_charge(SpyState* S, int64_t n) {
+	int64_t left = __atomic_load_n(&S->budget, __ATOMIC_RELAXED) - n;
+	__atomic_store_n(&S->budget, left, __ATOMIC_RELAXED);
+	return left;
+}
 
 #endif
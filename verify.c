@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "verify.h"
+#include "assembler.h"
+
+/* checks the loaded bytecode before it runs.  malformed code (truncated
+ * instructions, invalid opcodes, jumps that don't land on an instruction)
+ * crashes, nothing can run it safely.  code that is well formed but whose
+ * stack use can't be proven (unbalanced joins, computed jumps, C functions
+ * without a fixed result count) is reported by returning the reason, it
+ * still runs in the checked interpreter.  code that passes sets
+ * P->verified and may run without any run time checks in states whose
+ * stack Spy_verifyStack accepts.
+ *
+ * every CALL target and the entry point at offset 0 start a function.  a
+ * function's stack depth is counted in slots above its bp and must be the
+ * same on every path reaching an instruction.  'entry_args' is the number
+ * of slots the entry code can read with IARG (argc and the argv pointers).
+ * S->program->functions receives what was learned about each function */
+const char*
+Spy_verify(SpyState* S, uint32_t entry_args) {
+	Verifier V;
+	const uint8_t* code = S->program->bytecode;
+	const size_t size = S->program->bytecode_size;
+	uint64_t* bounds;
+	int ok = 1;
+
+	memset(&V, 0, sizeof(V));
+	V.S = S;
+	V.starts = (uint8_t *)calloc(size + 1, 1);
+	V.depth = (int32_t *)malloc((size + 1) * sizeof(int32_t));
+	V.stamp = (uint32_t *)calloc(size + 1, sizeof(uint32_t));
+	V.work = (uint32_t *)malloc((size + 1) * sizeof(uint32_t));
+	if (!V.starts || !V.depth || !V.stamp || !V.work) Spy_crash(S, "Out of memory\n");
+	for (size_t i = 0; i < S->program->nimports; i++) {
+		S->program->import_results[i] = Spy_findC(S, S->program->imports[i])->results;
+	}
+
+	/* instruction boundaries, every operand must be inside the code.  the
+	 * passes below only look at boundaries, so they can trust the table */
+	for (size_t at = 0; at < size; at += Spy_instructionSize(S->program, &code[at])) {
+		if (!instructions[code[at]].name) {
+			Spy_crash(S, "invalid opcode 0x%02X at code offset %zu", code[at], at);
+		}
+		if (at + Spy_instructionSize(S->program, &code[at]) > size) {
+			Spy_crash(S, "truncated instruction at code offset %zu", at);
+		}
+		V.starts[at] = 1;
+	}
+
+	/* jump targets and functions.  the end of the code is a valid target,
+	 * running into it halts */
+	V.functions = (SpyFunction *)malloc(sizeof(SpyFunction));
+	if (!V.functions) Spy_crash(S, "Out of memory\n");
+	V.functions[0].entry = 0;
+	V.functions[0].nargs = entry_args;
+	V.nfunctions = 1;
+	for (size_t at = 0; at < size; at += Spy_instructionSize(S->program, &code[at])) {
+		const AssemblerInstruction* ins = &instructions[code[at]];
+		for (int i = 0; i < 4 && ins->operands[i] != NO_OPERAND; i++) {
+			if (ins->operands[i] == _ADDR32) {
+				uint32_t target = (uint32_t)Verifier_operand(&code[at], i);
+				if (target > size || (target < size && !V.starts[target])) {
+					Spy_crash(S, "invalid jump target %u at code offset %zu", target, at);
+				}
+			}
+		}
+		if (code[at] == 0x16) { /* CALL */
+			uint32_t target = (uint32_t)Verifier_operand(&code[at], 0);
+			uint32_t nargs = (uint32_t)Verifier_operand(&code[at], 1);
+			SpyFunction* f = Verifier_findFunction(&V, target);
+			if (f) {
+				if (nargs < f->nargs) f->nargs = nargs;
+				continue;
+			}
+			V.functions = (SpyFunction *)realloc(V.functions, (V.nfunctions + 1) * sizeof(SpyFunction));
+			if (!V.functions) Spy_crash(S, "Out of memory\n");
+			/* keep them sorted by entry */
+			size_t i = V.nfunctions++;
+			while (i > 0 && V.functions[i - 1].entry > target) {
+				V.functions[i] = V.functions[i - 1];
+				i--;
+			}
+			V.functions[i].entry = target;
+			V.functions[i].nargs = nargs;
+		}
+	}
+	for (size_t i = 0; i < V.nfunctions; i++) {
+		V.functions[i].results = -1;
+		V.functions[i].max_depth = 0;
+		V.functions[i].max_stack = 0;
+	}
+
+	/* how every function returns, CALL's stack effect depends on it */
+	for (size_t i = 0; ok && i < V.nfunctions; i++) {
+		ok = Verifier_findReturns(&V, i);
+	}
+	if (ok && V.functions[0].entry == 0 && V.functions[0].results >= 0) {
+		ok = Verifier_fail(&V, "the entry code returns");
+	}
+
+	/* stack depths */
+	for (size_t i = 0; ok && i < V.nfunctions; i++) {
+		ok = Verifier_walkFunction(&V, i);
+	}
+
+	/* stack bounds through the call graph */
+	if (ok) {
+		bounds = (uint64_t *)calloc(V.nfunctions, sizeof(uint64_t));
+		if (!bounds) Spy_crash(S, "Out of memory\n");
+		for (size_t i = 0; i < V.nfunctions; i++) {
+			Verifier_stackBound(&V, i, bounds);
+		}
+		free(bounds);
+	}
+
+	free(V.starts);
+	free(V.depth);
+	free(V.stamp);
+	free(V.work);
+	free(V.calls);
+	free(S->program->functions);
+	S->program->functions = V.functions;
+	S->program->function_count = V.nfunctions;
+	S->program->stack_bound = ok ? V.functions[0].max_stack : SPY_UNBOUNDED;
+	S->program->checked = 1;
+	S->program->verified = ok;
+	if (ok) return NULL;
+
+	static __thread char error[sizeof(V.error)];
+	memcpy(error, V.error, sizeof(error));
+	return error;
+}
+
+/* whether S can skip stack checks running a verified program.  stacks
+ * differ between states, see Spy_setLimits.  if the stack might overflow,
+ * it's only caught when no single instruction can move sp past the guard.
+ * returns why not, NULL if it can */
+const char*
+Spy_verifyStack(SpyState* S, uint32_t entry_args) {
+	const SpyProgram* P = S->program;
+	static __thread char error[sizeof(((Verifier *)0)->error)];
+	if (P->stack_bound != SPY_UNBOUNDED &&
+		START_STACK + 2 + (entry_args + 3) * 8 + P->stack_bound <= S->heap_start - SIZE_GUARD) {
+		return NULL;
+	}
+	for (size_t i = 0; i < P->function_count; i++) {
+		if ((P->functions[i].max_depth + 3) * 8 >= SIZE_GUARD) {
+			snprintf(error, sizeof(error), "the frame of the function at code offset %u is larger than the stack guard", P->functions[i].entry);
+			return error;
+		}
+	}
+	return NULL;
+}
+
+static int
+Verifier_fail(Verifier* V, const char* format, ...) {
+	va_list list;
+	va_start(list, format);
+	vsnprintf(V->error, sizeof(V->error), format, list);
+	va_end(list);
+	return 0;
+}
+
+/* reads operand n of the instruction at 'ins' */
+static int64_t
+Verifier_operand(const uint8_t* ins, int n) {
+	const AssemblerInstruction* info = &instructions[*ins];
+	const uint8_t* at = ins + 1;
+	for (int i = 0; i < n; i++) {
+		at += info->operands[i] == _INT32 || info->operands[i] == _ADDR32 ? 4 : 8;
+	}
+	if (info->operands[n] == _INT32 || info->operands[n] == _ADDR32) {
+		return *(uint32_t *)at;
+	}
+	return *(int64_t *)at;
+}
+
+static SpyFunction*
+Verifier_findFunction(Verifier* V, uint32_t entry) {
+	size_t low = 0;
+	size_t high = V->nfunctions;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (V->functions[mid].entry == entry) return &V->functions[mid];
+		if (V->functions[mid].entry < entry) low = mid + 1;
+		else high = mid;
+	}
+	return NULL;
+}
+
+/* queues 'at' for walking with the given stack depth.  fails when another
+ * path already reached it with a different depth */
+static int
+Verifier_visit(Verifier* V, uint32_t stamp, uint32_t at, int32_t depth) {
+	if (at >= V->S->program->bytecode_size) {
+		return 1; /* halts */
+	}
+	if (V->stamp[at] == stamp) {
+		if (V->depth[at] != depth) {
+			return Verifier_fail(V, "stack depth at code offset %u is %d on one path and %d on another", at, V->depth[at], depth);
+		}
+		return 1;
+	}
+	V->stamp[at] = stamp;
+	V->depth[at] = depth;
+	V->work[V->nwork++] = at;
+	return 1;
+}
+
+/* walks everything reachable from function f's entry without following
+ * calls, recording whether it returns a value */
+static int
+Verifier_findReturns(Verifier* V, uint32_t f) {
+	const uint8_t* code = V->S->program->bytecode;
+	const uint32_t stamp = f * 2 + 1;
+	SpyFunction* func = &V->functions[f];
+	V->nwork = 0;
+	Verifier_visit(V, stamp, func->entry, 0);
+	while (V->nwork > 0) {
+		uint32_t at = V->work[--V->nwork];
+		uint32_t next = at + Spy_instructionSize(V->S->program, &code[at]);
+		int32_t results = -1;
+		switch (code[at]) {
+			case 0x00: /* NOOP */
+				continue;
+			case 0x17: /* IRET */
+			case 0x23: /* FRET */
+				results = 1;
+				break;
+			case 0x33: /* VRET */
+				results = 0;
+				break;
+			case 0x37: /* CJNZ */
+			case 0x38: /* CJZ */
+			case 0x39: /* CJMP */
+				return Verifier_fail(V, "computed jump at code offset %u", at);
+			case 0x48: /* CONEW */
+			case 0x49: /* RESUME */
+			case 0x4A: /* YIELD */
+				return Verifier_fail(V, "coroutine at code offset %u, it switches stacks", at);
+			case 0x15: /* JMP */
+				Verifier_visit(V, stamp, (uint32_t)Verifier_operand(&code[at], 0), 0);
+				continue;
+			case 0x13: /* JNZ */
+			case 0x14: /* JZ */
+				Verifier_visit(V, stamp, (uint32_t)Verifier_operand(&code[at], 0), 0);
+				break;
+			case 0x46: /* ILLTJZ */
+			case 0x47: /* ILCLTJZ */
+				Verifier_visit(V, stamp, (uint32_t)Verifier_operand(&code[at], 2), 0);
+				break;
+		}
+		if (results >= 0) {
+			if (func->results >= 0 && func->results != results) {
+				return Verifier_fail(V, "the function at code offset %u returns both with and without a value", func->entry);
+			}
+			func->results = results;
+			continue;
+		}
+		Verifier_visit(V, stamp, next, 0);
+	}
+	return 1;
+}
+
+/* follows every path through function f, tracking the stack depth */
+static int
+Verifier_walkFunction(Verifier* V, uint32_t f) {
+	SpyState* S = V->S;
+	const uint8_t* code = S->program->bytecode;
+	const uint32_t stamp = f * 2 + 2;
+	SpyFunction* func = &V->functions[f];
+
+	/* slots 1 to 'end' above bp must be in use, locals live there */
+#define LOCALS(end) \
+	if ((int64_t)(end) > depth) { \
+		return Verifier_fail(V, "%s at code offset %u reaches outside the stack", ins->name, at); \
+	}
+
+	V->nwork = 0;
+	Verifier_visit(V, stamp, func->entry, 0);
+	while (V->nwork > 0) {
+		uint32_t at = V->work[--V->nwork];
+		const AssemblerInstruction* ins = &instructions[code[at]];
+		uint32_t next;
+		int64_t depth = V->depth[at];
+		if (!ins->name) {
+			Spy_crash(S, "invalid opcode 0x%02X at code offset %u", code[at], at);
+		}
+		next = at + Spy_instructionSize(S->program, &code[at]);
+		int64_t a = ins->operands[0] != NO_OPERAND ? Verifier_operand(&code[at], 0) : 0;
+		int64_t b = ins->operands[1] != NO_OPERAND ? Verifier_operand(&code[at], 1) : 0;
+
+		if (ins->pops != VARIES) {
+			if (depth < ins->pops) {
+				return Verifier_fail(V, "stack underflow at code offset %u (%s)", at, ins->name);
+			}
+			depth += ins->pushes - ins->pops;
+		}
+
+		switch (code[at]) {
+			case 0x00: /* NOOP */
+			case 0x17: /* IRET */
+			case 0x23: /* FRET */
+			case 0x33: /* VRET */
+				continue;
+			case 0x16: /* CALL */
+			{
+				SpyFunction* callee = Verifier_findFunction(V, (uint32_t)a);
+				if (depth < b) {
+					return Verifier_fail(V, "stack underflow at code offset %u (CALL)", at);
+				}
+				if (V->ncalls == V->calls_capacity) {
+					V->calls_capacity = V->calls_capacity ? V->calls_capacity * 2 : 16;
+					V->calls = (VerifierCall *)realloc(V->calls, V->calls_capacity * sizeof(VerifierCall));
+					if (!V->calls) Spy_crash(S, "Out of memory\n");
+				}
+				V->calls[V->ncalls].caller = f;
+				V->calls[V->ncalls].callee = callee - V->functions;
+				V->calls[V->ncalls].depth = depth + 3;
+				V->ncalls++;
+				depth += (callee->results > 0 ? callee->results : 0) - b;
+				break;
+			}
+			case 0x43: /* NCALL, Spy_load rewrote every CCALL */
+			{
+				int32_t results = S->program->import_results[a];
+				if (results == SPY_ANYRESULTS) {
+					return Verifier_fail(V, "C function '%s' has no fixed result count", S->program->imports[a]);
+				}
+				if (depth < b) {
+					return Verifier_fail(V, "stack underflow at code offset %u (NCALL)", at);
+				}
+				depth += results - b;
+				break;
+			}
+			case 0x29: /* RES */
+				depth += a;
+				break;
+			case 0x3A: /* ILNSAVE */
+				if (depth < b) {
+					return Verifier_fail(V, "stack underflow at code offset %u (ILNSAVE)", at);
+				}
+				depth -= b;
+				LOCALS(a + b);
+				break;
+			case 0x3B: /* ILNLOAD */
+				LOCALS(a + b);
+				depth += b;
+				break;
+			case 0x24: /* ILLOAD */
+			case 0x2A: /* LEA */
+			case 0x3C: /* FLLOAD */
+			case 0x45: /* ILCINC */
+				LOCALS(a + 1 + 1); /* already pushed */
+				break;
+			case 0x25: /* ILSAVE */
+			case 0x3D: /* FLSAVE */
+			case 0x44: /* ILINC */
+			case 0x47: /* ILCLTJZ */
+				LOCALS(a + 1);
+				break;
+			case 0x46: /* ILLTJZ */
+				LOCALS(a + 1);
+				LOCALS(b + 1);
+				break;
+			case 0x26: /* IARG */
+				if (a >= func->nargs) {
+					return Verifier_fail(V, "IARG %lld at code offset %u, the function is passed %u argument%s", (long long)a, at, func->nargs, func->nargs == 1 ? "" : "s");
+				}
+				break;
+			case 0x3E: /* FTOI */
+			case 0x3F: /* ITOF */
+				if (a >= depth) {
+					return Verifier_fail(V, "%s at code offset %u reaches outside the stack", ins->name, at);
+				}
+				break;
+		}
+
+		if (depth > INT32_MAX / 8) {
+			return Verifier_fail(V, "stack depth overflows at code offset %u", at);
+		}
+		if ((uint32_t)depth > func->max_depth) {
+			func->max_depth = depth;
+		}
+
+		switch (code[at]) {
+			case 0x15: /* JMP */
+				if (!Verifier_visit(V, stamp, (uint32_t)a, depth)) return 0;
+				continue;
+			case 0x13: /* JNZ */
+			case 0x14: /* JZ */
+				if (!Verifier_visit(V, stamp, (uint32_t)a, depth)) return 0;
+				break;
+			case 0x46: /* ILLTJZ */
+			case 0x47: /* ILCLTJZ */
+				if (!Verifier_visit(V, stamp, (uint32_t)Verifier_operand(&code[at], 2), depth)) return 0;
+				break;
+		}
+		if (!Verifier_visit(V, stamp, next, depth)) return 0;
+	}
+#undef LOCALS
+	return 1;
+}
+
+/* bytes of stack function f can use above its bp, callees included, into
+ * its max_stack.  SPY_UNBOUNDED if it can recurse.  bounds holds one slot
+ * count per function, plus one: 0 not seen yet, UINT64_MAX in progress */
+static uint64_t
+Verifier_stackBound(Verifier* V, uint32_t f, uint64_t* bounds) {
+	SpyFunction* func = &V->functions[f];
+	uint64_t bound = func->max_depth;
+	size_t i = 0;
+	size_t high = V->ncalls;
+	if (bounds[f] == UINT64_MAX) {
+		return SPY_UNBOUNDED; /* recursion */
+	}
+	if (bounds[f]) {
+		return func->max_stack;
+	}
+	bounds[f] = UINT64_MAX;
+	/* calls were recorded function by function, find f's first */
+	while (i < high) {
+		size_t mid = (i + high) / 2;
+		if (V->calls[mid].caller < f) i = mid + 1;
+		else high = mid;
+	}
+	for (; i < V->ncalls && V->calls[i].caller == f; i++) {
+		uint64_t callee = Verifier_stackBound(V, V->calls[i].callee, bounds);
+		if (callee == SPY_UNBOUNDED) {
+			bound = SPY_UNBOUNDED;
+			break;
+		}
+		if (V->calls[i].depth + callee / 8 > bound) {
+			bound = V->calls[i].depth + callee / 8;
+		}
+	}
+	bounds[f] = bound == SPY_UNBOUNDED ? bound : bound + 1;
+	func->max_stack = bound == SPY_UNBOUNDED ? bound : bound * 8;
+	return func->max_stack;
+}
@@ -0,0 +1,41 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "spyre.h"
+
+typedef struct Verifier Verifier;
+typedef struct VerifierCall VerifierCall;
+
+/* a CALL found while walking a function */
+struct VerifierCall {
+	uint32_t		caller; /* index into Verifier.functions */
+	uint32_t		callee;
+	uint32_t		depth; /* slots in use by the caller once the call frame is pushed */
+};
+
+struct Verifier {
+	SpyState*		S;
+	uint8_t*		starts; /* 1 at every code offset that starts an instruction */
+	int32_t*		depth; /* stack slots above bp before each instruction */
+	uint32_t*		stamp; /* function (plus one) that 'depth' is valid for */
+	uint32_t*		work; /* offsets waiting to be walked */
+	size_t			nwork;
+	SpyFunction*	functions;
+	size_t			nfunctions;
+	VerifierCall*	calls;
+	size_t			ncalls;
+	size_t			calls_capacity;
+	char			error[256];
+};
+
+const char* Spy_verify(SpyState*, uint32_t);
+const char* Spy_verifyStack(SpyState*, uint32_t);
+static int Verifier_fail(Verifier*, const char*, ...);
+static int64_t Verifier_operand(const uint8_t*, int);
+static SpyFunction* Verifier_findFunction(Verifier*, uint32_t);
+static int Verifier_visit(Verifier*, uint32_t, uint32_t, int32_t);
+static int Verifier_findReturns(Verifier*, uint32_t);
+static int Verifier_walkFunction(Verifier*, uint32_t);
+static uint64_t Verifier_stackBound(Verifier*, uint32_t, uint64_t*);
+
+#endif